@@ -0,0 +1,26 @@
+#include <iostream>
+#include <fstream>
+
+#include "libautomusic.h"
+
+#define MODEL_PATH "../models/"
+
+int main(int argc, char *argv[])
+{
+  if (libam_require_version(1,0,0))
+    {
+      std::cerr << "libautomusic version mismatch." << std::endl;
+      return 1;
+    }
+
+  const char *modelPath = argc > 1 ? argv[1] : MODEL_PATH;
+  const char *filename = argc > 2 ? argv[2] : 0l;
+
+  std::cout << "libam_compile_models()" << std::endl;
+  if ( int err = libam_compile_models(modelPath, filename) )
+    {
+      std::cerr << "Failed on libam_compile_models(): err = " << err << "." << std::endl;
+      return 1;
+    }
+  return 0;
+}
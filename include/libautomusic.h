@@ -15,6 +15,7 @@
 #ifndef LIBAUTOMUSIC_H
 #define LIBAUTOMUSIC_H
 
+#include <stddef.h>
 #include "exportdecl.h"
 
 C_DECLS
@@ -31,7 +32,178 @@ C_DECLS
 #define RC_LOADING_SAMPLES (6)
 #define RC_UNSUPPORTED (7)
 
+/**@def KNOWLEDGE_ROLE_
+ * @brief Roles of knowledge entries, to filter the models to load
+ */
+#define KNOWLEDGE_ROLE_RHYTHM (1)
+#define KNOWLEDGE_ROLE_CHORD (2)
+#define KNOWLEDGE_ROLE_TIMBRE (4)
+
+/**@def LIBAM_LOG_
+ * @brief Levels of the messages passed to the log callback
+ */
+#define LIBAM_LOG_ERROR (0)
+#define LIBAM_LOG_WARNING (1)
+#define LIBAM_LOG_INFO (2)
+
 typedef struct am_context_s am_context_t;
+typedef struct am_model_s am_model_t;
+
+/**
+ * @brief Options of loading models.
+ * Initialize by libam_load_options_init() before setting the fields.
+ */
+typedef struct am_load_options_s
+{
+  int threads; /* Number of worker threads parsing bank sources. 0 = number of processors, 1 = serial. */
+
+  /*
+   * Filter of the models, the banks not matching are skipped at loading.
+   * A bank is loaded if it has any of the characters, any of the genres and any of the roles.
+   */
+  const int *characters;  /* Music characters. NULL = all. */
+  int character_count;
+  const int *genres;      /* Music genres. NULL = all. */
+  int genre_count;
+  int roles;              /* Mask of KNOWLEDGE_ROLE_*. 0 = all. */
+
+  /*
+   * Range of the bank sources to load, overriding index.meta. -1 = as index.meta.
+   * The bank sources are parsed if there is a range, as the compiled bank does not keep their indexes.
+   */
+  int index_start;
+  int index_end;
+  /*
+   * Nonzero = keep the compiled bank mapped and decode the pitches of a figure at its first use,
+   * which shortens the loading. It has no effect on the bank sources.
+   */
+  int lazy_pitchs;
+} am_load_options_t;
+
+/**
+ * @brief Parameters of a composition, to composite without an image.
+ * Initialize by libam_composition_params_init() before setting the fields.
+ */
+typedef struct am_composition_params_s
+{
+  int form_template_index;  /* Index of template of musical structure form. */
+  int beats;                /* Beats per bar, 3 or 4. */
+  int seed;                 /* Seed of all the random choices, the same parameters give the same composition. */
+  int character;            /* Music character, ranged from [0, 36). */
+  int genre;                /* Music genre. */
+  /*
+   * Position of the chord or timbre entry among the candidates, ranged from [0, 1].
+   * Negative = chosen randomly by the seed.
+   */
+  double chord_factor;
+  double timbre_factor;
+} am_composition_params_t;
+
+/**
+ * @brief Options of decoding an image to composite from.
+ * Initialize by libam_image_options_init() before setting the fields.
+ */
+typedef struct am_image_options_s
+{
+  /*
+   * Decode the image at 1/reduction of its resolution, 1, 2, 4 or 8.
+   * JPEG images are scaled down by the decoder itself, which is much cheaper than a full decoding.
+   * The features of the image hardly depend on its size, but the composition may differ from the one at full resolution.
+   */
+  int reduction;
+  int max_dimension;  /* Scale the decoded image down to this width and height at most. 0 = no limit. */
+} am_image_options_t;
+
+/**
+ * @brief A note of a composed form.
+ */
+typedef struct am_note_s
+{
+  int track;      /* Index of the track. */
+  int pitch;      /* MIDI note number. */
+  int velocity;   /* MIDI velocity. */
+  int start;      /* Position of the note on, in 64th notes from the beginning of the composition. */
+  int end;        /* Position of the note off, ditto. */
+} am_note_t;
+
+/**
+ * @brief A structure form composed in all the tracks, passed on by a progressive composition.
+ */
+typedef struct am_form_s
+{
+  int form_index;           /* Index of the form, in timeline order. */
+  int form_count;           /* Number of the forms of the composition. */
+  int begin;                /* First bar of the form. */
+  int end;                  /* Bar past the last one of the form. */
+  int track_count;          /* Number of the tracks. */
+  const int *timbres;       /* GM timbre of each track. */
+  const am_note_t *notes;   /* Notes of the form in all the tracks, sorted by their start. */
+  int note_count;
+} am_form_t;
+
+/**
+ * @brief Receiver of the forms of a progressive composition, @see libam_set_form_callback().
+ * The form and its notes are only valid during the call.
+ * The notes are final: they are the same as those of the form in the final composition.
+ * @param opaque The pointer given to libam_set_form_callback().
+ * @param form The form just composed.
+ * @return status code, nonzero = stop the composition, which returns this code.
+ */
+typedef int (*am_form_callback_t)(void *opaque, const am_form_t *form);
+
+/**
+ * @brief Receiver of the messages of the library.
+ * @param opaque The pointer given to libam_set_log_callback().
+ * @param level Level of the message. @see LIBAM_LOG_*
+ * @param message The message, without a line break.
+ */
+typedef void (*am_log_callback_t)(void *opaque, int level, const char *message);
+
+/**
+ * @brief Report of the loading of models.
+ */
+typedef struct am_load_report_s
+{
+  int compiled;           /* 1 = loaded from the compiled bank, 0 = from the bank sources */
+  double load_ms;         /* Wall time of the loading */
+  unsigned int file_count; /* Number of the files, @see libam_model_load_file_report() */
+
+  unsigned int entry_count;
+  unsigned int track_count;
+  unsigned int figure_count;
+  unsigned int chord_count;
+  unsigned int note_count;
+
+  /*
+   * Bytes allocated per structure type.
+   * The pitches decoded lazily are not counted, @see am_load_options_t::lazy_pitchs
+   */
+  size_t entry_bytes;
+  size_t track_bytes;
+  size_t figure_bytes;
+  size_t chord_bytes;
+  size_t pitch_bytes;
+  size_t value_bytes;     /* characters and genres */
+  size_t arena_bytes;     /* All the above, as allocated */
+  size_t arena_capacity;  /* Memory blocks holding the above */
+  size_t index_bytes;     /* Estimate of the lookup indexes */
+  size_t mapped_bytes;    /* The compiled bank kept mapped for the lazy pitches */
+  size_t resident_bytes;  /* Total footprint: arena_capacity + index_bytes + mapped_bytes */
+} am_load_report_t;
+
+/**
+ * @brief Report of a file read by the loading of models.
+ */
+typedef struct am_load_file_report_s
+{
+  const char *filename;   /* Valid until the model handle is reloaded or released */
+  int status;             /* @see RC_* */
+  double parse_ms;        /* Time to parse or decode the file */
+  unsigned int entry_count; /* 0 if the file was filtered out or failed */
+  unsigned int figure_count;
+  unsigned int note_count;
+  size_t bytes;           /* Allocated for the entries of the file */
+} am_load_file_report_t;
 
 /*
  * Exported functions
@@ -50,6 +222,122 @@ int LIBAM_EXPORT(libam_require_version)(int major, int minor, int revsion);
  */
 am_context_t *LIBAM_EXPORT(libam_create_context)(const char *modelPath);
 
+/**
+ * @brief Fill the options of loading models with default values.
+ * @param options Pointer to the target options.
+ */
+void LIBAM_EXPORT(libam_load_options_init)(am_load_options_t *options);
+
+/**
+ * @brief Create a context handle, loading the models with the given options.
+ * @param modelPath Indicates the path of models.
+ * @param options Options of loading models. NULL = default options.
+ * @return a pointer to the context memory.
+ */
+am_context_t *LIBAM_EXPORT(libam_create_context_ex)(const char *modelPath, const am_load_options_t *options);
+
+/**
+ * @brief Load the models once, to be shared read-only by many contexts.
+ * The model is reference counted, it is released after libam_free_model()
+ * and all the contexts created from it were released.
+ * @param modelPath Indicates the path of models.
+ * @param options Options of loading models. NULL = default options.
+ * @return a pointer to the model handle. NULL if failed.
+ */
+am_model_t *LIBAM_EXPORT(libam_create_model)(const char *modelPath, const am_load_options_t *options);
+
+/**
+ * @brief Create a context handle attached to a shared model.
+ * @param model Handle, a pointer to the model created by libam_create_model().
+ * @return a pointer to the context memory.
+ */
+am_context_t *LIBAM_EXPORT(libam_create_context_from_model)(am_model_t *model);
+
+/**
+ * @brief Release the model handle created by libam_create_model().
+ * Contexts created from the model remain valid.
+ * @param model Handle, a pointer to the model.
+ */
+void LIBAM_EXPORT(libam_free_model)(am_model_t *model);
+
+/**
+ * @brief Reload the models and publish them to all the contexts created from the model handle.
+ * The new models are loaded aside in the calling thread. Compositions in progress keep the models
+ * they started with, the following calls of libam_composite_by_image() use the new ones,
+ * and the previous models are released once no context uses them anymore.
+ * The current models are kept if the loading failed.
+ * @param model Handle, a pointer to the model created by libam_create_model().
+ * @param modelPath Indicates the path of models.
+ * @param options Options of loading models. NULL = default options.
+ * @return status code. @see RC_*
+ */
+int LIBAM_EXPORT(libam_reload_model)(am_model_t *model, const char *modelPath, const am_load_options_t *options);
+
+/**
+ * @brief Get the generation of the models, which starts from 1 and increases by each reload.
+ * @param model Handle, a pointer to the model created by libam_create_model().
+ * @return generation number.
+ */
+unsigned int LIBAM_EXPORT(libam_model_generation)(am_model_t *model);
+
+/**
+ * @brief Get the report of the loading of the current models.
+ * @param model Handle, a pointer to the model created by libam_create_model().
+ * @param report Pointer to the target report.
+ * @return status code. @see RC_*
+ */
+int LIBAM_EXPORT(libam_model_load_report)(am_model_t *model, am_load_report_t *report);
+
+/**
+ * @brief Get the report of a file read by the loading of the current models.
+ * The files are in the order of loading, the bank sources after a failed one are not reported.
+ * @param model Handle, a pointer to the model created by libam_create_model().
+ * @param index Index of the file, less than am_load_report_t::file_count.
+ * @param report Pointer to the target report.
+ * @return status code. @see RC_*
+ */
+int LIBAM_EXPORT(libam_model_load_file_report)(am_model_t *model, unsigned int index, am_load_file_report_t *report);
+
+/**
+ * @brief Set the receiver of the messages of the library, for all the contexts.
+ * Without a receiver, the warnings and errors are printed to stderr and the other messages dropped.
+ * The receiver may be called by several threads at once, possibly not the calling thread, and may call
+ * back into the library. A message logged while the receiver is replaced may still reach the previous one.
+ * @param callback Receiver of the messages. NULL = default.
+ * @param opaque Pointer passed to the callback.
+ */
+void LIBAM_EXPORT(libam_set_log_callback)(am_log_callback_t callback, void *opaque);
+
+/**
+ * @brief Compile the bank sources of models into a binary bank file,
+ * which is mapped and loaded by libam_create_context() in preference to the sources.
+ * @param modelPath Indicates the path of models.
+ * @param filename Path and filename of target file. NULL = "knowledge.bank.bin" in modelPath.
+ * @return status code. @see RC_*
+ */
+int LIBAM_EXPORT(libam_compile_models)(const char *modelPath, const char *filename);
+
+/**
+ * @brief Set the number of threads composing the tracks of the context concurrently.
+ * The composition is the same whatever the number of threads.
+ * The threads are started at the first composition needing them and kept until the context is freed.
+ * @param context Handle, a pointer to the context memory.
+ * @param threads Number of threads. 0 = number of processors, 1 = serial (default).
+ * @return status code. @see RC_*
+ */
+int LIBAM_EXPORT(libam_set_threads)(am_context_t *context, int threads);
+
+/**
+ * @brief Composite progressively in timeline order, passing on each form once it is composed in all the tracks,
+ * so that the output may start before the whole composition is done.
+ * The forms passed on are never changed afterwards, and the final composition is the same as without the callback.
+ * @param context Handle, a pointer to the context memory.
+ * @param callback Receiver of the forms, called by the compositing thread. NULL = composite all the forms at once (default).
+ * @param opaque Pointer passed to the callback.
+ * @return status code. @see RC_*
+ */
+int LIBAM_EXPORT(libam_set_form_callback)(am_context_t *context, am_form_callback_t callback, void *opaque);
+
 /**
  * @brief Start a process of composition by giving a image file.
  * @param context Handle, a pointer to the context memory.
@@ -60,6 +348,103 @@ am_context_t *LIBAM_EXPORT(libam_create_context)(const char *modelPath);
  */
 int LIBAM_EXPORT(libam_composite_by_image)(am_context_t *context, int form_template_index, int beats, const char *filename);
 
+/**
+ * @brief Fill the options of decoding an image with default values, i.e. at full resolution.
+ * @param options Pointer to the target options.
+ */
+void LIBAM_EXPORT(libam_image_options_init)(am_image_options_t *options);
+
+/**
+ * @brief Start a process of composition by giving an encoded image in memory, e.g. the content of a JPEG or PNG file.
+ * The image is decoded straight to grayscale.
+ * @param context Handle, a pointer to the context memory.
+ * @param form_template_index Index of template of musical structure form.
+ * @param beats Beats per bar.
+ * @param data Pointer to the encoded image.
+ * @param size Size of the encoded image in bytes.
+ * @param options Options of decoding the image. NULL = default options.
+ * @return status code. @see RC_*
+ */
+int LIBAM_EXPORT(libam_composite_by_image_buffer)(am_context_t *context, int form_template_index, int beats,
+                                                  const void *data, size_t size, const am_image_options_t *options);
+
+/**
+ * @brief Fill the parameters of composition with default values.
+ * @param params Pointer to the target parameters.
+ */
+void LIBAM_EXPORT(libam_composition_params_init)(am_composition_params_t *params);
+
+/**
+ * @brief Start a process of composition by giving all its parameters, without decoding any image.
+ * Unlike libam_composite_by_image(), nothing selected by the previous compositions of the context is avoided,
+ * so that the same parameters always give the same composition.
+ * @param context Handle, a pointer to the context memory.
+ * @param params Parameters of the composition.
+ * @return status code. @see RC_*
+ */
+int LIBAM_EXPORT(libam_composite_by_params)(am_context_t *context, const am_composition_params_t *params);
+
+/**
+ * @brief Get the layout of the last composition of the context.
+ * @param context Handle, a pointer to the context memory.
+ * @param track_count Pointer receiving the number of tracks.
+ * @param form_count Pointer receiving the number of structure forms of each track.
+ * @return status code. @see RC_*
+ */
+int LIBAM_EXPORT(libam_composition_layout)(am_context_t *context, int *track_count, int *form_count);
+
+/**
+ * @brief Recomposite a track of the last composition with other figures, e.g. new drums.
+ * All the other tracks are kept, only the velocities are processed over again.
+ * @param context Handle, a pointer to the context memory.
+ * @param track Index of the track, ranged from [0, track_count).
+ * @return status code. @see RC_*
+ */
+int LIBAM_EXPORT(libam_recomposite_track)(am_context_t *context, int track);
+
+/**
+ * @brief Recomposite a range of structure forms of the last composition, e.g. the chorus.
+ * All the other forms are kept as they are, and the other tracks of the recomposited forms only have their
+ * velocities processed over again.
+ * @param context Handle, a pointer to the context memory.
+ * @param track Index of the track, ranged from [0, track_count). Negative = all the tracks.
+ * @param form_begin Index of the first form to recomposite.
+ * @param form_end Index of the form past the last one to recomposite.
+ * @return status code. @see RC_*
+ */
+int LIBAM_EXPORT(libam_recomposite_forms)(am_context_t *context, int track, int form_begin, int form_end);
+
+/**
+ * @brief Extract the parameters of composition from an encoded image in memory, without compositing,
+ * so that they may be varied and given to libam_composite_by_params() or libam_composite_variations().
+ * The form template and the beats of params are left untouched.
+ * @param data Pointer to the encoded image.
+ * @param size Size of the encoded image in bytes.
+ * @param options Options of decoding the image. NULL = default options.
+ * @param params Pointer to the target parameters.
+ * @return status code. @see RC_*
+ */
+int LIBAM_EXPORT(libam_image_params)(const void *data, size_t size, const am_image_options_t *options, am_composition_params_t *params);
+
+/**
+ * @brief Composite many variations of one parameter set, differing in their seeds and factors.
+ * The candidate entries of the character and the genre are collected once and shared by all the variations,
+ * which are composited concurrently by the threads of the context, @see libam_set_threads().
+ * Variation i is the same as libam_composite_by_params() with seeds[i], chord_factors[i] and timbre_factors[i].
+ * @param context Handle, a pointer to the context memory, giving the models and the number of threads.
+ * @param params Parameters shared by the variations.
+ * @param seeds Array of the seeds of the variations. NULL = params->seed + i for variation i, wrapping around.
+ * @param chord_factors Array of the chord factors of the variations. NULL = params->chord_factor for all.
+ * @param timbre_factors Array of the timbre factors of the variations. NULL = params->timbre_factor for all.
+ * @param count Number of variations.
+ * @param variations Array receiving a new context per variation, to be output by libam_output_file()
+ * and freed by libam_free_context(). Nothing is returned on error.
+ * @return status code. @see RC_*
+ */
+int LIBAM_EXPORT(libam_composite_variations)(am_context_t *context, const am_composition_params_t *params,
+                                             const int *seeds, const double *chord_factors, const double *timbre_factors,
+                                             int count, am_context_t **variations);
+
 /**
  * @brief Output the result of composition to target file.
  * @param context Handle, a pointer to the context memory.
@@ -16,6 +16,7 @@
 #define LIBAUTOMUSIC_TYPEDEFS_H
 
 #include <stdint.h>
+#include <vector>
 
 namespace autocomp
 {
@@ -95,6 +96,11 @@ public:
   {}
   StructureForm(const StructureForm &form) : m_type(form.m_type), m_bars(form.m_bars), m_begin(form.m_begin), m_end(form.m_end)
   {}
+  StructureForm &operator=(const StructureForm &form)
+  {
+    m_type = form.m_type; m_bars = form.m_bars; m_begin = form.m_begin; m_end = form.m_end;
+    return *this;
+  }
 
   inline FormType type() const  { return m_type; }
   inline void setType(FormType type)    { m_type = type; }
@@ -122,6 +128,13 @@ public:
       chords(formChain.chords),
       figure(formChain.figure), offset(formChain.offset), key(formChain.key)
   {}
+  FormChainNode &operator=(const FormChainNode &formChain)
+  {
+    form = formChain.form;
+    chords = formChain.chords;
+    figure = formChain.figure; offset = formChain.offset; key = formChain.key;
+    return *this;
+  }
 public:
   StructureForm form;
   std::vector<ChordPair> chords;
@@ -130,9 +143,12 @@ public:
   int key;
 };
 
+typedef std::vector<FormChainNode> FormChain;
+
 class CompositionChainNode : public FormChainNode
 {
 public:
+  CompositionChainNode() {}
   CompositionChainNode(const FormChainNode &formChain) :
       FormChainNode(formChain)
   {}
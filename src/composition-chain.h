@@ -0,0 +1,70 @@
+/*
+ *  libautomusic (Library for Image-based Algorithmic Musical Composition)
+ *  Copyright (C) 2018, automusic.
+ *
+ *  THIS PROJECT IS FREE SOFTWARE; YOU CAN REDISTRIBUTE IT AND/OR
+ *  MODIFY IT UNDER THE TERMS OF THE GNU LESSER GENERAL PUBLIC LICENSE(GPL)
+ *  AS PUBLISHED BY THE FREE SOFTWARE FOUNDATION; EITHER VERSION 2.1
+ *  OF THE LICENSE, OR (AT YOUR OPTION) ANY LATER VERSION.
+ *
+ *  THIS PROJECT IS DISTRIBUTED IN THE HOPE THAT IT WILL BE USEFUL,
+ *  BUT WITHOUT ANY WARRANTY; WITHOUT EVEN THE IMPLIED WARRANTY OF
+ *  MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE.  SEE THE GNU
+ *  LESSER GENERAL PUBLIC LICENSE FOR MORE DETAILS.
+ */
+#ifndef COMPOSITION_CHAIN_H
+#define COMPOSITION_CHAIN_H
+
+#include <cstddef>
+#include <vector>
+
+#include "typedefs.h"
+
+namespace autocomp
+{
+
+/**
+ * @brief Chain nodes of all the tracks of a composition, stored contiguously track by track.
+ * The nodes are kept over the compositions and only reset, so that they reuse the memory of the previous one.
+ */
+class CompositionChain
+{
+public:
+  CompositionChain()
+    : m_trackCount(0), m_formCount(0) {}
+
+  void reset(std::size_t trackCount, const FormChain &forms)
+  {
+    m_trackCount = trackCount;
+    m_formCount = forms.size();
+    m_nodes.resize(m_trackCount * m_formCount);
+    for(std::size_t i=0; i < m_trackCount; i++)
+      for(std::size_t j=0; j < m_formCount; j++)
+        resetNode(i, j, forms[j]);
+  }
+  void clear()
+  {
+    m_trackCount = 0;
+    m_formCount = 0;
+  }
+  void resetNode(std::size_t track, std::size_t form, const FormChainNode &formChain)
+  {
+    CompositionChainNode &node = m_nodes[track * m_formCount + form];
+    static_cast<FormChainNode &>(node) = formChain;
+    node.pitch.clear();
+  }
+
+  inline std::size_t trackCount() const { return m_trackCount; }
+  inline std::size_t formCount() const { return m_formCount; }
+  inline CompositionChainNode *operator[](std::size_t track) { return m_nodes.data() + track * m_formCount; }
+  inline const CompositionChainNode *operator[](std::size_t track) const { return m_nodes.data() + track * m_formCount; }
+
+private:
+  std::vector<CompositionChainNode> m_nodes;
+  std::size_t m_trackCount;
+  std::size_t m_formCount;
+};
+
+}
+
+#endif
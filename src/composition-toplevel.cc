@@ -19,21 +19,86 @@
 #include "theory-structure.h"
 #include "theory-orchestration.h"
 #include "util-randomize.h"
+#include "util-parallel.h"
 #include "libautomusic.h"
 #include "composition-toplevel.h"
 
 namespace autocomp
 {
 
-CompositionToplevel::CompositionToplevel()
-    : m_knowledgeModel(new KnowledgeModel),
-      m_parameterGenerator(new ParameterGenerator(m_knowledgeModel)),
+/**
+ * @brief Create a composition attached to a loaded model.
+ * The model is shared read-only, and kept alive until the last composition using it is destroyed.
+ */
+CompositionToplevel::CompositionToplevel(const std::shared_ptr<const KnowledgeModel> &knowledgeModel)
+    : m_knowledgeModel(knowledgeModel),
+      m_parameterGenerator(new ParameterGenerator(m_knowledgeModel.get())),
       m_modelLibrary(new ModelLibrary),
-      m_rhythm_knowledge_entry(0l)
+      m_rhythm_knowledge_entry(0l),
+      m_pool(1),
+      m_formCallback(0l),
+      m_formOpaque(0l)
+{
+}
+
+CompositionToplevel::~CompositionToplevel()
+{
+  delete m_modelLibrary;
+  delete m_parameterGenerator;
+}
+
+/**
+ * @brief Attach the composition to another model, e.g. a newly published generation.
+ * Nothing selected from the previous model is kept, which is released if this was its last user.
+ */
+void CompositionToplevel::setKnowledgeModel(const std::shared_ptr<const KnowledgeModel> &knowledgeModel)
 {
+  m_parameterGenerator->setKnowledgeModel(knowledgeModel.get());
+  reset();
+  m_knowledgeModel = knowledgeModel;
+}
+
+/**
+ * @brief Forget the entries selected by the previous compositions, which are otherwise avoided by the next one.
+ */
+void CompositionToplevel::reset()
+{
+  m_parameterGenerator->reset();
+  m_rhythm_knowledge_entry = 0l;
+  m_melody_rhythm_array_entries.clear();
+  m_solo_rhythm_array_entries.clear();
+  m_figure_entries.clear();
+  m_figure_keys.clear();
+  m_exclude_rhythm_entries.clear();
+  m_exclude_figure_entries.clear();
+  m_timbre_knowledge_entries.clear();
+  clearComposition();
 }
 
 int CompositionToplevel::startup()
+{
+  /*
+   * A composition failed halfway is not to be recomposed.
+   */
+  if( int err = compose() )
+    {
+      clearComposition();
+      return err;
+    }
+  return 0;
+}
+
+/**
+ * @brief Forget the last composition, keeping the storage of its chain for the next one.
+ */
+void CompositionToplevel::clearComposition()
+{
+  m_compositionChain.clear();
+  m_composedPitchs.clear();
+  m_revisions.clear();
+}
+
+int CompositionToplevel::compose()
 {
   /*
    * Get global parameters from generator, i.e. key, scale, beats, chords, development structure and
@@ -47,30 +112,33 @@ int CompositionToplevel::startup()
   const std::vector<int> &figure_classes = m_parameterGenerator->figureClasses();
   int character = m_parameterGenerator->character();
   int genre = m_parameterGenerator->genre();
-  int beats = m_parameterGenerator->beats();
 
-  std::vector<const KnowledgeEntry *> candidate_knowledge_entries;
-  std::vector<const KnowledgeEntry *> secondary_candidate_knowledge_entries;
+  const std::vector<const KnowledgeEntry *> *primary_entries = 0l;
+  const std::vector<const KnowledgeEntry *> *secondary_entries = 0l;
 
-  if( int err = m_knowledgeModel->getKnowledgeEntry(candidate_knowledge_entries, character, genre) )
+  if( int err = m_knowledgeModel->getKnowledgeEntry(&primary_entries, character, genre) )
     return err;
-  if( int err = m_knowledgeModel->getKnowledgeEntry(secondary_candidate_knowledge_entries, character) )
+  if( int err = m_knowledgeModel->getKnowledgeEntry(&secondary_entries, character) )
     return err;
 
+  const std::vector<const KnowledgeEntry *> &candidate_knowledge_entries = *primary_entries;
+  const std::vector<const KnowledgeEntry *> &secondary_candidate_knowledge_entries = *secondary_entries;
+
   /*
    * Generator the extremely primitive rhythm from the selected knowledge entries.
    */
   if( !m_rhythm_knowledge_entry )
     {
-      std::vector<const KnowledgeEntry *> exclude_list;
-      exclude_list.push_back(m_parameterGenerator->chordKnowledgeEntry());
+      std::vector<bool> excluded(m_knowledgeModel->models().size(), false);
+      excludeEntry(excluded, m_parameterGenerator->chordKnowledgeEntry());
       for(std::size_t i=0; i <m_exclude_rhythm_entries.size(); i++)
-        exclude_list.push_back(m_exclude_rhythm_entries[i]);
+        excludeEntry(excluded, m_exclude_rhythm_entries[i]);
 
-      std::vector<const KnowledgeEntry *> candidate_rhythm_entries;
-      generateCandidateList(candidate_rhythm_entries, candidate_knowledge_entries, secondary_candidate_knowledge_entries, exclude_list);
-      narrowRhythm(candidate_rhythm_entries);
-      m_rhythm_knowledge_entry = util::random_choice(candidate_rhythm_entries);
+      util::WeightedSampler<const KnowledgeEntry *> candidate_rhythm_entries;
+      generateCandidateList(candidate_rhythm_entries, candidate_knowledge_entries, secondary_candidate_knowledge_entries, excluded, true);
+      if( candidate_rhythm_entries.empty() )
+        return -RC_FAILED;
+      m_rhythm_knowledge_entry = candidate_rhythm_entries.choose(random());
     }
 
   m_melody_rhythm_array_entries.clear();
@@ -78,7 +146,7 @@ int CompositionToplevel::startup()
 
   for(std::size_t i=0; i <m_rhythm_knowledge_entry->m_knowledgeArrayEntries.size(); i++)
     {
-      const KnowledgeArrayEntry *knowledgeArrayEntry = m_rhythm_knowledge_entry->m_knowledgeArrayEntries[i];
+      const KnowledgeArrayEntry *knowledgeArrayEntry = &m_rhythm_knowledge_entry->m_knowledgeArrayEntries[i];
       if( theory::FIGURE_CLASS_SOLO == knowledgeArrayEntry->figure_class )
         {
           if( theory::FIGURE_BANK_MELODY == knowledgeArrayEntry->figure_bank )
@@ -99,7 +167,7 @@ int CompositionToplevel::startup()
     {
       if( m_timbre_knowledge_entries.size() > i && m_timbre_knowledge_entries[i] )
         {
-          const std::vector<const FigureListEntry *> *figures = 0l;
+          const KnowledgeArrayEntry *figures = 0l;
           const KnowledgeEntry *figure_knowledge_entry = m_timbre_knowledge_entries[i];
 
           if( int err = getUnusedTimbreFigures(&figures, figure_knowledge_entry, figure_banks[i], figure_classes[i], used_figure_banks) )
@@ -110,188 +178,344 @@ int CompositionToplevel::startup()
         }
       else
         {
-          std::vector<const KnowledgeEntry *> exclude_list;
-
-          exclude_list.push_back(m_parameterGenerator->chordKnowledgeEntry());
-          exclude_list.push_back(m_rhythm_knowledge_entry);
-          for(std::size_t j=0; j < m_timbre_knowledge_entries.size(); j++)
-            exclude_list.push_back(m_timbre_knowledge_entries[j]);
-          for(std::size_t j=0; j < MIN(i, m_exclude_figure_entries.size()); j++)
-            exclude_list.push_back(m_exclude_figure_entries[j]);
+          const KnowledgeArrayEntry *figures = 0l;
+          if( int err = chooseTrackFigures(&figures, i, candidate_knowledge_entries, secondary_candidate_knowledge_entries) )
+            return err;
 
-          std::vector<const KnowledgeEntry *> candidate_timbre_entries;
-          generateCandidateList(candidate_timbre_entries,
-                                candidate_knowledge_entries, secondary_candidate_knowledge_entries,
-                                exclude_list);
+          m_figure_entries.push_back(figures);
+          m_figure_keys.push_back(m_timbre_knowledge_entries[i]->key);
+        }
+    }
 
-          int track;
-          const KnowledgeEntry *timbre_knowledge_entry = 0l;
+  /*
+   * Startup composition process
+   * Copy all the chain nodes from parameter generator to each track as the input of following composition,
+   * reusing the nodes and the notes of the previous composition.
+   */
+  m_compositionChain.reset(m_parameterGenerator->timbreBanks().size(), m_parameterGenerator->chains());
+  m_composedPitchs.resize(m_compositionChain.trackCount() * m_compositionChain.formCount());
+  for(std::size_t k=0; k < m_composedPitchs.size(); k++)
+    m_composedPitchs[k].clear();
+  m_revisions.assign(m_compositionChain.trackCount() * m_compositionChain.formCount(), 0);
+
+  std::vector<std::pair<std::size_t, std::size_t> > forms;
+  if( !m_formCallback )
+    {
+      for(std::size_t i=0; i < m_compositionChain.trackCount(); i++)
+        for(std::size_t j=0; j < m_compositionChain.formCount(); j++)
+          forms.push_back(std::make_pair(i, j));
 
-          switch( int status = theory::get_timbre_figures(&timbre_knowledge_entry, &track, candidate_timbre_entries, figure_banks[i], figure_classes[i]) ) {
-            case 0:
-              break;
-            case -1: /* There is no enough knowledge entries to get a timbre schedule, so retry searching with the whole library. */
-              if( (status = theory::get_timbre_figures(&timbre_knowledge_entry, &track, m_knowledgeModel->models(), figure_banks[i], figure_classes[i])) )
-                return status;
-              break;
-            default:
-              return status;
-          }
+      return composeForms(forms);
+    }
 
-          if( m_timbre_knowledge_entries.size() > i )
-            m_timbre_knowledge_entries[i] = timbre_knowledge_entry;
-          else
-            m_timbre_knowledge_entries.push_back(timbre_knowledge_entry);
+  /*
+   * Progressive composition in timeline order, a form of all the tracks at a time, which is passed on at once.
+   * The velocities of a form only depend on its own notes, so the forms passed on are never changed afterwards,
+   * and the final composition is the same as the one composed at once, as every form has its own random stream.
+   */
+  for(std::size_t j=0; j < m_parameterGenerator->chains().size(); j++)
+    {
+      forms.clear();
+      for(std::size_t i=0; i < m_compositionChain.trackCount(); i++)
+        forms.push_back(std::make_pair(i, j));
 
-          const std::vector<const FigureListEntry *> *figures = &timbre_knowledge_entry->m_knowledgeArrayEntries[track]->figure_list;
-          m_figure_entries.push_back(figures);
-          m_figure_keys.push_back(timbre_knowledge_entry->key);
-        }
+      if( int err = composeForms(forms) )
+        return err;
+      if( int err = m_formCallback(m_formOpaque, this, j) )
+        return err;
     }
+  return 0;
+}
+
+/**
+ * @brief Recompose a track of the last composition with other figures, keeping all the other tracks.
+ */
+int CompositionToplevel::recomposeTrack(std::size_t track_index)
+{
+  if( !composed() || track_index >= m_compositionChain.trackCount() )
+    return -RC_FAILED;
+
+  const std::vector<const KnowledgeEntry *> *primary_entries = 0l;
+  const std::vector<const KnowledgeEntry *> *secondary_entries = 0l;
+
+  if( int err = m_knowledgeModel->getKnowledgeEntry(&primary_entries, m_parameterGenerator->character(), m_parameterGenerator->genre()) )
+    return err;
+  if( int err = m_knowledgeModel->getKnowledgeEntry(&secondary_entries, m_parameterGenerator->character()) )
+    return err;
 
   /*
-   * Startup composition process
-   * Deep-copy all the chain nodes from parameter generator as the input of following composition.
+   * The current timbre entry of the track is excluded along with the others, so that other figures are picked if any.
    */
-  m_compositionChainTracks.clear();
-  for(std::size_t i=0; i < m_parameterGenerator->timbreBanks().size(); i++)
+  const KnowledgeArrayEntry *figures = 0l;
+  if( int err = chooseTrackFigures(&figures, track_index, *primary_entries, *secondary_entries) )
+    return err;
+  m_figure_entries[track_index] = figures;
+  m_figure_keys[track_index] = m_timbre_knowledge_entries[track_index]->key;
+
+  std::vector<std::pair<std::size_t, std::size_t> > forms;
+  for(std::size_t j=0; j < m_compositionChain.formCount(); j++)
+    {
+      ++m_revisions[track_index * m_compositionChain.formCount() + j];
+      forms.push_back(std::make_pair(track_index, j));
+    }
+  return composeForms(forms);
+}
+
+/**
+ * @brief Recompose a range of structure forms of the last composition, keeping all the other forms.
+ * @param track_index Track to recompose, negative = all the tracks.
+ * @param form_begin Index of the first form to recompose.
+ * @param form_end Index of the form past the last one to recompose.
+ */
+int CompositionToplevel::recomposeForms(int track_index, std::size_t form_begin, std::size_t form_end)
+{
+  if( !composed() || track_index >= (int)m_compositionChain.trackCount() )
+    return -RC_FAILED;
+
+  std::vector<std::pair<std::size_t, std::size_t> > forms;
+  for(std::size_t i=0; i < m_compositionChain.trackCount(); i++)
     {
-      m_compositionChainTracks.push_back(std::vector<CompositionChainNode *>());
-      for(std::size_t j=0; j < m_parameterGenerator->chains().size(); j++)
+      if( track_index >= 0 && (std::size_t)track_index != i )
+        continue;
+      for(std::size_t j=form_begin; j < MIN(form_end, m_compositionChain.formCount()); j++)
         {
-          m_compositionChainTracks.back().push_back(new CompositionChainNode(*(m_parameterGenerator->chains()[j])));
+          ++m_revisions[i * m_compositionChain.formCount() + j];
+          forms.push_back(std::make_pair(i, j));
         }
     }
+  if( forms.empty() )
+    return -RC_FAILED;
+  return composeForms(forms);
+}
+
+/**
+ * @brief Whether the tracks are composed from the current parameters of the generator, so that they may be recomposed.
+ */
+bool CompositionToplevel::composed() const
+{
+  std::size_t track_count = m_compositionChain.trackCount();
+  return track_count && track_count == m_parameterGenerator->timbreBanks().size() &&
+         m_compositionChain.formCount() == m_parameterGenerator->chains().size() &&
+         m_figure_entries.size() == track_count && m_figure_keys.size() == track_count &&
+         m_timbre_knowledge_entries.size() >= track_count &&
+         m_revisions.size() == track_count * m_compositionChain.formCount();
+}
 
-  for(std::size_t i=0; i < m_timbre_knowledge_entries.size(); i++)
+/**
+ * @brief Select the timbre entry and the figures of a track, excluding the timbre entries of all the tracks.
+ */
+int CompositionToplevel::chooseTrackFigures(const KnowledgeArrayEntry **dst, std::size_t track_index,
+                                            const std::vector<const KnowledgeEntry *> &primary_candidate_list,
+                                            const std::vector<const KnowledgeEntry *> &secondary_candidate_list)
+{
+  int figure_bank = m_parameterGenerator->figureBanks()[track_index];
+  int figure_class = m_parameterGenerator->figureClasses()[track_index];
+  std::vector<bool> excluded(m_knowledgeModel->models().size(), false);
+
+  excludeEntry(excluded, m_parameterGenerator->chordKnowledgeEntry());
+  excludeEntry(excluded, m_rhythm_knowledge_entry);
+  for(std::size_t j=0; j < m_timbre_knowledge_entries.size(); j++)
+    excludeEntry(excluded, m_timbre_knowledge_entries[j]);
+  for(std::size_t j=0; j < MIN(track_index, m_exclude_figure_entries.size()); j++)
+    excludeEntry(excluded, m_exclude_figure_entries[j]);
+
+  util::WeightedSampler<const KnowledgeEntry *> candidate_timbre_entries;
+  generateCandidateList(candidate_timbre_entries,
+                        primary_candidate_list, secondary_candidate_list,
+                        excluded);
+
+  int track;
+  const KnowledgeEntry *timbre_knowledge_entry = 0l;
+
+  switch( int status = theory::get_timbre_figures(&timbre_knowledge_entry, &track, random(), candidate_timbre_entries, figure_bank, figure_class) ) {
+    case 0:
+      break;
+    case -1: /* There is no enough knowledge entries to get a timbre schedule, so retry searching with the whole library. */
+      if( (status = theory::get_timbre_figures(&timbre_knowledge_entry, &track, random(), *m_knowledgeModel, figure_bank, figure_class)) )
+        return status;
+      break;
+    default:
+      return status;
+  }
+
+  if( m_timbre_knowledge_entries.size() > track_index )
+    m_timbre_knowledge_entries[track_index] = timbre_knowledge_entry;
+  else
+    m_timbre_knowledge_entries.push_back(timbre_knowledge_entry);
+
+  *dst = &timbre_knowledge_entry->m_knowledgeArrayEntries[track];
+  return 0;
+}
+
+/**
+ * @brief Compose the given forms over again, then redo the velocity processing of the structure forms they are in.
+ */
+int CompositionToplevel::composeForms(const std::vector<std::pair<std::size_t, std::size_t> > &forms)
+{
+  int beats = m_parameterGenerator->beats();
+
+  for(std::size_t k=0; k < forms.size(); k++)
     {
-      int track_index = i;
-      const std::vector<CompositionChainNode *> compositionChain = m_compositionChainTracks[track_index];
-
-      int track_key = this->trackFigureKeys()[track_index];
-      int track_figure_bank = m_parameterGenerator->figureBanks()[track_index];
-      int track_figure_classes = m_parameterGenerator->figureClasses()[track_index];
-      const std::vector<const FigureListEntry *> &track_figures_entries = *(trackFigureEntries()[track_index]);
-
-      /*
-       * Composition for each structure form.
-       */
-      for(std::size_t j=0; j < compositionChain.size(); j++)
-        {
-          CompositionChainNode *compositionNode = compositionChain[j];
-          StructureForm::FormType dst_form_type = compositionNode->form.type();
-          const FigureListEntry *src_figure = theory::pick_form(dst_form_type, track_figures_entries);
-
-          int src_bars = src_figure->end - src_figure->begin;
-          int src_offset = src_figure->offset;
-          const std::vector<ChordPair> &src_chords = src_figure->chord;
-          const std::vector<PitchNote> &src_figures = src_figure->pitchs;
-
-          int dst_bars = compositionNode->form.end() - compositionNode->form.begin();
-          dst_form_type = compositionNode->form.type();
-          const std::vector<ChordPair> &dst_chords = compositionNode->chords;
-          if( src_figures.size() == 0 )
-            continue;
-          if( dst_form_type == StructureForm::FORM_BLANK )
-            continue;
-          int dst_offset = src_offset;
-
-          compositionNode->offset = dst_offset;
-
-          std::vector<ChordPair> stretched_chords;
-          std::vector<PitchNote> stretched_figures;
-          if( int err = theory::stretch_chord_sequence(stretched_chords, src_chords, src_bars, dst_bars) )
-            return err;
-          if( int err = theory::stretch_figure_sequence(stretched_figures, src_figures, src_bars, dst_bars) )
-            return err;
+      m_compositionChain.resetNode(forms[k].first, forms[k].second, m_parameterGenerator->chains()[forms[k].second]);
+    }
 
-          /*
-           * Invoke a corresponding model that is appropriate to the current instrument track
-           */
-          ModelBase *modelInstance = m_modelLibrary->invokeModel(track_figure_bank, track_figure_classes);
-          if( int err = modelInstance->generate(compositionNode->pitch, this,
-                                                track_figure_bank, stretched_chords, stretched_figures,
-                                                dst_form_type, dst_chords, dst_offset, dst_bars,
-                                                track_key,
-                                                m_parameterGenerator->key(), m_parameterGenerator->scale(),
-                                                beats) )
-          {
-            return err;
-          }
-        }
+  /*
+   * Composition for each structure form of each track.
+   * Every form writes its own chain node and draws from its own random stream,
+   * so the forms are composed concurrently when threads are enabled, with the same result as in serial.
+   */
+  std::vector<int> results(forms.size(), 0);
+  m_pool.run(forms.size(), [&](std::size_t k)
+    {
+      results[k] = composeForm(forms[k].first, forms[k].second, beats);
+    });
+  for(std::size_t k=0; k < results.size(); k++)
+    {
+      if( results[k] )
+        return results[k];
     }
 
   /*
    * Post processing of composition chain.
+   * The velocities of a structure form are normalized over all the tracks, so the processing of the forms
+   * touched restarts from the composed notes of all their tracks. The other forms are left as they are.
    */
-  if( int err = theory::processVelocity(m_compositionChainTracks, generator()->figureBanks(), generator()->figureClasses()) )
-    return err;
+  std::size_t form_count = m_compositionChain.formCount();
+  std::vector<bool> recomposed(m_compositionChain.trackCount() * form_count, false);
+  std::vector<bool> touched(form_count, false);
+  for(std::size_t k=0; k < forms.size(); k++)
+    {
+      recomposed[forms[k].first * form_count + forms[k].second] = true;
+      touched[forms[k].second] = true;
+      m_composedPitchs[forms[k].first * form_count + forms[k].second] = m_compositionChain[forms[k].first][forms[k].second].pitch;
+    }
+  for(std::size_t j=0; j < form_count; j++)
+    {
+      if( !touched[j] )
+        continue;
+      for(std::size_t i=0; i < m_compositionChain.trackCount(); i++)
+        {
+          if( !recomposed[i * form_count + j] )
+            m_compositionChain[i][j].pitch = m_composedPitchs[i * form_count + j];
+        }
+      if( int err = theory::processVelocity(m_compositionChain, j, generator()->seed(), generator()->figureBanks(), generator()->figureClasses()) )
+        return err;
+    }
   return 0;
 }
 
+/**
+ * @brief Compose a structure form of a track, invoking the model appropriate to the instrument.
+ */
+int CompositionToplevel::composeForm(std::size_t track_index, std::size_t form_index, int beats)
+{
+  CompositionChainNode *compositionNode = &m_compositionChain[track_index][form_index];
+
+  int track_key = this->trackFigureKeys()[track_index];
+  int track_figure_bank = m_parameterGenerator->figureBanks()[track_index];
+  int track_figure_classes = m_parameterGenerator->figureClasses()[track_index];
+  const KnowledgeArrayEntry &track_figures_entries = *(trackFigureEntries()[track_index]);
+
+  StructureForm::FormType dst_form_type = compositionNode->form.type();
+  util::RandomStream random(m_parameterGenerator->seed(), track_index, form_index, util::RANDOM_STAGE_FIGURE,
+                            m_revisions[track_index * m_compositionChain.formCount() + form_index]);
+  const FigureListEntry *src_figure = theory::pick_form(random, dst_form_type, track_figures_entries);
+
+  int src_bars = src_figure->end - src_figure->begin;
+  int src_offset = src_figure->offset;
+  const util::ArrayRef<ChordPair> &src_chords = src_figure->chord;
+
+  int dst_bars = compositionNode->form.end() - compositionNode->form.begin();
+  const std::vector<ChordPair> &dst_chords = compositionNode->chords;
+  if( src_figure->pitchCount() == 0 )
+    return 0;
+  if( dst_form_type == StructureForm::FORM_BLANK )
+    return 0;
+  int dst_offset = src_offset;
+
+  compositionNode->offset = dst_offset;
+
+  std::vector<ChordPair> stretched_chords;
+  std::vector<PitchNote> src_figures, stretched_figures;
+  src_figure->pitchs().decode(src_figures);
+  if( int err = theory::stretch_chord_sequence(stretched_chords, src_chords, src_bars, dst_bars) )
+    return err;
+  if( int err = theory::stretch_figure_sequence(stretched_figures, src_figures, src_bars, dst_bars) )
+    return err;
+
+  /*
+   * Invoke a corresponding model that is appropriate to the current instrument track
+   */
+  ModelBase *modelInstance = m_modelLibrary->invokeModel(track_figure_bank, track_figure_classes);
+  return modelInstance->generate(compositionNode->pitch, this, random,
+                                 track_figure_bank, stretched_chords, stretched_figures,
+                                 dst_form_type, dst_chords, dst_offset, dst_bars,
+                                 track_key,
+                                 m_parameterGenerator->key(), m_parameterGenerator->scale(),
+                                 beats);
+}
+
 float CompositionToplevel::tempo() const
 {
   return m_parameterGenerator->chordKnowledgeEntry()->tempo;
 }
 
-void CompositionToplevel::generateCandidateList(std::vector<const KnowledgeEntry *> &dst,
+void CompositionToplevel::excludeEntry(std::vector<bool> &excluded, const KnowledgeEntry *entry) const
+{
+  if( entry && entry->index < excluded.size() && m_knowledgeModel->models()[entry->index] == entry )
+    excluded[entry->index] = true;
+}
+
+/**
+ * @brief Build up the weighted candidates, preferring the primary entries to the secondary ones by 10:1.
+ * The excluded entries are given up, unless nothing else is left.
+ */
+void CompositionToplevel::generateCandidateList(util::WeightedSampler<const KnowledgeEntry *> &dst,
                           const std::vector<const KnowledgeEntry *> &primary_candidate_list,
                           const std::vector<const KnowledgeEntry *> &secondary_candidate_list,
-                          const std::vector<const KnowledgeEntry *> &exclude_list)
+                          const std::vector<bool> &excluded,
+                          bool rhythm_only /*= false*/)
 {
   bool do_exclude = true;
   dst.clear();
 
 generate:
-  for(unsigned int i=0; i < 10; i++)
-    for(std::size_t j=0; j < primary_candidate_list.size(); j++)
-      dst.push_back(primary_candidate_list[j]);
-  for(std::size_t i=0; i < secondary_candidate_list.size(); i++)
-    dst.push_back(secondary_candidate_list[i]);
-
-  if(do_exclude)
+  for(std::size_t i=0; i < primary_candidate_list.size(); i++)
     {
-  for(std::size_t i=0; i < exclude_list.size(); i++)
-    for(std::vector<const KnowledgeEntry *>::iterator iter = dst.begin(); iter != dst.end(); )
-      {
-        if( *iter == exclude_list[i] )
-          dst.erase(iter);
-        else
-          iter++;
-      }
+      const KnowledgeEntry *entry = primary_candidate_list[i];
+      if( (do_exclude && excluded[entry->index]) || (rhythm_only && !entry->for_rhythm) )
+        continue;
+      dst.add(entry, 10);
     }
-  if( dst.size() == 0 )
+  for(std::size_t i=0; i < secondary_candidate_list.size(); i++)
     {
-      do_exclude = false;
-      goto generate;
+      const KnowledgeEntry *entry = secondary_candidate_list[i];
+      if( (do_exclude && excluded[entry->index]) || (rhythm_only && !entry->for_rhythm) )
+        continue;
+      dst.add(entry, 1);
     }
-}
 
-void CompositionToplevel::narrowRhythm(std::vector<const KnowledgeEntry *> &dst_entries)
-{
-  for(std::vector<const KnowledgeEntry *>::iterator iter=dst_entries.begin(); iter != dst_entries.end(); )
+  if( dst.empty() && do_exclude )
     {
-      const KnowledgeEntry *knowledgeEntry = *iter;
-      if( !knowledgeEntry->for_rhythm )
-        dst_entries.erase(iter);
-      else
-        iter++;
+      do_exclude = false;
+      goto generate;
     }
+  dst.build();
 }
 
 /**
  * @brief Select a figure entry from the list according to the figure bank and class,
  * ensuring it is not selected before as far as possible .
  */
-int CompositionToplevel::getUnusedTimbreFigures(const std::vector<const FigureListEntry *> **dst,
+int CompositionToplevel::getUnusedTimbreFigures(const KnowledgeArrayEntry **dst,
                                              const KnowledgeEntry *knowledge_entry,
                                              int figure_bank, int figure_class,
                                              std::vector<const KnowledgeArrayEntry *> used_entries)
 {
-  const std::vector<const FigureListEntry *> *figure_list = 0l;
+  const KnowledgeArrayEntry *figure_list = 0l;
   for(std::size_t i=0; i < knowledge_entry->m_knowledgeArrayEntries.size(); i++)
     {
-      const KnowledgeArrayEntry *entry = knowledge_entry->m_knowledgeArrayEntries[i];
+      const KnowledgeArrayEntry *entry = &knowledge_entry->m_knowledgeArrayEntries[i];
       if( figure_bank == entry->figure_bank && figure_class == entry->figure_class )
         {
           bool unused = true;
@@ -300,7 +524,7 @@ int CompositionToplevel::getUnusedTimbreFigures(const std::vector<const FigureLi
               { unused = false; break; }
           if( unused )
             {
-              figure_list = &knowledge_entry->m_knowledgeArrayEntries[i]->figure_list;
+              figure_list = &knowledge_entry->m_knowledgeArrayEntries[i];
               used_entries.push_back(entry);
               break;
             }
@@ -316,14 +540,10 @@ int CompositionToplevel::getUnusedTimbreFigures(const std::vector<const FigureLi
       int track;
       const KnowledgeEntry *knowledgeEntry = 0l;
 
-      std::vector<const KnowledgeEntry *> knowledgeEntries;
-      for(std::size_t i=0; i < m_knowledgeModel->models().size(); i++)
-        knowledgeEntries.push_back(m_knowledgeModel->models()[i]);
-
-      if( int err = theory::get_timbre_figures(&knowledgeEntry, &track, knowledgeEntries, figure_bank, figure_class) )
+      if( int err = theory::get_timbre_figures(&knowledgeEntry, &track, random(), *m_knowledgeModel, figure_bank, figure_class) )
         return err;
 
-      *dst = &knowledgeEntry->m_knowledgeArrayEntries[track]->figure_list;
+      *dst = &knowledgeEntry->m_knowledgeArrayEntries[track];
     }
   else
     {
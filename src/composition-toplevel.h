@@ -16,8 +16,11 @@
 #define COMPOSITION_TOPLEVEL_H
 
 #include "parameter-generator.h"
+#include "composition-chain.h"
+#include "util-parallel.h"
 
 #include <vector>
+#include <memory>
 
 namespace autocomp
 {
@@ -27,48 +30,81 @@ class KnowledgeEntry;
 class KnowledgeArrayEntry;
 class ParameterGenerator;
 class ModelLibrary;
+class CompositionToplevel;
+
+/**
+ * @brief Receiver of the forms composed progressively, @see CompositionToplevel::setFormCallback()
+ * @param form_index Index of the structure form just composed in all the tracks.
+ * @return status code, nonzero = stop the composition and return it.
+ */
+typedef int (*FormCallback)(void *opaque, const CompositionToplevel *composition, std::size_t form_index);
+
 class CompositionToplevel
 {
 public:
-  CompositionToplevel();
+  CompositionToplevel(const std::shared_ptr<const KnowledgeModel> &knowledgeModel);
+  ~CompositionToplevel();
 
+  void setKnowledgeModel(const std::shared_ptr<const KnowledgeModel> &knowledgeModel);
+  void reset();
   int startup();
+  int recomposeTrack(std::size_t track_index);
+  int recomposeForms(int track_index, std::size_t form_begin, std::size_t form_end);
 
   inline const std::vector<const KnowledgeArrayEntry *> &melodyRhythmEntries() const { return m_melody_rhythm_array_entries; }
   inline const std::vector<const KnowledgeArrayEntry *> &soloRhythmEntries() const { return m_solo_rhythm_array_entries; }
-  inline const std::vector<const std::vector<const FigureListEntry *> *> &trackFigureEntries() const { return m_figure_entries; }
+  inline const std::vector<const KnowledgeArrayEntry *> &trackFigureEntries() const { return m_figure_entries; }
   inline const std::vector<int> &trackFigureKeys() const { return m_figure_keys; }
-  inline const std::vector<std::vector<CompositionChainNode *>> &chains() const { return m_compositionChainTracks; }
-  inline KnowledgeModel *knowledgeModel() { return m_knowledgeModel; }
+  inline const CompositionChain &chains() const { return m_compositionChain; }
+  inline const KnowledgeModel *knowledgeModel() const { return m_knowledgeModel.get(); }
   inline ParameterGenerator *generator() { return m_parameterGenerator; }
+  inline util::Random &random() { return m_parameterGenerator->random(); }
+  inline int threads() const { return m_pool.threads(); }
+  inline void setThreads(int threads) { m_pool.setThreads(threads); }
+  inline util::ThreadPool &pool() { return m_pool; }
+  inline void setFormCallback(FormCallback callback, void *opaque) { m_formCallback = callback; m_formOpaque = opaque; }
   float tempo() const;
 
 private:
-  void generateCandidateList(std::vector<const KnowledgeEntry *> &dst,
+  void excludeEntry(std::vector<bool> &excluded, const KnowledgeEntry *entry) const;
+  void generateCandidateList(util::WeightedSampler<const KnowledgeEntry *> &dst,
                             const std::vector<const KnowledgeEntry *> &primary_candidate_list,
                             const std::vector<const KnowledgeEntry *> &secondary_candidate_list,
-                            const std::vector<const KnowledgeEntry *> &exclude_list = std::vector<const KnowledgeEntry *> () );
-  void narrowRhythm(std::vector<const KnowledgeEntry *> &dst_entries);
-  int getUnusedTimbreFigures(const std::vector<const FigureListEntry *> **dst,
+                            const std::vector<bool> &excluded,
+                            bool rhythm_only = false);
+  int compose();
+  void clearComposition();
+  bool composed() const;
+  int chooseTrackFigures(const KnowledgeArrayEntry **dst, std::size_t track_index,
+                         const std::vector<const KnowledgeEntry *> &primary_candidate_list,
+                         const std::vector<const KnowledgeEntry *> &secondary_candidate_list);
+  int composeForms(const std::vector<std::pair<std::size_t, std::size_t> > &forms);
+  int composeForm(std::size_t track_index, std::size_t form_index, int beats);
+  int getUnusedTimbreFigures(const KnowledgeArrayEntry **dst,
                           const KnowledgeEntry *knowledge_entry,
                           int figure_bank, int figure_class,
                           std::vector<const KnowledgeArrayEntry *> used_entries);
 
 private:
-  KnowledgeModel *m_knowledgeModel;
+  std::shared_ptr<const KnowledgeModel> m_knowledgeModel;
   ParameterGenerator *m_parameterGenerator;
   ModelLibrary *m_modelLibrary;
   const KnowledgeEntry *m_rhythm_knowledge_entry;
   std::vector<const KnowledgeArrayEntry *> m_melody_rhythm_array_entries;
   std::vector<const KnowledgeArrayEntry *> m_solo_rhythm_array_entries;
-  std::vector<const std::vector<const FigureListEntry *> *> m_figure_entries;
+  std::vector<const KnowledgeArrayEntry *> m_figure_entries;
   std::vector<int> m_figure_keys;
 
   std::vector<const KnowledgeEntry *> m_exclude_rhythm_entries;
   std::vector<const KnowledgeEntry *> m_exclude_figure_entries;
   std::vector<const KnowledgeEntry *> m_timbre_knowledge_entries;
 
-  std::vector<std::vector<CompositionChainNode *>> m_compositionChainTracks;
+  CompositionChain m_compositionChain;
+  std::vector<std::vector<PitchNote> > m_composedPitchs; /* notes of each form before the velocity processing, track by track */
+  std::vector<uint32_t> m_revisions; /* recompositions of each form, track by track */
+  util::ThreadPool m_pool; /* worker threads composing the forms, also running the variations of the context */
+  FormCallback m_formCallback; /* NULL = compose all the forms at once */
+  void *m_formOpaque;
 };
 
 
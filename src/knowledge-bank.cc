@@ -0,0 +1,731 @@
+/*
+ *  libautomusic (Library for Image-based Algorithmic Musical Composition)
+ *  Copyright (C) 2018, automusic.
+ *
+ *  THIS PROJECT IS FREE SOFTWARE; YOU CAN REDISTRIBUTE IT AND/OR
+ *  MODIFY IT UNDER THE TERMS OF THE GNU LESSER GENERAL PUBLIC LICENSE(GPL)
+ *  AS PUBLISHED BY THE FREE SOFTWARE FOUNDATION; EITHER VERSION 2.1
+ *  OF THE LICENSE, OR (AT YOUR OPTION) ANY LATER VERSION.
+ *
+ *  THIS PROJECT IS DISTRIBUTED IN THE HOPE THAT IT WILL BE USEFUL,
+ *  BUT WITHOUT ANY WARRANTY; WITHOUT EVEN THE IMPLIED WARRANTY OF
+ *  MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE.  SEE THE GNU
+ *  LESSER GENERAL PUBLIC LICENSE FOR MORE DETAILS.
+ */
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <new>
+
+#if defined(_WIN32)
+# include <cstdlib>
+# include <sys/types.h>
+# include <sys/stat.h>
+#else
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
+
+#include "libautomusic.h"
+#include "knowledge-model.h"
+#include "knowledge-bank.h"
+#include "theory-orchestration.h"
+#include "util-log.h"
+
+namespace autocomp
+{
+
+static const char bank_magic[8] = {'A', 'M', 'K', 'B', 'A', 'N', 'K', '\x1a'};
+
+#define BANK_HEADER_SIZE 64
+#define BANK_ENTRY_WORDS 12
+#define BANK_ARRAY_WORDS 5
+#define BANK_FIGURE_WORDS 11
+#define BANK_CHORD_WORDS 2
+#define BANK_PITCH_WORDS 3
+
+#define BANK_FLAG_RHYTHM  (1u << 0)
+#define BANK_FLAG_CHORD   (1u << 1)
+#define BANK_FLAG_TIMBRE  (1u << 2)
+
+/*
+ * Header words following the magic number.
+ */
+enum
+{
+  HDR_VERSION = 0,
+  HDR_HEADER_SIZE,
+  HDR_ENTRY_COUNT,
+  HDR_ARRAY_COUNT,
+  HDR_FIGURE_COUNT,
+  HDR_CHORD_COUNT,
+  HDR_PITCH_COUNT,
+  HDR_VALUE_COUNT,
+  HDR_PAYLOAD_SIZE,
+  HDR_PAYLOAD_CRC,  /* all the sections but the pitches */
+  HDR_PITCH_CRC,
+  HDR_SOURCE_STAMP, /* @see KnowledgeBank::sourceStamp() */
+  HDR_HEADER_CRC,
+  HDR_WORDS
+};
+
+static inline uint32_t get_u32(const uint8_t *p)
+{
+  return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+static inline int32_t get_i32(const uint8_t *p)
+{
+  return static_cast<int32_t>(get_u32(p));
+}
+
+static inline void put_u32(std::vector<uint8_t> &dst, uint32_t value)
+{
+  dst.push_back(uint8_t(value));
+  dst.push_back(uint8_t(value >> 8));
+  dst.push_back(uint8_t(value >> 16));
+  dst.push_back(uint8_t(value >> 24));
+}
+
+static inline void set_u32(uint8_t *dst, uint32_t value)
+{
+  dst[0] = uint8_t(value);
+  dst[1] = uint8_t(value >> 8);
+  dst[2] = uint8_t(value >> 16);
+  dst[3] = uint8_t(value >> 24);
+}
+
+struct Crc32Table
+{
+  Crc32Table()
+    {
+      for(uint32_t i=0; i < 256; i++)
+        {
+          uint32_t c = i;
+          for(int k=0; k < 8; k++)
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+          values[i] = c;
+        }
+    }
+
+  uint32_t values[256];
+};
+
+/**
+ * @brief Calculate the CRC-32 (IEEE 802.3) of a block of data.
+ */
+uint32_t crc32(const uint8_t *data, std::size_t size, uint32_t crc /*= 0*/)
+{
+  static const Crc32Table table; /* built once by the first caller, other threads wait for it */
+  crc = ~crc;
+  for(std::size_t i=0; i < size; i++)
+    crc = table.values[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+MappedFile::MappedFile()
+    : m_data(0l),
+      m_size(0),
+      m_mapped(false)
+{
+}
+
+MappedFile::~MappedFile()
+{
+  close();
+}
+
+/**
+ * @brief Map the whole file into memory read-only.
+ * Fall back to reading the file into a heap buffer where mmap() is not available.
+ * @param prefetch Whether to read the whole file ahead, false = fault the pages in at their first access.
+ */
+int MappedFile::open(const char *filename, bool prefetch /*= true*/)
+{
+  close();
+#if defined(_WIN32)
+  std::ifstream stream(filename, std::ifstream::binary);
+  if( !stream.is_open() )
+    return -RC_OPENFILE;
+  stream.seekg(0, std::ios::end);
+  std::streamoff size = stream.tellg();
+  stream.seekg(0, std::ios::beg);
+  if( size <= 0 )
+    return -RC_OPENFILE;
+  uint8_t *buffer = static_cast<uint8_t *>(std::malloc(size));
+  if( !buffer )
+    return -RC_FAILED;
+  if( !stream.read(reinterpret_cast<char *>(buffer), size) )
+    {
+      std::free(buffer);
+      return -RC_OPENFILE;
+    }
+  m_data = buffer;
+  m_size = std::size_t(size);
+  m_mapped = false;
+#else
+  int fd = ::open(filename, O_RDONLY);
+  if( fd < 0 )
+    return -RC_OPENFILE;
+  struct stat st;
+  if( fstat(fd, &st) || st.st_size <= 0 )
+    {
+      ::close(fd);
+      return -RC_OPENFILE;
+    }
+  void *addr = mmap(0l, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if( addr == MAP_FAILED )
+    return -RC_OPENFILE;
+  madvise(addr, st.st_size, prefetch ? MADV_WILLNEED : MADV_RANDOM);
+  m_data = static_cast<const uint8_t *>(addr);
+  m_size = std::size_t(st.st_size);
+  m_mapped = true;
+#endif
+  return 0;
+}
+
+void MappedFile::close()
+{
+  if( !m_data )
+    return;
+#if defined(_WIN32)
+  std::free(const_cast<uint8_t *>(m_data));
+#else
+  if( m_mapped )
+    munmap(const_cast<uint8_t *>(m_data), m_size);
+#endif
+  m_data = 0l;
+  m_size = 0;
+  m_mapped = false;
+}
+
+/**
+ * @brief Flatten all the entries of a loaded model into a compiled bank file.
+ * The file is written aside and renamed at last, so a running loader never sees a partial bank.
+ */
+int KnowledgeBank::compile(const KnowledgeModel &model, const char *filename)
+{
+  const std::vector<const KnowledgeEntry *> &entries = model.models();
+  std::vector<uint8_t> entry_section, array_section, figure_section, chord_section, pitch_section, value_section;
+  uint32_t array_count = 0, figure_count = 0, chord_count = 0, pitch_count = 0, value_count = 0;
+
+  for(std::size_t i=0; i < entries.size(); i++)
+    {
+      const KnowledgeEntry *entry = entries[i];
+      uint32_t tempo_bits;
+      std::memcpy(&tempo_bits, &entry->tempo, sizeof tempo_bits);
+      uint32_t flags = (entry->for_rhythm ? BANK_FLAG_RHYTHM : 0) |
+                       (entry->for_chord ? BANK_FLAG_CHORD : 0) |
+                       (entry->for_timbre ? BANK_FLAG_TIMBRE : 0);
+
+      put_u32(entry_section, entry->key);
+      put_u32(entry_section, entry->scale);
+      put_u32(entry_section, tempo_bits);
+      put_u32(entry_section, entry->time_beats);
+      put_u32(entry_section, entry->time_beat_type);
+      put_u32(entry_section, flags);
+      put_u32(entry_section, array_count);
+      put_u32(entry_section, entry->m_knowledgeArrayEntries.size());
+      put_u32(entry_section, value_count);
+      put_u32(entry_section, entry->character.size());
+      put_u32(entry_section, value_count + entry->character.size());
+      put_u32(entry_section, entry->genre.size());
+
+      for(std::size_t k=0; k < entry->character.size(); k++)
+        put_u32(value_section, entry->character[k]);
+      for(std::size_t k=0; k < entry->genre.size(); k++)
+        put_u32(value_section, entry->genre[k]);
+      value_count += entry->character.size() + entry->genre.size();
+
+      for(std::size_t j=0; j < entry->m_knowledgeArrayEntries.size(); j++)
+        {
+          const KnowledgeArrayEntry *arrayEntry = &entry->m_knowledgeArrayEntries[j];
+          put_u32(array_section, arrayEntry->timbre_bank);
+          put_u32(array_section, arrayEntry->figure_bank);
+          put_u32(array_section, arrayEntry->figure_class);
+          put_u32(array_section, figure_count);
+          put_u32(array_section, arrayEntry->figure_list.size());
+          array_count++;
+
+          for(std::size_t k=0; k < arrayEntry->figure_list.size(); k++)
+            {
+              const FigureListEntry *figure = &arrayEntry->figure_list[k];
+              put_u32(figure_section, figure->segment);
+              put_u32(figure_section, figure->offset);
+              put_u32(figure_section, figure->begin);
+              put_u32(figure_section, figure->end);
+              put_u32(figure_section, chord_count);
+              put_u32(figure_section, figure->chord.size());
+              put_u32(figure_section, pitch_count);
+              put_u32(figure_section, figure->pitchCount());
+              put_u32(figure_section, figure->pitchs().byteSize());
+              put_u32(figure_section, figure->pitch_low);
+              put_u32(figure_section, figure->pitch_high);
+              figure_count++;
+
+              for(std::size_t m=0; m < figure->chord.size(); m++)
+                {
+                  put_u32(chord_section, figure->chord[m].root);
+                  put_u32(chord_section, figure->chord[m].sign);
+                }
+              chord_count += figure->chord.size();
+
+              util::PitchSequence pitchs = figure->pitchs();
+              for(util::PitchSequence::const_iterator note = pitchs.begin(); note != pitchs.end(); ++note)
+                {
+                  put_u32(pitch_section, uint32_t(note->pitch) | (uint32_t(note->velocity) << 8));
+                  put_u32(pitch_section, note->start);
+                  put_u32(pitch_section, note->end);
+                }
+              pitch_count += pitchs.size();
+            }
+        }
+    }
+
+  uint32_t payload_crc = crc32(entry_section.data(), entry_section.size());
+  payload_crc = crc32(array_section.data(), array_section.size(), payload_crc);
+  payload_crc = crc32(figure_section.data(), figure_section.size(), payload_crc);
+  payload_crc = crc32(chord_section.data(), chord_section.size(), payload_crc);
+  payload_crc = crc32(value_section.data(), value_section.size(), payload_crc);
+
+  std::vector<uint8_t> payload;
+  payload.reserve(entry_section.size() + array_section.size() + figure_section.size() +
+                  chord_section.size() + pitch_section.size() + value_section.size());
+  payload.insert(payload.end(), entry_section.begin(), entry_section.end());
+  payload.insert(payload.end(), array_section.begin(), array_section.end());
+  payload.insert(payload.end(), figure_section.begin(), figure_section.end());
+  payload.insert(payload.end(), chord_section.begin(), chord_section.end());
+  payload.insert(payload.end(), pitch_section.begin(), pitch_section.end());
+  payload.insert(payload.end(), value_section.begin(), value_section.end());
+
+  uint8_t header[BANK_HEADER_SIZE];
+  std::memset(header, 0, sizeof header);
+  std::memcpy(header, bank_magic, sizeof bank_magic);
+  uint8_t *words = header + sizeof bank_magic;
+  set_u32(words + 4 * HDR_VERSION, KNOWLEDGE_BANK_VERSION);
+  set_u32(words + 4 * HDR_HEADER_SIZE, BANK_HEADER_SIZE);
+  set_u32(words + 4 * HDR_ENTRY_COUNT, entries.size());
+  set_u32(words + 4 * HDR_ARRAY_COUNT, array_count);
+  set_u32(words + 4 * HDR_FIGURE_COUNT, figure_count);
+  set_u32(words + 4 * HDR_CHORD_COUNT, chord_count);
+  set_u32(words + 4 * HDR_PITCH_COUNT, pitch_count);
+  set_u32(words + 4 * HDR_VALUE_COUNT, value_count);
+  set_u32(words + 4 * HDR_PAYLOAD_SIZE, payload.size());
+  set_u32(words + 4 * HDR_PAYLOAD_CRC, payload_crc);
+  set_u32(words + 4 * HDR_PITCH_CRC, crc32(pitch_section.data(), pitch_section.size()));
+  set_u32(words + 4 * HDR_SOURCE_STAMP, model.m_sourceStamp);
+  set_u32(words + 4 * HDR_HEADER_CRC, crc32(header, sizeof bank_magic + 4 * HDR_HEADER_CRC));
+
+  std::string tmpname(filename);
+  tmpname.append(".tmp");
+  {
+    std::ofstream stream(tmpname.c_str(), std::ofstream::binary | std::ofstream::trunc);
+    if( !stream.is_open() )
+      return -RC_OPENFILE;
+    stream.write(reinterpret_cast<const char *>(header), sizeof header);
+    stream.write(reinterpret_cast<const char *>(payload.data()), payload.size());
+    if( !stream )
+      {
+        stream.close();
+        std::remove(tmpname.c_str());
+        return -RC_WRITE_FILE;
+      }
+  }
+  std::remove(filename); /* rename() does not replace existing files on Windows */
+  if( std::rename(tmpname.c_str(), filename) )
+    {
+      std::remove(tmpname.c_str());
+      return -RC_WRITE_FILE;
+    }
+  return 0;
+}
+
+/**
+ * @brief Stamp the bank sources with their names, sizes and modification times.
+ * @param filenames Bank sources listed in index.meta, the index itself is stamped as well.
+ * @return The stamp, 0 if any source is missing.
+ */
+uint32_t KnowledgeBank::sourceStamp(const char *modelPath, const std::vector<std::string> &filenames)
+{
+  std::string index(modelPath);
+  index.append("/meta-data/index.meta");
+
+  std::size_t path_length = std::strlen(modelPath);
+  uint32_t stamp = 0;
+  for(std::size_t i=0; i <= filenames.size(); i++)
+    {
+      const std::string &filename = i < filenames.size() ? filenames[i] : index;
+      struct stat st;
+      if( stat(filename.c_str(), &st) )
+        return 0;
+
+      /* relative to the model path, so that the stamp follows a moved model */
+      std::vector<uint8_t> record(filename.begin() + std::min(path_length, filename.size()), filename.end());
+      put_u32(record, uint32_t(st.st_size));
+      put_u32(record, uint32_t(uint64_t(st.st_mtime)));
+      put_u32(record, uint32_t(uint64_t(st.st_mtime) >> 32));
+      stamp = crc32(record.data(), record.size(), stamp);
+    }
+  return stamp ? stamp : 1;
+}
+
+/**
+ * @brief Load the entries passing the filter of options from a compiled bank file.
+ * @param sourceStamp Stamp of the sources the bank has to be compiled from, 0 = not checked.
+ */
+int KnowledgeBank::load(KnowledgeModel &model, const char *filename, const KnowledgeLoadOptions &options,
+                        uint32_t sourceStamp /*= 0*/)
+{
+  /*
+   * Loading the pitches lazily, the mapped file is handed over to the model through the decoder.
+   * A model holds one decoder, so the pitches of a further bank are decoded at once.
+   */
+  std::unique_ptr<LazyPitchDecoder> lazyPitchs;
+  MappedFile local_file;
+  if( options.lazy_pitchs && !model.m_pitchDecoder )
+    lazyPitchs.reset(new LazyPitchDecoder);
+  MappedFile &file = lazyPitchs ? lazyPitchs->file() : local_file;
+  if( int rc = file.open(filename, !lazyPitchs) )
+    return rc;
+
+  if( sourceStamp && file.size() >= BANK_HEADER_SIZE &&
+      get_u32(file.data() + sizeof bank_magic + 4 * HDR_SOURCE_STAMP) != sourceStamp )
+    {
+      util::log(util::LOG_WARNING, "KnowledgeBank::load(): %s is out of date with its sources.", filename);
+      return -RC_PARSE_DATABASE;
+    }
+
+  int rc = decode(model, file.data(), file.size(), options, lazyPitchs.get());
+  if( rc )
+    {
+      util::log(util::LOG_WARNING, "KnowledgeBank::load(): %s is corrupted or incompatible.", filename);
+      model.removeEntries();
+      return rc;
+    }
+  if( lazyPitchs )
+    model.m_pitchDecoder = std::move(lazyPitchs);
+  return 0;
+}
+
+/**
+ * @brief Get the encoded pitches of a figure, decoding them unless another thread did it in the meantime.
+ */
+const uint8_t *LazyPitchDecoder::decode(std::atomic<const uint8_t *> &dst, const uint8_t *records, std::size_t count)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  const uint8_t *data = dst.load(std::memory_order_acquire);
+  if( data )
+    return data;
+
+  decodeRecords(m_pitchs, records, count);
+  uint8_t *encoded = m_arena.allocateArray<uint8_t>(util::PitchSequence::encodedSize(&m_pitchs[0], count));
+  util::PitchSequence::encode(encoded, &m_pitchs[0], count);
+  dst.store(encoded, std::memory_order_release);
+  return encoded;
+}
+
+void LazyPitchDecoder::decodeRecords(std::vector<PitchNote> &dst, const uint8_t *records, std::size_t count)
+{
+  dst.resize(count);
+  for(std::size_t i=0; i < count; i++)
+    {
+      const uint8_t *rec = records + 4 * BANK_PITCH_WORDS * i;
+      uint32_t note = get_u32(rec);
+      dst[i] = PitchNote(note & 0xff, (note >> 8) & 0xff, get_i32(rec + 4), get_i32(rec + 8));
+    }
+}
+
+static inline bool range_valid(uint32_t first, uint32_t count, uint32_t total)
+{
+  return first <= total && count <= total - first;
+}
+
+/*
+ * The sections of a validated payload, @see knowledge-bank.h
+ */
+struct BankSections
+{
+  const uint8_t *entries;
+  const uint8_t *arrays;
+  const uint8_t *figures;
+  const uint8_t *chords;
+  const uint8_t *pitches;
+  const uint8_t *values;
+  uint32_t array_count;
+  uint32_t figure_count;
+  uint32_t chord_count;
+  uint32_t pitch_count;
+  uint32_t value_count;
+};
+
+/* Arena space of an array, with the worst padding to align it. */
+template <typename T>
+  static inline std::size_t arena_size(uint32_t count)
+    {
+      return count ? sizeof(T) * count + alignof(T) : 0;
+    }
+
+/**
+ * @brief Validate the ranges of the characters and genres of an entry record, which the filter reads.
+ */
+static bool values_valid(const BankSections &sections, const uint8_t *rec)
+{
+  return range_valid(get_u32(rec + 32), get_u32(rec + 36), sections.value_count) &&
+         range_valid(get_u32(rec + 40), get_u32(rec + 44), sections.value_count);
+}
+
+/**
+ * @brief Validate the child ranges of an entry record, and get the arena space to decode the entry.
+ * The space of the pitches comes from the figure records, without decoding them.
+ */
+static bool measure_entry(const BankSections &sections, const uint8_t *rec, bool lazy_pitchs, std::size_t *size)
+{
+  uint32_t array_first = get_u32(rec + 24), array_num = get_u32(rec + 28);
+  uint32_t character_num = get_u32(rec + 36);
+  uint32_t genre_num = get_u32(rec + 44);
+
+  if( !range_valid(array_first, array_num, sections.array_count) || !values_valid(sections, rec) )
+    return false;
+
+  *size = arena_size<KnowledgeEntry>(1) + arena_size<KnowledgeArrayEntry>(array_num) +
+          arena_size<int>(character_num) + arena_size<int>(genre_num);
+
+  for(uint32_t j=array_first; j < array_first + array_num; j++)
+    {
+      const uint8_t *array_rec = sections.arrays + 4 * BANK_ARRAY_WORDS * j;
+      uint32_t figure_first = get_u32(array_rec + 12), figure_num = get_u32(array_rec + 16);
+      if( !range_valid(figure_first, figure_num, sections.figure_count) )
+        return false;
+      *size += arena_size<FigureListEntry>(figure_num);
+
+      for(uint32_t k=figure_first; k < figure_first + figure_num; k++)
+        {
+          const uint8_t *figure_rec = sections.figures + 4 * BANK_FIGURE_WORDS * k;
+          uint32_t chord_first = get_u32(figure_rec + 16), chord_num = get_u32(figure_rec + 20);
+          uint32_t pitch_first = get_u32(figure_rec + 24), pitch_num = get_u32(figure_rec + 28);
+          if( !range_valid(chord_first, chord_num, sections.chord_count) ||
+              !range_valid(pitch_first, pitch_num, sections.pitch_count) )
+            return false;
+          *size += arena_size<ChordPair>(chord_num);
+          if( !lazy_pitchs ) /* a note takes 12 bytes at most, @see PitchSequence */
+            *size += std::min<std::size_t>(get_u32(figure_rec + 32), std::size_t(12) * pitch_num);
+        }
+    }
+  return true;
+}
+
+static void read_values(std::vector<int> &dst, const BankSections &sections, uint32_t first, uint32_t count)
+{
+  dst.resize(count);
+  for(uint32_t i=0; i < count; i++)
+    dst[i] = get_i32(sections.values + 4 * (first + i));
+}
+
+static util::ArrayRef<int> decode_values(util::Arena &arena, const BankSections &sections, uint32_t first, uint32_t count)
+{
+  int *values = arena.allocateArray<int>(count);
+  for(uint32_t i=0; i < count; i++)
+    values[i] = get_i32(sections.values + 4 * (first + i));
+  return util::ArrayRef<int>(values, count);
+}
+
+static void decode_figure(util::Arena &arena, const BankSections &sections, const uint8_t *rec,
+                          LazyPitchDecoder *lazyPitchs, std::vector<PitchNote> &pitchs, FigureListEntry *figure)
+{
+  uint32_t chord_first = get_u32(rec + 16), chord_num = get_u32(rec + 20);
+  uint32_t pitch_first = get_u32(rec + 24), pitch_num = get_u32(rec + 28);
+
+  ChordPair *chords = arena.allocateArray<ChordPair>(chord_num);
+  for(uint32_t i=0; i < chord_num; i++)
+    {
+      const uint8_t *chord_rec = sections.chords + 4 * BANK_CHORD_WORDS * (chord_first + i);
+      new (&chords[i]) ChordPair(get_i32(chord_rec), get_i32(chord_rec + 4));
+    }
+
+  figure->segment = get_i32(rec);
+  figure->offset  = get_i32(rec + 4);
+  figure->begin   = get_u32(rec + 8);
+  figure->end     = get_u32(rec + 12);
+  figure->chord   = util::ArrayRef<ChordPair>(chords, chord_num);
+
+  const uint8_t *pitch_records = sections.pitches + 4 * BANK_PITCH_WORDS * pitch_first;
+  if( lazyPitchs )
+    {
+      figure->setLazyPitchs(lazyPitchs, pitch_records, pitch_num, get_i32(rec + 36), get_i32(rec + 40));
+    }
+  else
+    {
+      LazyPitchDecoder::decodeRecords(pitchs, pitch_records, pitch_num);
+      figure->setPitchs(arena, pitchs.empty() ? 0l : &pitchs[0], pitch_num);
+    }
+}
+
+/**
+ * @brief Decode an entry record validated by measure_entry() into the arena.
+ */
+static KnowledgeEntry *decode_entry(util::Arena &arena, const BankSections &sections, const uint8_t *rec,
+                                    LazyPitchDecoder *lazyPitchs, std::vector<PitchNote> &pitchs)
+{
+  uint32_t array_first = get_u32(rec + 24), array_num = get_u32(rec + 28);
+  uint32_t tempo_bits = get_u32(rec + 8);
+  uint32_t flags = get_u32(rec + 20);
+
+  KnowledgeEntry *entry = arena.create<KnowledgeEntry>();
+  entry->key            = get_i32(rec);
+  entry->scale          = get_i32(rec + 4);
+  std::memcpy(&entry->tempo, &tempo_bits, sizeof tempo_bits);
+  entry->time_beats     = get_i32(rec + 12);
+  entry->time_beat_type = get_i32(rec + 16);
+  entry->for_rhythm     = (flags & BANK_FLAG_RHYTHM) != 0;
+  entry->for_chord      = (flags & BANK_FLAG_CHORD) != 0;
+  entry->for_timbre     = (flags & BANK_FLAG_TIMBRE) != 0;
+  entry->character      = decode_values(arena, sections, get_u32(rec + 32), get_u32(rec + 36));
+  entry->genre          = decode_values(arena, sections, get_u32(rec + 40), get_u32(rec + 44));
+
+  KnowledgeArrayEntry *arrays = arena.createArray<KnowledgeArrayEntry>(array_num);
+  for(uint32_t j=0; j < array_num; j++)
+    {
+      const uint8_t *array_rec = sections.arrays + 4 * BANK_ARRAY_WORDS * (array_first + j);
+      uint32_t figure_first = get_u32(array_rec + 12), figure_num = get_u32(array_rec + 16);
+
+      FigureListEntry *figures = arena.createArray<FigureListEntry>(figure_num);
+      for(uint32_t k=0; k < figure_num; k++)
+        decode_figure(arena, sections, sections.figures + 4 * BANK_FIGURE_WORDS * (figure_first + k), lazyPitchs, pitchs, &figures[k]);
+
+      KnowledgeArrayEntry *arrayEntry = &arrays[j];
+      arrayEntry->timbre_bank   = get_i32(array_rec);
+      arrayEntry->figure_bank   = get_i32(array_rec + 4);
+      arrayEntry->figure_class  = get_i32(array_rec + 8);
+      arrayEntry->track_figure_bank = theory::get_track_figure_bank(arrayEntry->timbre_bank,
+                                                                    arrayEntry->figure_bank,
+                                                                    arrayEntry->figure_class);
+      arrayEntry->figure_list   = util::ArrayRef<FigureListEntry>(figures, figure_num);
+      theory::resolve_form_figures(arrayEntry->form_figures, arrayEntry->last_form_figures, arrayEntry->figure_list);
+    }
+  entry->m_knowledgeArrayEntries = util::ArrayRef<KnowledgeArrayEntry>(arrays, array_num);
+  return entry;
+}
+
+/**
+ * @brief Decode the entries of a bank file passing the filter of options.
+ * @param lazyPitchs Decoder to attach the pitches to, NULL = decode them at once.
+ */
+int KnowledgeBank::decode(KnowledgeModel &model, const uint8_t *data, std::size_t size,
+                          const KnowledgeLoadOptions &options, LazyPitchDecoder *lazyPitchs)
+{
+  /*
+   * Validate the header, then all the sections before touching any record.
+   * The pitches are only checked when they are decoded at once, which reads all of them anyway;
+   * their records are fixed-size, so a corrupted one gives a wrong note but never a wrong access.
+   */
+  if( size < BANK_HEADER_SIZE || std::memcmp(data, bank_magic, sizeof bank_magic) )
+    return -RC_PARSE_DATABASE;
+
+  const uint8_t *words = data + sizeof bank_magic;
+  if( get_u32(words + 4 * HDR_VERSION) != KNOWLEDGE_BANK_VERSION ||
+      get_u32(words + 4 * HDR_HEADER_SIZE) != BANK_HEADER_SIZE ||
+      get_u32(words + 4 * HDR_HEADER_CRC) != crc32(data, sizeof bank_magic + 4 * HDR_HEADER_CRC) )
+    return -RC_PARSE_DATABASE;
+
+  uint32_t entry_count  = get_u32(words + 4 * HDR_ENTRY_COUNT);
+  uint32_t array_count  = get_u32(words + 4 * HDR_ARRAY_COUNT);
+  uint32_t figure_count = get_u32(words + 4 * HDR_FIGURE_COUNT);
+  uint32_t chord_count  = get_u32(words + 4 * HDR_CHORD_COUNT);
+  uint32_t pitch_count  = get_u32(words + 4 * HDR_PITCH_COUNT);
+  uint32_t value_count  = get_u32(words + 4 * HDR_VALUE_COUNT);
+  uint32_t payload_size = get_u32(words + 4 * HDR_PAYLOAD_SIZE);
+
+  uint64_t expected_size = 4 * (uint64_t(entry_count) * BANK_ENTRY_WORDS +
+                                uint64_t(array_count) * BANK_ARRAY_WORDS +
+                                uint64_t(figure_count) * BANK_FIGURE_WORDS +
+                                uint64_t(chord_count) * BANK_CHORD_WORDS +
+                                uint64_t(pitch_count) * BANK_PITCH_WORDS +
+                                uint64_t(value_count));
+  if( expected_size != payload_size || size - BANK_HEADER_SIZE != payload_size )
+    return -RC_PARSE_DATABASE;
+
+  const uint8_t *payload = data + BANK_HEADER_SIZE;
+  BankSections sections;
+  sections.entries  = payload;
+  sections.arrays   = sections.entries + 4 * BANK_ENTRY_WORDS * entry_count;
+  sections.figures  = sections.arrays  + 4 * BANK_ARRAY_WORDS * array_count;
+  sections.chords   = sections.figures + 4 * BANK_FIGURE_WORDS * figure_count;
+  sections.pitches  = sections.chords  + 4 * BANK_CHORD_WORDS * chord_count;
+  sections.values   = sections.pitches + 4 * BANK_PITCH_WORDS * pitch_count;
+  sections.array_count  = array_count;
+  sections.figure_count = figure_count;
+  sections.chord_count  = chord_count;
+  sections.pitch_count  = pitch_count;
+  sections.value_count  = value_count;
+
+  uint32_t crc = crc32(sections.entries, sections.pitches - sections.entries);
+  crc = crc32(sections.values, 4 * value_count, crc);
+  if( get_u32(words + 4 * HDR_PAYLOAD_CRC) != crc )
+    return -RC_PARSE_DATABASE;
+  if( !lazyPitchs &&
+      get_u32(words + 4 * HDR_PITCH_CRC) != crc32(sections.pitches, sections.values - sections.pitches) )
+    return -RC_PARSE_DATABASE;
+
+  /*
+   * Validate all the records and select the entries passing the filter,
+   * before allocating a single block of the arena for the selected ones.
+   */
+  std::vector<uint32_t> selected;
+  std::vector<int> characters, genres;
+  std::vector<PitchNote> pitchs;
+  std::size_t decoded_size = 0;
+  for(uint32_t i=0; i < entry_count; i++)
+    {
+      const uint8_t *rec = sections.entries + 4 * BANK_ENTRY_WORDS * i;
+      std::size_t size = 0;
+
+      /*
+       * Filter first, so that the entries given up are not measured at all.
+       */
+      if( options.filtered() )
+        {
+          if( !values_valid(sections, rec) )
+            return -RC_PARSE_DATABASE;
+          uint32_t flags = get_u32(rec + 20);
+          int roles = ((flags & BANK_FLAG_RHYTHM) ? KNOWLEDGE_ROLE_RHYTHM : 0) |
+                      ((flags & BANK_FLAG_CHORD) ? KNOWLEDGE_ROLE_CHORD : 0) |
+                      ((flags & BANK_FLAG_TIMBRE) ? KNOWLEDGE_ROLE_TIMBRE : 0);
+          read_values(characters, sections, get_u32(rec + 32), get_u32(rec + 36));
+          read_values(genres, sections, get_u32(rec + 40), get_u32(rec + 44));
+          if( !options.accepts(util::ArrayRef<int>(characters), util::ArrayRef<int>(genres), roles) )
+            continue;
+        }
+      if( !measure_entry(sections, rec, lazyPitchs != 0l, &size) )
+        return -RC_PARSE_DATABASE;
+      selected.push_back(i);
+      decoded_size += size;
+    }
+  if( entry_count == 0 )
+    return -RC_PARSE_DATABASE;
+
+  /*
+   * Every selected entry is decoded with all its children packed next to it.
+   */
+  model.m_arena.reserve(decoded_size);
+  model.m_knowledgeEntries.reserve(model.m_knowledgeEntries.size() + selected.size());
+
+  for(std::size_t i=0; i < selected.size(); i++)
+    {
+      const uint8_t *rec = sections.entries + 4 * BANK_ENTRY_WORDS * selected[i];
+      KnowledgeEntry *entry = decode_entry(model.m_arena, sections, rec, lazyPitchs, pitchs);
+      KnowledgeModel::measureEntry(entry);
+      entry->index = model.m_knowledgeEntries.size();
+      model.m_knowledgeEntries.push_back(entry);
+    }
+  model.buildIndexes();
+  return 0;
+}
+
+}
@@ -0,0 +1,117 @@
+/*
+ *  libautomusic (Library for Image-based Algorithmic Musical Composition)
+ *  Copyright (C) 2018, automusic.
+ *
+ *  THIS PROJECT IS FREE SOFTWARE; YOU CAN REDISTRIBUTE IT AND/OR
+ *  MODIFY IT UNDER THE TERMS OF THE GNU LESSER GENERAL PUBLIC LICENSE(GPL)
+ *  AS PUBLISHED BY THE FREE SOFTWARE FOUNDATION; EITHER VERSION 2.1
+ *  OF THE LICENSE, OR (AT YOUR OPTION) ANY LATER VERSION.
+ *
+ *  THIS PROJECT IS DISTRIBUTED IN THE HOPE THAT IT WILL BE USEFUL,
+ *  BUT WITHOUT ANY WARRANTY; WITHOUT EVEN THE IMPLIED WARRANTY OF
+ *  MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE.  SEE THE GNU
+ *  LESSER GENERAL PUBLIC LICENSE FOR MORE DETAILS.
+ */
+#ifndef KNOWLEDGE_BANK_H
+#define KNOWLEDGE_BANK_H
+
+#include <cstddef>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "typedefs.h"
+#include "util-arena.h"
+#include "util-pitch-sequence.h"
+
+namespace autocomp
+{
+
+/*
+ * Compiled knowledge bank.
+ * All the bank files listed by meta-data/index.meta are flattened into one binary file,
+ * which is mapped into memory and decoded without any YAML parsing.
+ *
+ * Layout (all the fields are little-endian 32-bit words):
+ *   header    64 bytes, @see knowledge-bank.cc
+ *   entries   entry_count  * 12 words (key, scale, tempo, beats, beat type, flags, arrays, characters, genres)
+ *   arrays    array_count  * 5 words  (timbre bank, figure bank, class, figures)
+ *   figures   figure_count * 11 words (segment, offset, begin, end, chords, pitches, encoded pitch bytes, lowest and highest pitch)
+ *   chords    chord_count  * 2 words  (root, sign)
+ *   pitches   pitch_count  * 3 words  (pitch | velocity << 8, start, end)
+ *   values    value_count  * 1 word   (characters and genres)
+ * Ranges of child records are stored as (first, count) pairs indexing the following sections.
+ * The pitches have their own CRC, so that loading them lazily never reads the whole section.
+ * The header keeps a stamp of the sources, so that a bank older than them is not loaded.
+ */
+#define KNOWLEDGE_BANK_VERSION 4
+#define KNOWLEDGE_BANK_FILENAME "knowledge.bank.bin"
+
+class KnowledgeModel;
+class KnowledgeLoadOptions;
+
+class MappedFile
+{
+public:
+  MappedFile();
+  ~MappedFile();
+
+  int open(const char *filename, bool prefetch = true);
+  void close();
+  inline const uint8_t *data() const { return m_data; }
+  inline std::size_t size() const { return m_size; }
+
+private:
+  MappedFile(const MappedFile &);
+  MappedFile &operator=(const MappedFile &);
+
+  const uint8_t *m_data;
+  std::size_t m_size;
+  bool m_mapped;
+};
+
+/**
+ * @brief Decoder of the pitches of a compiled bank on demand.
+ * The bank file stays mapped while the model is alive, and the pitches of a figure are decoded
+ * from their records at the first access, then cached in the arena of the decoder in the compact
+ * encoding of util::PitchSequence.
+ */
+class LazyPitchDecoder
+{
+public:
+  LazyPitchDecoder() {}
+
+  inline MappedFile &file() { return m_file; }
+  const uint8_t *decode(std::atomic<const uint8_t *> &dst, const uint8_t *records, std::size_t count);
+
+  static void decodeRecords(std::vector<PitchNote> &dst, const uint8_t *records, std::size_t count);
+
+private:
+  LazyPitchDecoder(const LazyPitchDecoder &);
+  LazyPitchDecoder &operator=(const LazyPitchDecoder &);
+
+  MappedFile m_file;
+  std::mutex m_mutex;
+  util::Arena m_arena;
+  std::vector<PitchNote> m_pitchs; /* decoded records to encode */
+};
+
+class KnowledgeBank
+{
+public:
+  static int compile(const KnowledgeModel &model, const char *filename);
+  static int load(KnowledgeModel &model, const char *filename, const KnowledgeLoadOptions &options,
+                  uint32_t sourceStamp = 0);
+  static uint32_t sourceStamp(const char *modelPath, const std::vector<std::string> &filenames);
+
+private:
+  static int decode(KnowledgeModel &model, const uint8_t *data, std::size_t size,
+                    const KnowledgeLoadOptions &options, LazyPitchDecoder *lazyPitchs);
+};
+
+uint32_t crc32(const uint8_t *data, std::size_t size, uint32_t crc = 0);
+
+}
+
+#endif
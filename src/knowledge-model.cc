@@ -15,15 +15,25 @@
 #include <iostream>
 #include <fstream>
 #include <cstdio>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
 
 #include <yaml-cpp/yaml.h>
 #include "libautomusic.h"
 #include "knowledge-model.h"
+#include "knowledge-bank.h"
+#include "knowledge-source.h"
+#include "theory-harmonics.h"
+#include "theory-orchestration.h"
+#include "util-parallel.h"
+#include "util-log.h"
 
 namespace autocomp
 {
 
 KnowledgeModel::KnowledgeModel()
+    : m_sourceStamp(0)
 {
 }
 
@@ -32,252 +42,715 @@ KnowledgeModel::~KnowledgeModel()
   removeEntries();
 }
 
-void KnowledgeModel::removeEntries()
+/**
+ * @brief Encode the pitches into the arena.
+ */
+void FigureListEntry::setPitchs(util::Arena &arena, const PitchNote *pitchs, std::size_t count)
 {
-  for(std::vector<const KnowledgeEntry *>::const_iterator iter = m_knowledgeEntries.begin(); iter != m_knowledgeEntries.end(); iter++)
-    delete const_cast<KnowledgeEntry *>(*iter);
-  m_knowledgeEntries.clear();
+  pitch_low = pitch_high = 0;
+  for(std::size_t i=0; i < count; i++)
+    {
+      if( i == 0 || pitchs[i].pitch < pitch_low )
+        pitch_low = pitchs[i].pitch;
+      if( i == 0 || pitchs[i].pitch > pitch_high )
+        pitch_high = pitchs[i].pitch;
+    }
+  uint8_t *data = arena.allocateArray<uint8_t>(util::PitchSequence::encodedSize(pitchs, count));
+  if( data )
+    util::PitchSequence::encode(data, pitchs, count);
+  m_pitchCount = count;
+  m_pitchDecoder = 0l;
+  m_pitchRecords = 0l;
+  m_pitchData.store(data, std::memory_order_release);
 }
 
-int KnowledgeModel::loadModels(const char *modelPath)
+/**
+ * @brief Attach the pitch records of a compiled bank, which are decoded at the first access.
+ * @param records The records in the mapped bank file, which must outlive the entry.
+ * @param low The lowest pitch, stored in the bank so that the records are not read before.
+ * @param high The highest pitch.
+ */
+void FigureListEntry::setLazyPitchs(LazyPitchDecoder *decoder, const uint8_t *records, std::size_t count, int low, int high)
 {
-  char filename_buff[4096];
-  char filename_pattern[256];
-  try
-    {
-      std::snprintf(filename_buff, sizeof filename_buff, "%s/meta-data/index.meta", modelPath);
+  pitch_low = low;
+  pitch_high = high;
+  m_pitchCount = count;
+  m_pitchDecoder = decoder;
+  m_pitchRecords = records;
+  m_pitchData.store(0l, std::memory_order_release);
+}
 
-      YAML::Node root = YAML::LoadFile(filename_buff);
-      YAML::Node index = root["index"];
-      std::string pattern = index["filename-pattern"].as<std::string>();
-      int index_start = index["index-start"].as<int>();
-      int index_end = index["index-end"].as<int>();
+const uint8_t *FigureListEntry::decodePitchs() const
+{
+  return m_pitchDecoder->decode(m_pitchData, m_pitchRecords, m_pitchCount);
+}
 
-      for(int i=index_start; i <= index_end; i++)
-        {
-          std::snprintf(filename_pattern, sizeof filename_pattern, "%%s/%s", pattern.c_str());
-          std::snprintf(filename_buff, sizeof filename_buff, filename_pattern, modelPath, i);
+bool KnowledgeLoadOptions::filtered() const
+{
+  return !characters.empty() || !genres.empty() || roles != 0;
+}
 
-          std::cout << "loadModels(): " << filename_buff << std::endl;
+static bool any_of_values(const std::vector<int> &wanted, const util::ArrayRef<int> &values)
+{
+  if( wanted.empty() )
+    return true;
+  for(std::size_t i=0; i < values.size(); i++)
+    if( std::find(wanted.begin(), wanted.end(), values[i]) != wanted.end() )
+      return true;
+  return false;
+}
 
-          if (int rc = loadModelFile(filename_buff))
-            return rc;
-        }
-      return 0;
-    }
-  catch( YAML::Exception &excp )
+/**
+ * @brief Check if an entry passes the filter.
+ * @param entry_roles Mask of KNOWLEDGE_ROLE_* of the entry.
+ */
+bool KnowledgeLoadOptions::accepts(const util::ArrayRef<int> &entry_characters, const util::ArrayRef<int> &entry_genres, int entry_roles) const
+{
+  return any_of_values(characters, entry_characters) &&
+         any_of_values(genres, entry_genres) &&
+         (roles == 0 || (roles & entry_roles) != 0);
+}
+
+SharedKnowledgeModel::SharedKnowledgeModel(const std::shared_ptr<const KnowledgeModel> &knowledgeModel)
+    : m_knowledgeModel(knowledgeModel),
+      m_generation(1)
+{
+}
+
+/**
+ * @brief Get a reference to the current generation, which stays valid while it is held.
+ */
+std::shared_ptr<const KnowledgeModel> SharedKnowledgeModel::acquire() const
+{
+  return std::atomic_load(&m_knowledgeModel);
+}
+
+/**
+ * @brief Replace the current generation by a loaded model.
+ * The previous generation is released once no reader holds it anymore.
+ */
+void SharedKnowledgeModel::publish(const std::shared_ptr<const KnowledgeModel> &knowledgeModel)
+{
+  std::atomic_store(&m_knowledgeModel, knowledgeModel);
+  ++m_generation;
+}
+
+void KnowledgeModel::removeEntries()
+{
+  m_knowledgeEntries.clear();
+  clearIndexes();
+  m_arena.clear();
+  m_pitchDecoder.reset(); /* after the entries, which refer to its mapping */
+  m_sourceStamp = 0;
+}
+
+void KnowledgeModel::clearIndexes()
+{
+  m_chordPlans.clear();
+  m_characterIndex.clear();
+  m_chordCharacterIndex.clear();
+  m_timbreGenreIndex.clear();
+  m_characterGenreIndex.clear();
+  m_timbreTrackIndex.clear();
+  m_rhythmEntries.clear();
+  m_chordEntries.clear();
+  m_timbreEntries.clear();
+}
+
+static void unique_values(std::vector<int> &dst, const util::ArrayRef<int> &src)
+{
+  dst.clear();
+  for(std::size_t i=0; i < src.size(); i++)
     {
-      std::cerr << "loadModels(): " << excp.what() << std::endl;
-      return -RC_OPENFILE;
+      if( std::find(dst.begin(), dst.end(), src[i]) == dst.end() )
+        dst.push_back(src[i]);
     }
 }
 
-int KnowledgeModel::loadModelFile(const char *filename)
+/**
+ * @brief Add an entry appended to the models into the indexes.
+ * An entry is added to a list at most once, even if it repeats a character or genre.
+ */
+void KnowledgeModel::indexEntry(const KnowledgeEntry *entry)
 {
-  using namespace std;
-  int rc = 0;
-  try
+  std::vector<int> characters, genres;
+  unique_values(characters, entry->character);
+  unique_values(genres, entry->genre);
+
+  for(std::size_t i=0; i < characters.size(); i++)
+    {
+      m_characterIndex[characters[i]].push_back(entry);
+      if( entry->for_chord )
+        m_chordCharacterIndex[characters[i]].push_back(entry);
+      for(std::size_t k=0; k < genres.size(); k++)
+        m_characterGenreIndex[std::make_pair(characters[i], genres[k])].push_back(entry);
+    }
+  if( entry->for_timbre )
     {
-      int entry_count = 0;
-      YAML::Node root = YAML::LoadFile(filename);
-      YAML::Node knowledge_array = root["knowledge_array"];
-      YAML::Node knowledge_constraint = root["knowledge_constraint"];
+      for(std::size_t k=0; k < genres.size(); k++)
+        m_timbreGenreIndex[genres[k]].push_back(entry);
+    }
 
-      if( knowledge_array.IsSequence() && knowledge_constraint.IsMap() )
+  /*
+   * Index the tracks of the entry for every figure bank and the figure classes it contains.
+   */
+  std::vector<int> classes;
+  for(std::size_t j=0; j < entry->m_knowledgeArrayEntries.size(); j++)
+    {
+      int figure_class = entry->m_knowledgeArrayEntries[j].figure_class;
+      if( std::find(classes.begin(), classes.end(), figure_class) == classes.end() )
+        classes.push_back(figure_class);
+    }
+  for(int figure_bank = theory::FIGURE_BANK_PIANO; figure_bank <= theory::FIGURE_BANK_UNSORTED; figure_bank++)
+    {
+      for(std::size_t k=0; k < classes.size(); k++)
         {
-          KnowledgeEntry *entry = appendKnowledgeEntry();
+          bool related;
+          int track = theory::find_timbre_track(entry, figure_bank, classes[k], &related);
+          if( track < 0 )
+            continue;
+          KnowledgeTrackList &tracks = m_timbreTrackIndex[std::make_pair(figure_bank, classes[k])];
+          if( related )
+            tracks.related.push_back(KnowledgeTrack(entry, track));
+          else
+            tracks.matched.push_back(KnowledgeTrack(entry, track));
+        }
+    }
 
-          for(std::size_t i=0; i < knowledge_array.size(); i++)
-            {
-              YAML::Node knowledge = knowledge_array[i];
+  if( entry->for_rhythm )
+    m_rhythmEntries.push_back(entry);
+  if( entry->for_chord )
+    m_chordEntries.push_back(entry);
+  if( entry->for_timbre )
+    m_timbreEntries.push_back(entry);
+}
 
-              KnowledgeArrayEntry *arrayEntry = entry->appendKnowledgeArrayEntry();
+/**
+ * @brief Compute the statistics of a parsed entry.
+ */
+void KnowledgeModel::measureEntry(KnowledgeEntry *entry)
+{
+  entry->chord_count = 0;
+  entry->out_of_key_chord_count = 0;
+  entry->bars = 0;
+  entry->pitch_low = entry->pitch_high = 0;
+  bool has_pitch = false;
 
-              arrayEntry->timbre_bank   = knowledge["timbre_bank"].as<int>();
-              arrayEntry->figure_bank   = knowledge["figure_bank"].as<int>();
-              arrayEntry->figure_class  = knowledge["class"].as<int>();
-              YAML::Node figure_list    = knowledge["figure_list"];
+  for(std::size_t i=0; i < entry->m_knowledgeArrayEntries.size(); i++)
+    {
+      const util::ArrayRef<FigureListEntry> &figureList = entry->m_knowledgeArrayEntries[i].figure_list;
+      for(std::size_t j=0; j < figureList.size(); j++)
+        {
+          const FigureListEntry &figure = figureList[j];
 
-              if( figure_list.IsSequence() )
+          if( i == 0 )
+            {
+              for(std::size_t k=0; k < figure.chord.size(); k++)
                 {
-                  for(std::size_t j=0; j < figure_list.size(); j++)
-                    {
-                      YAML::Node figure = figure_list[j];
-                      FigureListEntry *figureListEntry = arrayEntry->appendFigureListEntry();
-
-                      /*
-                       * Read-in and parse chords
-                       */
-                      YAML::Node chords = figure["chord"];
-                      if( chords.IsSequence() )
-                        {
-                          for(std::size_t k=0; k < chords.size(); k++)
-                            {
-                              YAML::Node chordpair = chords[k];
-                              if( chordpair.IsSequence() )
-                                {
-                                  figureListEntry->appendChord(ChordPair(chordpair[0].as<int>(),
-                                                                         chordpair[1].as<int>()));
-                                }
-                            }
-                        }
-
-                      figureListEntry->segment  = figure["segment"].as<int>();
-                      figureListEntry->offset   = figure["offset"].as<int>();
-                      figureListEntry->begin    = figure["begin"].as<uint32_t>();
-                      figureListEntry->end      = figure["end"].as<uint32_t>();
-
-                      /*
-                       * Read-in and parse pitches
-                       */
-                      YAML::Node pitchs = figure["pitch"];
-                      if( pitchs.IsSequence() )
-                        {
-                          for(std::size_t k=0; k < pitchs.size(); k+=4)
-                            {
-                              uint32_t pitch = pitchs[k].as<uint32_t>();
-                              uint32_t velocity = pitchs[k+1].as<uint32_t>();
-
-                              if(pitch > 255 || velocity > 255)
-                                throw YAML::RepresentationException(YAML::Mark(), "Pitch or velocity is out of range.");
-
-                              figureListEntry->appendPitch(PitchNote(static_cast<uint8_t>(pitch),
-                                                                     static_cast<uint8_t>(velocity),
-                                                                     pitchs[k+2].as<int32_t>(),
-                                                                     pitchs[k+3].as<int32_t>()));
-                            }
-                        }
-                    }
+                  if( !theory::chord_is_in_key(figure.chord[k], entry->key, entry->scale) )
+                    ++entry->out_of_key_chord_count;
                 }
+              entry->chord_count += figure.chord.size();
             }
 
-          /*
-           * Get extra parameters from knowledge constraint
-           */
-          entry->key            = knowledge_constraint["key"].as<int>();
-          entry->scale          = knowledge_constraint["scale"].as<int>();
-          entry->tempo          = knowledge_constraint["tempo"].as<float>();
-          entry->time_beats     = knowledge_constraint["time_beats"].as<int>();
-          entry->time_beat_type = knowledge_constraint["time_beat_type"].as<int>();
-          entry->for_rhythm     = knowledge_constraint["for_rhythm"].as<bool>();
-          entry->for_chord      = knowledge_constraint["for_chord"].as<bool>();
-          entry->for_timbre     = knowledge_constraint["for_timbre"].as<bool>();
-
-          YAML::Node character = knowledge_constraint["character"];
-          if( character.IsSequence() )
+          entry->bars = std::max(entry->bars, figure.end);
+
+          if( figure.pitchCount() )
             {
-              for(std::size_t k=0; k < character.size(); k+=4)
-                {
-                  entry->appendCharacter(character[k].as<int>());
-                }
+              if( !has_pitch || figure.pitch_low < entry->pitch_low )
+                entry->pitch_low = figure.pitch_low;
+              if( !has_pitch || figure.pitch_high > entry->pitch_high )
+                entry->pitch_high = figure.pitch_high;
+              has_pitch = true;
             }
-          YAML::Node genre = knowledge_constraint["genre"];
-            if( genre.IsSequence() )
-              {
-                for(std::size_t k=0; k < genre.size(); k+=4)
-                  {
-                    entry->appendGenre(genre[k].as<int>());
-                  }
-              }
-
-          entry_count++;
         }
+    }
+
+  entry->out_of_key_ratio = entry->chord_count ? float(entry->out_of_key_chord_count) / entry->chord_count : 1.0f;
+}
+
+void KnowledgeModel::buildIndexes()
+{
+  clearIndexes();
+  for(std::size_t i=0; i < m_knowledgeEntries.size(); i++)
+    indexEntry(m_knowledgeEntries[i]);
+}
+
+void KnowledgeLoadReport::clear()
+{
+  compiled = false;
+  load_ms = 0;
+  files.clear();
+  entries = arrays = figures = chords = notes = values = 0;
+  entry_bytes = array_bytes = figure_bytes = chord_bytes = pitch_bytes = value_bytes = 0;
+  arena_bytes = arena_capacity = index_bytes = mapped_bytes = resident_bytes = 0;
+}
+
+static double elapsed_ms(const std::chrono::steady_clock::time_point &start)
+{
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
 
-      rc = entry_count > 0 ? 0 : -RC_PARSE_DATABASE;
+static void count_entry(const KnowledgeEntry *entry, unsigned int *figures, unsigned int *notes)
+{
+  for(std::size_t i=0; i < entry->m_knowledgeArrayEntries.size(); i++)
+    {
+      const util::ArrayRef<FigureListEntry> &figureList = entry->m_knowledgeArrayEntries[i].figure_list;
+      *figures += figureList.size();
+      for(std::size_t j=0; j < figureList.size(); j++)
+        *notes += figureList[j].pitchCount();
     }
-  catch( YAML::Exception &excp )
+}
+
+/*
+ * Heap used by the indexes, counting the nodes of a map as the value and 4 pointers.
+ */
+template <typename T>
+  static inline std::size_t heap_bytes(const std::vector<T> &src)
     {
-      std::cerr << "loadModelFile(): " << excp.what() << std::endl;
-      rc = -RC_OPENFILE;
+      return src.capacity() * sizeof(T);
     }
-  if(rc) { removeEntries(); }
-  return rc;
+
+static inline std::size_t heap_bytes(const KnowledgeTrackList &src)
+{
+  return heap_bytes(src.matched) + heap_bytes(src.related);
 }
 
+template <typename K, typename V>
+  static std::size_t heap_bytes(const std::map<K, V> &src)
+    {
+      std::size_t bytes = src.size() * (sizeof(typename std::map<K, V>::value_type) + 4 * sizeof(void *));
+      for(typename std::map<K, V>::const_iterator iter = src.begin(); iter != src.end(); ++iter)
+        bytes += heap_bytes(iter->second);
+      return bytes;
+    }
+
 /**
- * @brief Get entries of chord knowledge by music character
+ * @brief Complete the report of a loading with the totals of the loaded models.
  */
-int KnowledgeModel::getChord(std::vector<const KnowledgeEntry *> &dst, int character)
+void KnowledgeModel::finishReport(double load_ms, int rc)
 {
-  dst.clear();
-  std::size_t size = models().size();
-  for(std::size_t i=0; i < size; i++)
+  KnowledgeLoadReport &report = m_loadReport;
+  report.load_ms = load_ms;
+  report.entries = m_knowledgeEntries.size();
+
+  for(std::size_t i=0; i < m_knowledgeEntries.size(); i++)
     {
-      const KnowledgeEntry *entry = models()[i];
-      std::size_t characterSize = entry->character.size();
-      for(std::size_t k=0; k < characterSize; k++)
+      const KnowledgeEntry *entry = m_knowledgeEntries[i];
+      report.arrays += entry->m_knowledgeArrayEntries.size();
+      report.values += entry->character.size() + entry->genre.size();
+      for(std::size_t j=0; j < entry->m_knowledgeArrayEntries.size(); j++)
         {
-          if( character == entry->character[k] && entry->for_chord )
-            dst.push_back(entry);
+          const util::ArrayRef<FigureListEntry> &figureList = entry->m_knowledgeArrayEntries[j].figure_list;
+          report.figures += figureList.size();
+          for(std::size_t k=0; k < figureList.size(); k++)
+            {
+              const FigureListEntry &figure = figureList[k];
+              report.chords += figure.chord.size();
+              report.notes += figure.pitchCount();
+              if( figure.pitchsDecoded() )
+                report.pitch_bytes += figure.pitchs().byteSize();
+            }
         }
     }
-  return dst.size() ? 0 : -RC_FAILED;
+
+  report.entry_bytes    = report.entries * sizeof(KnowledgeEntry);
+  report.array_bytes    = report.arrays * sizeof(KnowledgeArrayEntry);
+  report.figure_bytes   = report.figures * sizeof(FigureListEntry);
+  report.chord_bytes    = report.chords * sizeof(ChordPair);
+  report.value_bytes    = report.values * sizeof(int);
+  report.arena_bytes    = m_arena.size();
+  report.arena_capacity = m_arena.capacity();
+  report.index_bytes    = heap_bytes(m_knowledgeEntries) +
+                          heap_bytes(m_characterIndex) + heap_bytes(m_chordCharacterIndex) +
+                          heap_bytes(m_timbreGenreIndex) + heap_bytes(m_characterGenreIndex) +
+                          heap_bytes(m_timbreTrackIndex) +
+                          heap_bytes(m_rhythmEntries) + heap_bytes(m_chordEntries) + heap_bytes(m_timbreEntries);
+  report.mapped_bytes   = m_pitchDecoder ? m_pitchDecoder->file().size() : 0;
+  report.resident_bytes = report.arena_capacity + report.index_bytes + report.mapped_bytes;
+
+  if( rc == 0 )
+    util::log(util::LOG_INFO, "loadModels(): %u entries, %u figures, %u notes, %zu KB resident in %.1f ms",
+              report.entries, report.figures, report.notes, report.resident_bytes / 1024, report.load_ms);
 }
 
-/**
- * @brief Get entries of timbre knowledge by music genre
+/*
+ * List the bank sources of index.meta in the index range of options.
  */
-int KnowledgeModel::getTimbreBank(std::vector<const KnowledgeEntry *> &dst, int genre)
+static void list_sources(std::vector<std::string> &dst, const char *modelPath, const KnowledgeLoadOptions &options)
 {
+  char filename_buff[4096];
+  char filename_pattern[256];
+  std::snprintf(filename_buff, sizeof filename_buff, "%s/meta-data/index.meta", modelPath);
+
+  YAML::Node root = YAML::LoadFile(filename_buff);
+  YAML::Node index = root["index"];
+  std::string pattern = index["filename-pattern"].as<std::string>();
+  int index_start = options.index_start >= 0 ? options.index_start : index["index-start"].as<int>();
+  int index_end = options.index_end >= 0 ? options.index_end : index["index-end"].as<int>();
+
   dst.clear();
-  std::size_t size = models().size();
-  for(std::size_t i=0; i < size; i++)
+  for(int i=index_start; i <= index_end; i++)
+    {
+      std::snprintf(filename_pattern, sizeof filename_pattern, "%%s/%s", pattern.c_str());
+      std::snprintf(filename_buff, sizeof filename_buff, filename_pattern, modelPath, i);
+      dst.push_back(filename_buff);
+    }
+}
+
+/**
+ * @brief Load the models, preferring the compiled bank if there is one.
+ * The bank sources listed in index.meta are parsed if the compiled bank is absent, invalid or older than them.
+ * Without index.meta or any of the sources, the compiled bank is loaded as is.
+ */
+int KnowledgeModel::loadModels(const char *modelPath, const KnowledgeLoadOptions &options)
+{
+  if( options.index_start >= 0 || options.index_end >= 0 )
+    return loadSourceModels(modelPath, options);
+
+  char filename_buff[4096];
+  std::snprintf(filename_buff, sizeof filename_buff, "%s/%s", modelPath, KNOWLEDGE_BANK_FILENAME);
+
+  uint32_t stamp = 0;
+  try
+    {
+      std::vector<std::string> filenames;
+      list_sources(filenames, modelPath, options);
+      stamp = KnowledgeBank::sourceStamp(modelPath, filenames);
+    }
+  catch( YAML::Exception & )
     {
-      const KnowledgeEntry *entry = models()[i];
-      std::size_t characterSize = entry->character.size();
-      for(std::size_t k=0; k < characterSize; k++)
+    }
+
+  int rc = loadCompiledModels(filename_buff, options, stamp);
+  if( rc != -RC_OPENFILE )
+    {
+      if( rc == 0 )
+        return 0;
+      util::log(util::LOG_WARNING, "loadModels(): falling back to the bank sources.");
+    }
+  return loadSourceModels(modelPath, options);
+}
+
+/**
+ * @brief Load the models from the YAML bank sources listed in index.meta.
+ */
+int KnowledgeModel::loadSourceModels(const char *modelPath, const KnowledgeLoadOptions &options)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  m_loadReport.clear();
+
+  std::vector<std::string> filenames;
+  try
+    {
+      list_sources(filenames, modelPath, options);
+    }
+  catch( YAML::Exception &excp )
+    {
+      util::log(util::LOG_ERROR, "loadModels(): %s", excp.what());
+      return -RC_OPENFILE;
+    }
+
+  /*
+   * Stamp the sources before parsing them, for compiling the models into a bank,
+   * unless they are mixed with other ones or filtered.
+   */
+  uint32_t stamp = m_knowledgeEntries.empty() && !options.filtered() ? KnowledgeBank::sourceStamp(modelPath, filenames) : 0;
+
+  /*
+   * Parse the bank sources concurrently, each one into its own entry and arena.
+   * Files after the first failed one are skipped, as the serial loader stops there.
+   */
+  std::vector<KnowledgeEntry *> entries(filenames.size(), 0l);
+  std::vector<util::Arena> arenas(filenames.size());
+  std::vector<int> results(filenames.size(), 0);
+  std::vector<double> parse_ms(filenames.size(), 0);
+  std::atomic<std::size_t> first_failed(filenames.size());
+
+  util::parallel_for(filenames.size(), options.threads, [&](std::size_t i)
+    {
+      if( i > first_failed )
+        return;
+      std::chrono::steady_clock::time_point parse_start = std::chrono::steady_clock::now();
+      results[i] = parseModelFile(filenames[i].c_str(), options, arenas[i], &entries[i]);
+      parse_ms[i] = elapsed_ms(parse_start);
+      if( results[i] )
+        {
+          std::size_t failed = first_failed;
+          while( i < failed && !first_failed.compare_exchange_weak(failed, i) ) {}
+        }
+    });
+
+  /*
+   * Merge in the index order, so that the models are the same as loaded serially.
+   */
+  int rc = 0;
+  for(std::size_t i=0; i < filenames.size(); i++)
+    {
+      util::log(util::LOG_INFO, "loadModels(): %s (%.2f ms)", filenames[i].c_str(), parse_ms[i]);
+
+      KnowledgeFileReport file;
+      file.filename = filenames[i];
+      file.status = results[i];
+      file.parse_ms = parse_ms[i];
+      file.bytes = arenas[i].size();
+      if( entries[i] )
         {
-          if( genre == entry->genre[k] && entry->for_timbre )
-            dst.push_back(entry);
+          file.entries = 1;
+          count_entry(entries[i], &file.figures, &file.notes);
         }
+      m_loadReport.files.push_back(file);
+
+      if( (rc = results[i]) )
+        break;
+      if( !entries[i] ) /* filtered out */
+        continue;
+      m_arena.merge(arenas[i]);
+      entries[i]->index = m_knowledgeEntries.size();
+      m_knowledgeEntries.push_back(entries[i]);
+      indexEntry(entries[i]);
     }
-  return dst.size() ? 0 : -RC_FAILED;
+  if( rc )
+    removeEntries();
+  else
+    m_sourceStamp = stamp;
+  finishReport(elapsed_ms(start), rc);
+  return rc;
 }
 
-/**
- * @brief Get entries of timbre knowledge by music character
+int KnowledgeModel::loadModelFile(const char *filename)
+{
+  KnowledgeEntry *entry = 0l;
+  util::Arena arena;
+  int rc = parseModelFile(filename, KnowledgeLoadOptions(), arena, &entry);
+  if( rc == 0 )
+    {
+      m_arena.merge(arena);
+      entry->index = m_knowledgeEntries.size();
+      m_knowledgeEntries.push_back(entry);
+      indexEntry(entry);
+      m_sourceStamp = 0; /* no longer the models of a source index */
+    }
+  else
+    removeEntries();
+  return rc;
+}
+
+/*
+ * Read the characters or genres of a knowledge constraint the same way as parseModelFile() does.
  */
-int KnowledgeModel::getKnowledgeEntry(std::vector<const KnowledgeEntry *> &dst, int character)
+static void constraint_values(std::vector<int> &dst, const YAML::Node &node)
 {
   dst.clear();
-  std::size_t size = models().size();
-  for(std::size_t i=0; i < size; i++)
+  if( node.IsSequence() )
+    {
+      for(std::size_t k=0; k < node.size(); k+=4)
+        dst.push_back(node[k].as<int>());
+    }
+}
+
+/*
+ * Read a role flag of a knowledge constraint, a missing one passes the filter and is left to the parser.
+ */
+static int constraint_role(const YAML::Node &node, int role)
+{
+  return !node || node.as<bool>() ? role : 0;
+}
+
+/**
+ * @brief Check the knowledge constraint of a bank source against the filter, without parsing the figures.
+ * The constraint is the top-level map following the figures, so the lines are skipped up to it
+ * and only the tail of the stream is parsed.
+ * @return false if the bank does not pass the filter, true if it does or if the constraint is not found.
+ */
+static bool constraint_accepted(std::istream &stream, const KnowledgeLoadOptions &options)
+{
+  static const char constraint_key[] = "knowledge_constraint:";
+  std::string line;
+  while( std::getline(stream, line) && line.compare(0, sizeof constraint_key - 1, constraint_key) != 0 ) {}
+  if( !stream )
+    return true;
+
+  line.push_back('\n');
+  line.append(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+  YAML::Node constraint = YAML::Load(line)["knowledge_constraint"];
+  if( !constraint.IsMap() )
+    return true;
+
+  std::vector<int> characters, genres;
+  constraint_values(characters, constraint["character"]);
+  constraint_values(genres, constraint["genre"]);
+  int roles = constraint_role(constraint["for_rhythm"], KNOWLEDGE_ROLE_RHYTHM) |
+              constraint_role(constraint["for_chord"], KNOWLEDGE_ROLE_CHORD) |
+              constraint_role(constraint["for_timbre"], KNOWLEDGE_ROLE_TIMBRE);
+  return options.accepts(util::ArrayRef<int>(characters), util::ArrayRef<int>(genres), roles);
+}
+
+/**
+ * @brief Parse a bank source into a new entry allocated in the arena, without touching the model.
+ * If the bank does not pass the filter of options, it is skipped with *dst set to NULL and 0 returned.
+ * This is safe to be called concurrently with different arenas.
+ */
+int KnowledgeModel::parseModelFile(const char *filename, const KnowledgeLoadOptions &options, util::Arena &arena, KnowledgeEntry **dst)
+{
+  using namespace std;
+  int rc = 0;
+  KnowledgeEntry *entry = 0l;
+  *dst = 0l;
+  try
     {
-      const KnowledgeEntry *entry = models()[i];
-      for(std::size_t k=0; k < entry->character.size(); k++)
+      ifstream stream(filename, ifstream::binary);
+      if( !stream.is_open() )
         {
-          if( character == entry->character[k] )
-            dst.push_back(entry);
+          util::log(util::LOG_ERROR, "loadModelFile(): bad file: %s", filename);
+          return -RC_OPENFILE;
         }
+      if( options.filtered() )
+        {
+          if( !constraint_accepted(stream, options) )
+            return 0;
+          stream.clear();
+          stream.seekg(0);
+        }
+      rc = KnowledgeSource::parse(stream, arena, &entry);
+
+      if( rc == 0 )
+        measureEntry(entry);
+    }
+  catch( YAML::Exception &excp )
+    {
+      util::log(util::LOG_ERROR, "loadModelFile(): %s: %s", filename, excp.what());
+      rc = -RC_OPENFILE;
     }
-  return dst.size() ? 0 : -RC_FAILED;
+  *dst = rc ? 0l : entry;
+  return rc;
 }
 
 /**
- * @brief Get entries of timbre knowledge by character and genre
+ * @brief Load the models from a compiled bank file.
+ * @param sourceStamp Stamp of the sources the bank has to be compiled from, 0 = not checked.
+ * @see KnowledgeBank
  */
-int KnowledgeModel::getKnowledgeEntry(std::vector<const KnowledgeEntry *> &dst, int character, int genre)
+int KnowledgeModel::loadCompiledModels(const char *filename, const KnowledgeLoadOptions &options, uint32_t sourceStamp /*= 0*/)
 {
-  dst.clear();
-  std::size_t size = models().size();
-  for(std::size_t i=0; i < size; i++)
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  m_loadReport.clear();
+  m_loadReport.compiled = true;
+
+  std::size_t entries = m_knowledgeEntries.size();
+  std::size_t bytes = m_arena.size();
+  int rc = KnowledgeBank::load(*this, filename, options, sourceStamp);
+
+  KnowledgeFileReport file;
+  file.filename = filename;
+  file.status = rc;
+  file.parse_ms = elapsed_ms(start);
+  file.bytes = m_arena.size() - std::min(bytes, m_arena.size());
+  for(std::size_t i=entries; i < m_knowledgeEntries.size(); i++)
+    {
+      ++file.entries;
+      count_entry(m_knowledgeEntries[i], &file.figures, &file.notes);
+    }
+  m_loadReport.files.push_back(file);
+
+  finishReport(elapsed_ms(start), rc);
+  return rc;
+}
+
+/**
+ * @brief Write all the loaded models into a compiled bank file.
+ * @see KnowledgeBank
+ */
+int KnowledgeModel::compileModels(const char *filename) const
+{
+  if( m_knowledgeEntries.empty() )
+    return -RC_FAILED;
+  return KnowledgeBank::compile(*this, filename);
+}
+
+static const std::vector<const KnowledgeEntry *> empty_entries;
+
+template <typename K>
+  static inline int find_entries(const std::vector<const KnowledgeEntry *> **dst,
+                                 const std::map<K, std::vector<const KnowledgeEntry *> > &index, const K &key)
     {
-      const KnowledgeEntry *entry = models()[i];
-      bool matched = false;
-      for(std::size_t k=0; k < entry->character.size(); k++)
-        if( character == entry->character[k] )
-          { matched = true; break; }
-      if(matched)
+      typename std::map<K, std::vector<const KnowledgeEntry *> >::const_iterator iter = index.find(key);
+      if( iter == index.end() )
         {
-          matched = false;
-          for(std::size_t k=0; k < entry->genre.size(); k++)
-            if( genre == entry->genre[k] )
-              { matched = true; break; }
+          *dst = &empty_entries;
+          return -RC_FAILED;
         }
-      if(matched)
-        dst.push_back(entry);
+      *dst = &iter->second;
+      return 0;
+    }
+
+/**
+ * @brief Get entries of chord knowledge by music character
+ */
+int KnowledgeModel::getChord(const std::vector<const KnowledgeEntry *> **dst, int character) const
+{
+  return find_entries(dst, m_chordCharacterIndex, character);
+}
+
+/**
+ * @brief Get entries of timbre knowledge by music genre
+ */
+int KnowledgeModel::getTimbreBank(const std::vector<const KnowledgeEntry *> **dst, int genre) const
+{
+  return find_entries(dst, m_timbreGenreIndex, genre);
+}
+
+/**
+ * @brief Get entries of timbre knowledge by music character
+ */
+int KnowledgeModel::getKnowledgeEntry(const std::vector<const KnowledgeEntry *> **dst, int character) const
+{
+  return find_entries(dst, m_characterIndex, character);
+}
+
+/**
+ * @brief Get entries of timbre knowledge by character and genre
+ */
+int KnowledgeModel::getKnowledgeEntry(const std::vector<const KnowledgeEntry *> **dst, int character, int genre) const
+{
+  return find_entries(dst, m_characterGenreIndex, std::make_pair(character, genre));
+}
+
+static const KnowledgeTrackList empty_tracks;
+
+/**
+ * @brief Get the tracks of all the entries matching a figure bank and class, in the order of models().
+ */
+int KnowledgeModel::getTimbreTracks(const KnowledgeTrackList **dst, int figure_bank, int figure_class) const
+{
+  std::map<std::pair<int, int>, KnowledgeTrackList>::const_iterator iter = m_timbreTrackIndex.find(std::make_pair(figure_bank, figure_class));
+  if( iter == m_timbreTrackIndex.end() )
+    {
+      *dst = &empty_tracks;
+      return -RC_FAILED;
     }
-  return dst.size() ? 0 : -RC_FAILED;
+  *dst = &iter->second;
+  return 0;
+}
+
+std::shared_ptr<const FormChain> ChordPlanCache::find(const KnowledgeEntry *chordEntry, int formTemplate, int beats) const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  std::map<PlanKey, std::shared_ptr<const FormChain> >::const_iterator iter =
+      m_plans.find(PlanKey(chordEntry, std::make_pair(formTemplate, beats)));
+  return iter != m_plans.end() ? iter->second : std::shared_ptr<const FormChain>();
+}
+
+void ChordPlanCache::insert(const KnowledgeEntry *chordEntry, int formTemplate, int beats, const std::shared_ptr<const FormChain> &chain)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_plans[PlanKey(chordEntry, std::make_pair(formTemplate, beats))] = chain;
+}
+
+void ChordPlanCache::clear()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_plans.clear();
 }
 
 }
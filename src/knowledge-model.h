@@ -18,12 +18,28 @@
 #include <string>
 #include <list>
 #include <vector>
+#include <map>
+#include <utility>
+#include <memory>
+#include <atomic>
+#include <mutex>
 
 #include "typedefs.h"
+#include "util-array.h"
+#include "util-arena.h"
+#include "util-pitch-sequence.h"
+#include "theory-structure.h"
 
 namespace autocomp
 {
 
+class LazyPitchDecoder;
+
+/*
+ * The entries of a loaded model live in the arena of KnowledgeModel.
+ * Their chords, pitches and child entries are packed arrays in the arena, the pitches
+ * in the compact encoding of util::PitchSequence, referenced by views, so the entries are trivially destructible and released with the arena.
+ */
 class FigureListEntry
 {
 public:
@@ -31,24 +47,51 @@ public:
     : segment(0),
       offset(0),
       begin(0),
-      end(0)
+      end(0),
+      pitch_low(0),
+      pitch_high(0),
+      m_pitchData(0l),
+      m_pitchCount(0),
+      m_pitchDecoder(0l),
+      m_pitchRecords(0l)
   {}
-  void appendChord(const ChordPair &src_chord )
-    {
-      chord.push_back(src_chord);
-    }
-  void appendPitch(const PitchNote &src_pitch)
+
+  /**
+   * @brief Get the pitches, which are decoded at the first access if they were loaded lazily.
+   * This is safe to be called concurrently.
+   */
+  inline util::PitchSequence pitchs() const
     {
-      pitchs.push_back(src_pitch);
+      const uint8_t *data = m_pitchData.load(std::memory_order_acquire);
+      if( !data && m_pitchCount )
+        data = decodePitchs();
+      return util::PitchSequence(data, m_pitchCount);
     }
+  inline std::size_t pitchCount() const { return m_pitchCount; }
+  inline bool pitchsDecoded() const { return !m_pitchCount || m_pitchData.load(std::memory_order_acquire); }
+
+  void setPitchs(util::Arena &arena, const PitchNote *pitchs, std::size_t count);
+  void setLazyPitchs(LazyPitchDecoder *decoder, const uint8_t *records, std::size_t count, int low, int high);
 
 public:
-  std::vector<ChordPair> chord;
+  util::ArrayRef<ChordPair> chord;
   int segment;
   int offset;
   unsigned int begin;
   unsigned int end;
-  std::vector<PitchNote> pitchs;
+  int pitch_low;  /* the range of the note pitches, known without decoding them */
+  int pitch_high;
+
+private:
+  FigureListEntry(const FigureListEntry &);
+  FigureListEntry &operator=(const FigureListEntry &);
+
+  const uint8_t *decodePitchs() const;
+
+  mutable std::atomic<const uint8_t *> m_pitchData;
+  std::size_t m_pitchCount;
+  LazyPitchDecoder *m_pitchDecoder;
+  const uint8_t *m_pitchRecords;
 };
 
 class KnowledgeArrayEntry
@@ -58,26 +101,25 @@ public:
     : timbre_bank(0),
       figure_bank(0),
       figure_class(0),
-      figure_list(0l)
-  {}
-
-  ~KnowledgeArrayEntry()
-    {
-      for(std::vector<const FigureListEntry *>::const_iterator iter = figure_list.begin(); iter != figure_list.end(); iter++)
-        delete const_cast<FigureListEntry *>(*iter);
-    }
-  FigureListEntry *appendFigureListEntry()
-    {
-      FigureListEntry *entry = new FigureListEntry;
-      figure_list.push_back(entry);
-      return entry;
-    }
+      track_figure_bank(0)
+  {
+    for(int i=0; i < FORM_TYPE_NUM; i++)
+      form_figures[i] = last_form_figures[i] = -1;
+  }
 
 public:
   int timbre_bank;
   int figure_bank;
   int figure_class;
-  std::vector<const FigureListEntry *> figure_list;
+  int track_figure_bank; /* figure bank normalized by the timbre at loading, @see theory::get_track_figure_bank() */
+  util::ArrayRef<FigureListEntry> figure_list;
+
+  /*
+   * Index of the figure to use for each form type, resolved with the replacement rules at loading.
+   * @see theory::resolve_form_figures()
+   */
+  int32_t form_figures[FORM_TYPE_NUM];
+  int32_t last_form_figures[FORM_TYPE_NUM];
 };
 
 class KnowledgeEntry
@@ -91,41 +133,166 @@ public:
       time_beat_type(4),
       for_rhythm(false),
       for_chord(false),
-      for_timbre(false)
+      for_timbre(false),
+      chord_count(0),
+      out_of_key_chord_count(0),
+      out_of_key_ratio(1.0f),
+      bars(0),
+      pitch_low(0),
+      pitch_high(0),
+      index(0)
   {}
 
-  ~KnowledgeEntry()
-    {
-      for(std::vector<const KnowledgeArrayEntry *>::const_iterator iter = m_knowledgeArrayEntries.begin(); iter != m_knowledgeArrayEntries.end(); iter++)
-        delete const_cast<KnowledgeArrayEntry *>(*iter);
-    }
-  KnowledgeArrayEntry *appendKnowledgeArrayEntry()
-    {
-      KnowledgeArrayEntry *entry = new KnowledgeArrayEntry;
-      m_knowledgeArrayEntries.push_back(entry);
-      return entry;
-    }
-  void appendCharacter(int src_character)
-    {
-      character.push_back(src_character);
-    }
-  void appendGenre(int src_genre)
-    {
-      genre.push_back(src_genre);
-    }
-
 public:
-  std::vector<const KnowledgeArrayEntry *> m_knowledgeArrayEntries;
+  util::ArrayRef<KnowledgeArrayEntry> m_knowledgeArrayEntries;
   int key;
   int scale;
   float tempo;
   int time_beats;
   int time_beat_type;
-  std::vector<int> character;
-  std::vector<int> genre;
+  util::ArrayRef<int> character;
+  util::ArrayRef<int> genre;
   bool for_rhythm;
   bool for_chord;
   bool for_timbre;
+
+  /*
+   * Statistics computed once at loading, as they only depend on the bank data.
+   * The chord counts are taken from the chord progression, i.e. the first figure list.
+   */
+  int chord_count;
+  int out_of_key_chord_count;
+  float out_of_key_ratio; /* out_of_key_chord_count / chord_count, 1 if there is not any chord */
+  unsigned int bars;      /* the furthest end of the figures */
+  int pitch_low;          /* the range of the note pitches, 0 if there is not any note */
+  int pitch_high;
+  unsigned int index;     /* the position in KnowledgeModel::models() */
+};
+
+/*
+ * A track of an entry, and the lists of the tracks matching a figure bank and class.
+ * @see theory::find_timbre_track()
+ */
+class KnowledgeTrack
+{
+public:
+  KnowledgeTrack(const KnowledgeEntry *entry, int track)
+    : entry(entry),
+      track(track)
+  {}
+
+public:
+  const KnowledgeEntry *entry;
+  int track;
+};
+
+class KnowledgeTrackList
+{
+public:
+  std::vector<KnowledgeTrack> matched;
+  std::vector<KnowledgeTrack> related;
+};
+
+class KnowledgeLoadOptions
+{
+public:
+  KnowledgeLoadOptions()
+    : threads(0),
+      lazy_pitchs(false),
+      roles(0),
+      index_start(-1),
+      index_end(-1)
+  {}
+
+  bool filtered() const;
+  bool accepts(const util::ArrayRef<int> &entry_characters, const util::ArrayRef<int> &entry_genres, int entry_roles) const;
+
+public:
+  int threads; /* worker threads parsing the bank sources. 0 = number of processors, 1 = serial */
+  bool lazy_pitchs; /* keep the compiled bank mapped and decode the pitches of a figure at its first use */
+
+  /*
+   * Filter of the entries to load, @see am_load_options_t
+   */
+  std::vector<int> characters; /* empty = all */
+  std::vector<int> genres;     /* empty = all */
+  int roles;                   /* mask of KNOWLEDGE_ROLE_*, 0 = all */
+  int index_start;             /* range of the bank sources, -1 = as index.meta */
+  int index_end;
+};
+
+/*
+ * Instrumentation of a loading, @see am_load_report_t
+ */
+class KnowledgeFileReport
+{
+public:
+  KnowledgeFileReport()
+    : status(0),
+      parse_ms(0),
+      entries(0),
+      figures(0),
+      notes(0),
+      bytes(0)
+  {}
+
+public:
+  std::string filename;
+  int status;
+  double parse_ms;
+  unsigned int entries;   /* 0 if the file was filtered out or failed */
+  unsigned int figures;
+  unsigned int notes;
+  std::size_t bytes;      /* used in the arena */
+};
+
+class KnowledgeLoadReport
+{
+public:
+  KnowledgeLoadReport() { clear(); }
+  void clear();
+
+public:
+  bool compiled;
+  double load_ms;
+  std::vector<KnowledgeFileReport> files;
+
+  unsigned int entries;
+  unsigned int arrays;
+  unsigned int figures;
+  unsigned int chords;
+  unsigned int notes;
+  unsigned int values;
+
+  std::size_t entry_bytes;
+  std::size_t array_bytes;
+  std::size_t figure_bytes;
+  std::size_t chord_bytes;
+  std::size_t pitch_bytes;    /* encoded pitches, without the ones left to decode lazily */
+  std::size_t value_bytes;
+  std::size_t arena_bytes;    /* used in the arena */
+  std::size_t arena_capacity;
+  std::size_t index_bytes;    /* estimate of the heap used by the indexes */
+  std::size_t mapped_bytes;   /* the compiled bank kept mapped for the lazy pitches */
+  std::size_t resident_bytes; /* arena_capacity + index_bytes + mapped_bytes */
+};
+
+/**
+ * @brief Form chains already coordinated with a chord entry, keyed by (chord entry, form template, beats).
+ * The chains are immutable once inserted and shared by all the compositions using the model.
+ */
+class ChordPlanCache
+{
+public:
+  std::shared_ptr<const FormChain> find(const KnowledgeEntry *chordEntry, int formTemplate, int beats) const;
+  void insert(const KnowledgeEntry *chordEntry, int formTemplate, int beats, const std::shared_ptr<const FormChain> &chain);
+  void clear();
+
+private:
+  typedef std::pair<const KnowledgeEntry *, std::pair<int, int> > PlanKey;
+
+  mutable std::mutex m_mutex;
+  std::map<PlanKey, std::shared_ptr<const FormChain> > m_plans;
 };
 
 class KnowledgeModel
@@ -135,30 +302,106 @@ public:
   ~KnowledgeModel();
 
 public:
-  int loadModels(const char *modelPath);
+  int loadModels(const char *modelPath, const KnowledgeLoadOptions &options = KnowledgeLoadOptions());
+  int loadSourceModels(const char *modelPath, const KnowledgeLoadOptions &options = KnowledgeLoadOptions());
   int loadModelFile(const char *filename);
+  int loadCompiledModels(const char *filename, const KnowledgeLoadOptions &options = KnowledgeLoadOptions(),
+                         uint32_t sourceStamp = 0);
+  int compileModels(const char *filename) const;
   inline std::vector<const KnowledgeEntry *> &models()
     {
       return m_knowledgeEntries;
     }
+  inline const std::vector<const KnowledgeEntry *> &models() const
+    {
+      return m_knowledgeEntries;
+    }
     
-  int getChord(std::vector<const KnowledgeEntry *> &dst, int character);
-  int getTimbreBank(std::vector<const KnowledgeEntry *> &dst, int genre);
-  int getKnowledgeEntry(std::vector<const KnowledgeEntry *> &dst, int character);
-  int getKnowledgeEntry(std::vector<const KnowledgeEntry *> &dst, int character, int genre);
+  int getChord(const std::vector<const KnowledgeEntry *> **dst, int character) const;
+  int getTimbreBank(const std::vector<const KnowledgeEntry *> **dst, int genre) const;
+  int getKnowledgeEntry(const std::vector<const KnowledgeEntry *> **dst, int character) const;
+  int getKnowledgeEntry(const std::vector<const KnowledgeEntry *> **dst, int character, int genre) const;
+  int getTimbreTracks(const KnowledgeTrackList **dst, int figure_bank, int figure_class) const;
+
+  inline const std::vector<const KnowledgeEntry *> &rhythmEntries() const
+    {
+      return m_rhythmEntries;
+    }
+  inline const std::vector<const KnowledgeEntry *> &chordEntries() const
+    {
+      return m_chordEntries;
+    }
+  inline const std::vector<const KnowledgeEntry *> &timbreEntries() const
+    {
+      return m_timbreEntries;
+    }
+  inline const KnowledgeLoadReport &loadReport() const
+    {
+      return m_loadReport;
+    }
+  inline ChordPlanCache &chordPlans() const
+    {
+      return m_chordPlans;
+    }
 
 private:
-  KnowledgeEntry *appendKnowledgeEntry()
-      {
-        KnowledgeEntry *entry = new KnowledgeEntry;
-        m_knowledgeEntries.push_back(entry);
-        return entry;
-      }
-      
+  friend class KnowledgeBank;
+
+  static int parseModelFile(const char *filename, const KnowledgeLoadOptions &options, util::Arena &arena, KnowledgeEntry **dst);
+  static void measureEntry(KnowledgeEntry *entry);
+
   void removeEntries();
+  void indexEntry(const KnowledgeEntry *entry);
+  void buildIndexes();
+  void clearIndexes();
+  void finishReport(double load_ms, int rc);
 
 private:
+  typedef std::vector<const KnowledgeEntry *> EntryList;
+
+  util::Arena m_arena;
+  std::unique_ptr<LazyPitchDecoder> m_pitchDecoder;
   std::vector<const KnowledgeEntry *> m_knowledgeEntries;
+  uint32_t m_sourceStamp; /* of the sources all the models are loaded from, 0 = none */
+
+  /*
+   * Inverted indexes built at loading, each list is in the order of models().
+   */
+  std::map<int, EntryList> m_characterIndex;
+  std::map<int, EntryList> m_chordCharacterIndex;
+  std::map<int, EntryList> m_timbreGenreIndex;
+  std::map<std::pair<int, int>, EntryList> m_characterGenreIndex;
+  std::map<std::pair<int, int>, KnowledgeTrackList> m_timbreTrackIndex;
+  EntryList m_rhythmEntries;
+  EntryList m_chordEntries;
+  EntryList m_timbreEntries;
+  mutable ChordPlanCache m_chordPlans;
+
+  KnowledgeLoadReport m_loadReport;
+};
+
+/**
+ * @brief The current generation of a knowledge model, shared by many compositions and replaceable at any time.
+ * Readers acquire a reference to the current generation and keep using it as long as they hold it,
+ * while a writer loads a new generation aside and publishes it at once (RCU-style).
+ * A generation is released as soon as the last reader holding it drops its reference.
+ */
+class SharedKnowledgeModel
+{
+public:
+  explicit SharedKnowledgeModel(const std::shared_ptr<const KnowledgeModel> &knowledgeModel);
+
+public:
+  std::shared_ptr<const KnowledgeModel> acquire() const;
+  void publish(const std::shared_ptr<const KnowledgeModel> &knowledgeModel);
+  inline unsigned int generation() const { return m_generation; }
+
+private:
+  SharedKnowledgeModel(const SharedKnowledgeModel &);
+  SharedKnowledgeModel &operator=(const SharedKnowledgeModel &);
+
+  std::shared_ptr<const KnowledgeModel> m_knowledgeModel;
+  std::atomic<unsigned int> m_generation;
 };
 
 }
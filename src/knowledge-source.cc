@@ -0,0 +1,632 @@
+/*
+ *  libautomusic (Library for Image-based Algorithmic Musical Composition)
+ *  Copyright (C) 2018, automusic.
+ *
+ *  THIS PROJECT IS FREE SOFTWARE; YOU CAN REDISTRIBUTE IT AND/OR
+ *  MODIFY IT UNDER THE TERMS OF THE GNU LESSER GENERAL PUBLIC LICENSE(GPL)
+ *  AS PUBLISHED BY THE FREE SOFTWARE FOUNDATION; EITHER VERSION 2.1
+ *  OF THE LICENSE, OR (AT YOUR OPTION) ANY LATER VERSION.
+ *
+ *  THIS PROJECT IS DISTRIBUTED IN THE HOPE THAT IT WILL BE USEFUL,
+ *  BUT WITHOUT ANY WARRANTY; WITHOUT EVEN THE IMPLIED WARRANTY OF
+ *  MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE.  SEE THE GNU
+ *  LESSER GENERAL PUBLIC LICENSE FOR MORE DETAILS.
+ */
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <yaml-cpp/eventhandler.h>
+#include <yaml-cpp/exceptions.h>
+#include <yaml-cpp/mark.h>
+#include <yaml-cpp/parser.h>
+#include "libautomusic.h"
+#include "knowledge-model.h"
+#include "knowledge-source.h"
+#include "theory-orchestration.h"
+
+namespace autocomp
+{
+
+enum SourceNode
+{
+  NODE_IGNORED = 0,
+  NODE_ROOT,
+  NODE_ARRAYS,      /* knowledge_array */
+  NODE_ARRAY,
+  NODE_FIGURES,     /* figure_list */
+  NODE_FIGURE,
+  NODE_CHORDS,
+  NODE_CHORD,
+  NODE_PITCHS,
+  NODE_CONSTRAINT,  /* knowledge_constraint */
+  NODE_CHARACTERS,
+  NODE_GENRES
+};
+
+/*
+ * Required scalar fields of the maps, in the order of their bits in SourceFrame::fields.
+ */
+static const char *const array_fields[] = { "timbre_bank", "figure_bank", "class", 0l };
+static const char *const figure_fields[] = { "segment", "offset", "begin", "end", 0l };
+static const char *const constraint_fields[] = { "key", "scale", "tempo", "time_beats", "time_beat_type",
+                                                 "for_rhythm", "for_chord", "for_timbre", 0l };
+
+static const char *const *node_fields(SourceNode node)
+{
+  switch( node )
+    {
+    case NODE_ARRAY: return array_fields;
+    case NODE_FIGURE: return figure_fields;
+    case NODE_CONSTRAINT: return constraint_fields;
+    default: return 0l;
+    }
+}
+
+static int field_index(SourceNode node, const std::string &key)
+{
+  const char *const *fields = node_fields(node);
+  for(int i=0; fields && fields[i]; i++)
+    if( key == fields[i] )
+      return i;
+  return -1;
+}
+
+class SourceFrame
+{
+public:
+  SourceFrame(SourceNode node, bool map, const YAML::Mark &mark)
+    : node(node),
+      map(map),
+      value(false),
+      mark(mark),
+      fields(0),
+      items(0)
+  {}
+
+public:
+  SourceNode node;
+  bool map;
+  bool value;         /* the next event of a map is the value of key */
+  std::string key;
+  YAML::Mark mark;
+  unsigned int fields;
+  std::size_t items;  /* number of the items of a sequence */
+};
+
+class FigureSource
+{
+public:
+  FigureSource()
+    : segment(0), offset(0), begin(0), end(0),
+      chord_first(0), chord_num(0), pitch_first(0), pitch_num(0)
+  {}
+
+public:
+  int segment;
+  int offset;
+  unsigned int begin;
+  unsigned int end;
+  std::size_t chord_first, chord_num;  /* range in SourceHandler::m_chords */
+  std::size_t pitch_first, pitch_num;  /* range in SourceHandler::m_pitchs */
+};
+
+class ArraySource
+{
+public:
+  ArraySource()
+    : timbre_bank(0), figure_bank(0), figure_class(0)
+  {}
+
+public:
+  int timbre_bank;
+  int figure_bank;
+  int figure_class;
+  util::ArrayRef<FigureListEntry> figure_list;
+};
+
+/*
+ * Conversions of the scalars, accepting the same forms as YAML::Node::as<T>().
+ */
+static long long to_integer(const YAML::Mark &mark, const std::string *value, long long low, long long high)
+{
+  if( value && !value->empty() )
+    {
+      const char *str = value->c_str();
+      int base = 10;
+      if( (str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) )
+        str += 2, base = 16;
+      else if( str[0] == '0' && str[1] == 'o' )
+        str += 2, base = 8;
+
+      char *end = 0l;
+      errno = 0;
+      long long result = std::strtoll(str, &end, base);
+      if( *str && !std::isspace((unsigned char)*str) && *end == '\0' && errno == 0 )
+        {
+          if( result < low || result > high )
+            throw YAML::RepresentationException(mark, "value is out of range: " + *value);
+          return result;
+        }
+    }
+  throw YAML::RepresentationException(mark, "bad conversion to an integer");
+}
+
+static inline int to_int(const YAML::Mark &mark, const std::string *value)
+{
+  return int(to_integer(mark, value, INT_MIN, INT_MAX));
+}
+
+static inline unsigned int to_uint(const YAML::Mark &mark, const std::string *value)
+{
+  return (unsigned int)to_integer(mark, value, 0, UINT_MAX);
+}
+
+static float to_float(const YAML::Mark &mark, const std::string *value)
+{
+  if( value && !value->empty() )
+    {
+      char *end = 0l;
+      float result = std::strtof(value->c_str(), &end);
+      if( !std::isspace((unsigned char)(*value)[0]) && *end == '\0' )
+        return result;
+    }
+  throw YAML::RepresentationException(mark, "bad conversion to a number");
+}
+
+static bool to_bool(const YAML::Mark &mark, const std::string *value)
+{
+  static const char *const true_values[] = { "y", "yes", "true", "on", 0l };
+  static const char *const false_values[] = { "n", "no", "false", "off", 0l };
+  if( value )
+    {
+      std::string lower(*value);
+      for(std::size_t i=0; i < lower.size(); i++)
+        lower[i] = std::tolower((unsigned char)lower[i]);
+      for(int i=0; true_values[i]; i++)
+        {
+          if( lower == true_values[i] )
+            return true;
+          if( lower == false_values[i] )
+            return false;
+        }
+    }
+  throw YAML::RepresentationException(mark, "bad conversion to a boolean");
+}
+
+/**
+ * @brief Receiver of the YAML events of a bank source.
+ * A stack of frames keeps track of the position in the document, the figures of a track
+ * are collected aside and packed into the arena at the end of the track.
+ */
+class SourceHandler : public YAML::EventHandler
+{
+public:
+  explicit SourceHandler(util::Arena &arena)
+    : m_arena(arena),
+      m_entry(0l),
+      m_hasArrays(false),
+      m_hasConstraint(false),
+      m_pitch(0), m_velocity(0), m_start(0)
+  {}
+
+  inline KnowledgeEntry *entry() const
+    {
+      return m_hasArrays && m_hasConstraint ? m_entry : 0l;
+    }
+
+  void OnDocumentStart(const YAML::Mark &) {}
+  void OnDocumentEnd() {}
+  void OnNull(const YAML::Mark &mark, YAML::anchor_t)
+    {
+      onScalar(mark, 0l);
+    }
+  void OnAlias(const YAML::Mark &mark, YAML::anchor_t)
+    {
+      throw YAML::ParserException(mark, "aliases are not supported in the bank sources");
+    }
+  void OnScalar(const YAML::Mark &mark, const std::string &, YAML::anchor_t, const std::string &value)
+    {
+      onScalar(mark, &value);
+    }
+  void OnSequenceStart(const YAML::Mark &mark, const std::string &, YAML::anchor_t, YAML::EmitterStyle::value)
+    {
+      push(childNode(mark, false), false, mark);
+    }
+  void OnSequenceEnd()
+    {
+      pop();
+    }
+  void OnMapStart(const YAML::Mark &mark, const std::string &, YAML::anchor_t, YAML::EmitterStyle::value)
+    {
+      push(childNode(mark, true), true, mark);
+    }
+  void OnMapEnd()
+    {
+      pop();
+    }
+
+private:
+  SourceNode childNode(const YAML::Mark &mark, bool map) const;
+  void push(SourceNode node, bool map, const YAML::Mark &mark);
+  void pop();
+  void onScalar(const YAML::Mark &mark, const std::string *value);
+  void onField(SourceFrame &frame, const YAML::Mark &mark, const std::string *value);
+  void onItem(SourceFrame &frame, const YAML::Mark &mark, const std::string *value);
+  void beginNode(SourceFrame &frame);
+  void endNode(SourceFrame &frame);
+  void endArray();
+  void endArrays();
+
+  util::Arena &m_arena;
+  std::vector<SourceFrame> m_stack;
+  KnowledgeEntry *m_entry;
+  bool m_hasArrays;
+  bool m_hasConstraint;
+
+  std::vector<ArraySource> m_arrays;
+  ArraySource m_array;
+  std::vector<FigureSource> m_figures;   /* of the current track */
+  FigureSource m_figure;
+  std::vector<ChordPair> m_chords;       /* of the current track */
+  std::vector<PitchNote> m_pitchs;       /* of the current track */
+  std::vector<int> m_characters;
+  std::vector<int> m_genres;
+  unsigned int m_pitch, m_velocity;
+  int32_t m_start;
+};
+
+/**
+ * @brief Get the kind of a collection starting at the current position.
+ */
+SourceNode SourceHandler::childNode(const YAML::Mark &mark, bool map) const
+{
+  if( m_stack.empty() )
+    return map ? NODE_ROOT : NODE_IGNORED;
+
+  const SourceFrame &parent = m_stack.back();
+  if( parent.map && field_index(parent.node, parent.key) >= 0 )
+    throw YAML::RepresentationException(mark, "\"" + parent.key + "\" must be a scalar");
+
+  switch( parent.node )
+    {
+    case NODE_ROOT:
+      if( parent.key == "knowledge_array" && !map )
+        return NODE_ARRAYS;
+      if( parent.key == "knowledge_constraint" && map )
+        return NODE_CONSTRAINT;
+      break;
+    case NODE_ARRAYS:
+    case NODE_FIGURES:
+      if( !map )
+        throw YAML::ParserException(mark, parent.node == NODE_ARRAYS ? "a track must be a map" : "a figure must be a map");
+      return parent.node == NODE_ARRAYS ? NODE_ARRAY : NODE_FIGURE;
+    case NODE_ARRAY:
+      if( parent.key == "figure_list" && !map )
+        return NODE_FIGURES;
+      break;
+    case NODE_FIGURE:
+      if( parent.key == "chord" && !map )
+        return NODE_CHORDS;
+      if( parent.key == "pitch" && !map )
+        return NODE_PITCHS;
+      break;
+    case NODE_CHORDS:
+      if( !map )
+        return NODE_CHORD;
+      break; /* not a chord, skipped */
+    case NODE_CHORD:
+      if( parent.items < 2 )
+        throw YAML::RepresentationException(mark, "bad conversion of a chord");
+      break;
+    case NODE_PITCHS:
+      throw YAML::RepresentationException(mark, "bad conversion of a pitch");
+    case NODE_CONSTRAINT:
+      if( parent.key == "character" && !map )
+        return NODE_CHARACTERS;
+      if( parent.key == "genre" && !map )
+        return NODE_GENRES;
+      break;
+    case NODE_CHARACTERS:
+    case NODE_GENRES:
+      if( parent.items % 4 == 0 )
+        throw YAML::RepresentationException(mark, "bad conversion of a constraint value");
+      break;
+    default:
+      break;
+    }
+  return NODE_IGNORED;
+}
+
+void SourceHandler::push(SourceNode node, bool map, const YAML::Mark &mark)
+{
+  m_stack.push_back(SourceFrame(node, map, mark));
+  beginNode(m_stack.back());
+}
+
+void SourceHandler::pop()
+{
+  endNode(m_stack.back());
+  m_stack.pop_back();
+
+  /*
+   * The collection was a value of the parent map, or an item of the parent sequence.
+   */
+  if( !m_stack.empty() )
+    {
+      SourceFrame &parent = m_stack.back();
+      if( parent.map )
+        parent.value = false;
+      else
+        ++parent.items;
+    }
+}
+
+void SourceHandler::onScalar(const YAML::Mark &mark, const std::string *value)
+{
+  if( m_stack.empty() )
+    return;
+
+  SourceFrame &frame = m_stack.back();
+  if( frame.map )
+    {
+      if( !frame.value )
+        {
+          frame.key = value ? *value : std::string();
+          frame.value = true;
+        }
+      else
+        {
+          onField(frame, mark, value);
+          frame.value = false;
+        }
+    }
+  else
+    {
+      onItem(frame, mark, value);
+      ++frame.items;
+    }
+}
+
+void SourceHandler::onField(SourceFrame &frame, const YAML::Mark &mark, const std::string *value)
+{
+  int index = field_index(frame.node, frame.key);
+  if( index < 0 )
+    return;
+  frame.fields |= 1u << index;
+
+  switch( frame.node )
+    {
+    case NODE_ARRAY:
+      switch( index )
+        {
+        case 0: m_array.timbre_bank  = to_int(mark, value); break;
+        case 1: m_array.figure_bank  = to_int(mark, value); break;
+        case 2: m_array.figure_class = to_int(mark, value); break;
+        }
+      break;
+    case NODE_FIGURE:
+      switch( index )
+        {
+        case 0: m_figure.segment = to_int(mark, value); break;
+        case 1: m_figure.offset  = to_int(mark, value); break;
+        case 2: m_figure.begin   = to_uint(mark, value); break;
+        case 3: m_figure.end     = to_uint(mark, value); break;
+        }
+      break;
+    case NODE_CONSTRAINT:
+      switch( index )
+        {
+        case 0: m_entry->key            = to_int(mark, value); break;
+        case 1: m_entry->scale          = to_int(mark, value); break;
+        case 2: m_entry->tempo          = to_float(mark, value); break;
+        case 3: m_entry->time_beats     = to_int(mark, value); break;
+        case 4: m_entry->time_beat_type = to_int(mark, value); break;
+        case 5: m_entry->for_rhythm     = to_bool(mark, value); break;
+        case 6: m_entry->for_chord      = to_bool(mark, value); break;
+        case 7: m_entry->for_timbre     = to_bool(mark, value); break;
+        }
+      break;
+    default:
+      break;
+    }
+}
+
+void SourceHandler::onItem(SourceFrame &frame, const YAML::Mark &mark, const std::string *value)
+{
+  switch( frame.node )
+    {
+    case NODE_ARRAYS:
+      throw YAML::ParserException(mark, "a track must be a map");
+    case NODE_FIGURES:
+      throw YAML::ParserException(mark, "a figure must be a map");
+    case NODE_CHORD:
+      /* the items after the root and the sign are ignored */
+      if( frame.items == 0 )
+        m_chords.push_back(ChordPair(to_int(mark, value), 0));
+      else if( frame.items == 1 )
+        m_chords.back().sign = to_int(mark, value);
+      break;
+    case NODE_PITCHS:
+      /*
+       * Every note is a group of 4 values: pitch, velocity, start, end
+       */
+      switch( frame.items % 4 )
+        {
+        case 0:
+          if( (m_pitch = to_uint(mark, value)) > 255 )
+            throw YAML::RepresentationException(mark, "Pitch is out of range.");
+          break;
+        case 1:
+          if( (m_velocity = to_uint(mark, value)) > 255 )
+            throw YAML::RepresentationException(mark, "Velocity is out of range.");
+          break;
+        case 2:
+          m_start = to_int(mark, value);
+          break;
+        case 3:
+          m_pitchs.push_back(PitchNote(m_pitch, m_velocity, m_start, to_int(mark, value)));
+          break;
+        }
+      break;
+    case NODE_CHARACTERS:
+    case NODE_GENRES:
+      /* the values are taken every 4 items, as the original loader did */
+      if( frame.items % 4 == 0 )
+        (frame.node == NODE_CHARACTERS ? m_characters : m_genres).push_back(to_int(mark, value));
+      break;
+    default:
+      break;
+    }
+}
+
+void SourceHandler::beginNode(SourceFrame &frame)
+{
+  switch( frame.node )
+    {
+    case NODE_ROOT:
+      m_entry = m_arena.create<KnowledgeEntry>();
+      break;
+    case NODE_ARRAY:
+      m_array = ArraySource();
+      m_figures.clear();
+      m_chords.clear();
+      m_pitchs.clear();
+      break;
+    case NODE_FIGURE:
+      m_figure = FigureSource();
+      break;
+    case NODE_CHORDS:
+      m_figure.chord_first = m_chords.size();
+      break;
+    case NODE_PITCHS:
+      m_figure.pitch_first = m_pitchs.size();
+      break;
+    case NODE_CHARACTERS:
+      m_characters.clear();
+      break;
+    case NODE_GENRES:
+      m_genres.clear();
+      break;
+    default:
+      break;
+    }
+}
+
+void SourceHandler::endNode(SourceFrame &frame)
+{
+  /*
+   * All the required fields of a map must be found.
+   */
+  const char *const *fields = node_fields(frame.node);
+  for(int i=0; fields && fields[i]; i++)
+    {
+      if( !(frame.fields & (1u << i)) )
+        throw YAML::ParserException(frame.mark, std::string("missing \"") + fields[i] + "\"");
+    }
+
+  switch( frame.node )
+    {
+    case NODE_CHORD:
+      if( frame.items < 2 )
+        throw YAML::RepresentationException(frame.mark, "a chord needs a root and a sign");
+      break;
+    case NODE_CHORDS:
+      m_figure.chord_num = m_chords.size() - m_figure.chord_first;
+      break;
+    case NODE_PITCHS:
+      if( frame.items % 4 )
+        throw YAML::RepresentationException(frame.mark, "the pitches are not groups of 4 values");
+      m_figure.pitch_num = m_pitchs.size() - m_figure.pitch_first;
+      break;
+    case NODE_FIGURE:
+      m_figures.push_back(m_figure);
+      break;
+    case NODE_ARRAY:
+      endArray();
+      break;
+    case NODE_ARRAYS:
+      endArrays();
+      break;
+    case NODE_CONSTRAINT:
+      m_entry->character = util::ArrayRef<int>(m_arena.allocateArray<int>(m_characters.size()), m_characters.size());
+      std::copy(m_characters.begin(), m_characters.end(), const_cast<int *>(m_entry->character.data()));
+      m_entry->genre = util::ArrayRef<int>(m_arena.allocateArray<int>(m_genres.size()), m_genres.size());
+      std::copy(m_genres.begin(), m_genres.end(), const_cast<int *>(m_entry->genre.data()));
+      m_hasConstraint = true;
+      break;
+    default:
+      break;
+    }
+}
+
+/**
+ * @brief Pack the figures of the track into the arena.
+ */
+void SourceHandler::endArray()
+{
+  FigureListEntry *figures = m_arena.createArray<FigureListEntry>(m_figures.size());
+  for(std::size_t i=0; i < m_figures.size(); i++)
+    {
+      const FigureSource &src = m_figures[i];
+      FigureListEntry *figure = &figures[i];
+
+      ChordPair *chords = m_arena.allocateArray<ChordPair>(src.chord_num);
+      for(std::size_t k=0; k < src.chord_num; k++)
+        new (&chords[k]) ChordPair(m_chords[src.chord_first + k]);
+
+      figure->chord   = util::ArrayRef<ChordPair>(chords, src.chord_num);
+      figure->segment = src.segment;
+      figure->offset  = src.offset;
+      figure->begin   = src.begin;
+      figure->end     = src.end;
+      figure->setPitchs(m_arena, src.pitch_num ? &m_pitchs[src.pitch_first] : 0l, src.pitch_num);
+    }
+  m_array.figure_list = util::ArrayRef<FigureListEntry>(figures, m_figures.size());
+  m_arrays.push_back(m_array);
+}
+
+void SourceHandler::endArrays()
+{
+  KnowledgeArrayEntry *arrays = m_arena.createArray<KnowledgeArrayEntry>(m_arrays.size());
+  for(std::size_t i=0; i < m_arrays.size(); i++)
+    {
+      const ArraySource &src = m_arrays[i];
+      KnowledgeArrayEntry *arrayEntry = &arrays[i];
+
+      arrayEntry->timbre_bank   = src.timbre_bank;
+      arrayEntry->figure_bank   = src.figure_bank;
+      arrayEntry->figure_class  = src.figure_class;
+      arrayEntry->track_figure_bank = theory::get_track_figure_bank(arrayEntry->timbre_bank,
+                                                                    arrayEntry->figure_bank,
+                                                                    arrayEntry->figure_class);
+      arrayEntry->figure_list   = src.figure_list;
+      theory::resolve_form_figures(arrayEntry->form_figures, arrayEntry->last_form_figures, arrayEntry->figure_list);
+    }
+  m_entry->m_knowledgeArrayEntries = util::ArrayRef<KnowledgeArrayEntry>(arrays, m_arrays.size());
+  m_arrays.clear();
+  m_hasArrays = true;
+}
+
+/**
+ * @brief Parse the first document of a bank source into a new entry allocated in the arena.
+ * Errors of the source throw YAML::Exception, telling the line and column.
+ * @return -RC_PARSE_DATABASE if the source has no knowledge_array or knowledge_constraint.
+ */
+int KnowledgeSource::parse(std::istream &stream, util::Arena &arena, KnowledgeEntry **dst)
+{
+  YAML::Parser parser(stream);
+  SourceHandler handler(arena);
+  parser.HandleNextDocument(handler);
+
+  *dst = handler.entry();
+  return *dst ? 0 : -RC_PARSE_DATABASE;
+}
+
+}
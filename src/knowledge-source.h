@@ -0,0 +1,46 @@
+/*
+ *  libautomusic (Library for Image-based Algorithmic Musical Composition)
+ *  Copyright (C) 2018, automusic.
+ *
+ *  THIS PROJECT IS FREE SOFTWARE; YOU CAN REDISTRIBUTE IT AND/OR
+ *  MODIFY IT UNDER THE TERMS OF THE GNU LESSER GENERAL PUBLIC LICENSE(GPL)
+ *  AS PUBLISHED BY THE FREE SOFTWARE FOUNDATION; EITHER VERSION 2.1
+ *  OF THE LICENSE, OR (AT YOUR OPTION) ANY LATER VERSION.
+ *
+ *  THIS PROJECT IS DISTRIBUTED IN THE HOPE THAT IT WILL BE USEFUL,
+ *  BUT WITHOUT ANY WARRANTY; WITHOUT EVEN THE IMPLIED WARRANTY OF
+ *  MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE.  SEE THE GNU
+ *  LESSER GENERAL PUBLIC LICENSE FOR MORE DETAILS.
+ */
+#ifndef KNOWLEDGE_SOURCE_H
+#define KNOWLEDGE_SOURCE_H
+
+#include <istream>
+
+#include "util-arena.h"
+
+namespace autocomp
+{
+
+class KnowledgeEntry;
+
+/*
+ * Bank sources (*.mdel).
+ * The source is read as a stream of YAML events filling the entry directly, without building
+ * the document tree, so the memory peak of a load keeps close to the size of the entry itself.
+ *
+ *   knowledge_array:          sequence of tracks
+ *     - timbre_bank, figure_bank, class, figure_list (sequence of figures)
+ *       figure: chord [[root, sign], ...], segment, offset, begin, end, pitch [pitch, velocity, start, end, ...]
+ *   knowledge_constraint:     key, scale, tempo, time_beats, time_beat_type,
+ *                             for_rhythm, for_chord, for_timbre, character, genre
+ */
+class KnowledgeSource
+{
+public:
+  static int parse(std::istream &stream, util::Arena &arena, KnowledgeEntry **dst);
+};
+
+}
+
+#endif
@@ -14,6 +14,9 @@
  */
 #include <cstdio>
 #include <cstring>
+#include <algorithm>
+#include <memory>
+#include <vector>
 
 #ifndef DLL_EXPORT
 # define DLL_EXPORT /* normally this will be defined by libtool automatically */
@@ -23,11 +26,14 @@
 
 #include "libautomusic.h"
 #include "knowledge-model.h"
+#include "knowledge-bank.h"
 #include "parameter-generator.h"
 #include "theory-harmonics.h"
 #include "output-base.h"
 #include "util-randomize.h"
+#include "util-log.h"
 #include "composition-toplevel.h"
+#include "util-parallel.h"
 
 #define CURRENT_VERSION_MAJOR 1
 #define CURRENT_VERSION_MINOR 0
@@ -35,10 +41,19 @@
 
 #define BEAT_TYPE 4
 
+struct am_model_s
+{
+  std::shared_ptr<autocomp::SharedKnowledgeModel> sharedModel;
+};
+
 struct am_context_s
 {
+  std::shared_ptr<autocomp::SharedKnowledgeModel> sharedModel;
   autocomp::CompositionToplevel *composition;
   autocomp::Output *output;
+  am_form_callback_t formCallback;
+  void *formOpaque;
+  std::vector<am_note_t> formNotes;
 };
 
 int
@@ -50,26 +65,272 @@ LIBAM_EXPORT(libam_require_version)(int major, int minor, int revsion)
 am_context_t *
 LIBAM_EXPORT(libam_create_context)(const char *modelPath)
 {
-  am_context_t *context = new am_context_t;
-  std::memset(context, 0, sizeof(*context));
-  
-  context->composition = new autocomp::CompositionToplevel;
-  context->output = new autocomp::Output;
-  
+  return libam_create_context_ex(modelPath, 0l);
+}
+
+void
+LIBAM_EXPORT(libam_load_options_init)(am_load_options_t *options)
+{
+  std::memset(options, 0, sizeof(*options));
+  options->threads = 0;
+  options->characters = 0l;
+  options->genres = 0l;
+  options->roles = 0;
+  options->index_start = -1;
+  options->index_end = -1;
+  options->lazy_pitchs = 0;
+}
+
+static autocomp::KnowledgeLoadOptions
+load_options(const am_load_options_t *options)
+{
+  autocomp::KnowledgeLoadOptions dst;
+  if( options )
+    {
+      dst.threads = options->threads;
+      if( options->characters )
+        dst.characters.assign(options->characters, options->characters + options->character_count);
+      if( options->genres )
+        dst.genres.assign(options->genres, options->genres + options->genre_count);
+      dst.roles = options->roles;
+      dst.index_start = options->index_start;
+      dst.index_end = options->index_end;
+      dst.lazy_pitchs = options->lazy_pitchs != 0;
+    }
+  return dst;
+}
+
+am_context_t *
+LIBAM_EXPORT(libam_create_context_ex)(const char *modelPath, const am_load_options_t *options)
+{
+  am_model_t *model = libam_create_model(modelPath, options);
+  if( !model )
+    return 0l;
+
+  am_context_t *context = libam_create_context_from_model(model);
+  libam_free_model(model);
+  return context;
+}
+
+am_model_t *
+LIBAM_EXPORT(libam_create_model)(const char *modelPath, const am_load_options_t *options)
+{
   /*
    * Load all the models in database to memory.
    */
-  if( context->composition->knowledgeModel()->loadModels(modelPath) )
+  std::shared_ptr<autocomp::KnowledgeModel> knowledgeModel(new autocomp::KnowledgeModel);
+  if( knowledgeModel->loadModels(modelPath, load_options(options)) )
+    return 0l;
+
+  am_model_t *model = new am_model_t;
+  model->sharedModel.reset(new autocomp::SharedKnowledgeModel(knowledgeModel));
+  return model;
+}
+
+int
+LIBAM_EXPORT(libam_reload_model)(am_model_t *model, const char *modelPath, const am_load_options_t *options)
+{
+  /*
+   * Load the new generation aside, the compositions in progress keep going with the current one.
+   */
+  if( !model )
+    return -RC_FAILED;
+
+  std::shared_ptr<autocomp::KnowledgeModel> knowledgeModel(new autocomp::KnowledgeModel);
+  if( int err = knowledgeModel->loadModels(modelPath, load_options(options)) )
+    return err;
+
+  model->sharedModel->publish(knowledgeModel);
+  return 0;
+}
+
+unsigned int
+LIBAM_EXPORT(libam_model_generation)(am_model_t *model)
+{
+  return model->sharedModel->generation();
+}
+
+int
+LIBAM_EXPORT(libam_model_load_report)(am_model_t *model, am_load_report_t *report)
+{
+  if( !model || !report )
+    return -RC_FAILED;
+
+  std::shared_ptr<const autocomp::KnowledgeModel> knowledgeModel = model->sharedModel->acquire();
+  const autocomp::KnowledgeLoadReport &src = knowledgeModel->loadReport();
+  report->compiled = src.compiled ? 1 : 0;
+  report->load_ms = src.load_ms;
+  report->file_count = src.files.size();
+  report->entry_count = src.entries;
+  report->track_count = src.arrays;
+  report->figure_count = src.figures;
+  report->chord_count = src.chords;
+  report->note_count = src.notes;
+  report->entry_bytes = src.entry_bytes;
+  report->track_bytes = src.array_bytes;
+  report->figure_bytes = src.figure_bytes;
+  report->chord_bytes = src.chord_bytes;
+  report->pitch_bytes = src.pitch_bytes;
+  report->value_bytes = src.value_bytes;
+  report->arena_bytes = src.arena_bytes;
+  report->arena_capacity = src.arena_capacity;
+  report->index_bytes = src.index_bytes;
+  report->mapped_bytes = src.mapped_bytes;
+  report->resident_bytes = src.resident_bytes;
+  return 0;
+}
+
+int
+LIBAM_EXPORT(libam_model_load_file_report)(am_model_t *model, unsigned int index, am_load_file_report_t *report)
+{
+  if( !model || !report )
+    return -RC_FAILED;
+
+  std::shared_ptr<const autocomp::KnowledgeModel> knowledgeModel = model->sharedModel->acquire();
+  const autocomp::KnowledgeLoadReport &src = knowledgeModel->loadReport();
+  if( index >= src.files.size() )
+    return -RC_FAILED;
+
+  const autocomp::KnowledgeFileReport &file = src.files[index];
+  report->filename = file.filename.c_str();
+  report->status = file.status;
+  report->parse_ms = file.parse_ms;
+  report->entry_count = file.entries;
+  report->figure_count = file.figures;
+  report->note_count = file.notes;
+  report->bytes = file.bytes;
+  return 0;
+}
+
+void
+LIBAM_EXPORT(libam_set_log_callback)(am_log_callback_t callback, void *opaque)
+{
+  autocomp::util::set_log_callback(callback, opaque);
+}
+
+static am_context_t *
+new_context(const std::shared_ptr<autocomp::SharedKnowledgeModel> &sharedModel,
+            const std::shared_ptr<const autocomp::KnowledgeModel> &knowledgeModel)
+{
+  am_context_t *context = new am_context_t;
+  context->sharedModel = sharedModel;
+  context->composition = new autocomp::CompositionToplevel(knowledgeModel);
+  context->output = new autocomp::Output;
+  context->formCallback = 0l;
+  context->formOpaque = 0l;
+  return context;
+}
+
+am_context_t *
+LIBAM_EXPORT(libam_create_context_from_model)(am_model_t *model)
+{
+  if( !model )
+    return 0l;
+
+  return new_context(model->sharedModel, model->sharedModel->acquire());
+}
+
+void
+LIBAM_EXPORT(libam_free_model)(am_model_t *model)
+{
+  delete model;
+}
+
+int
+LIBAM_EXPORT(libam_compile_models)(const char *modelPath, const char *filename)
+{
+  char filename_buff[4096];
+  if( !filename )
     {
-      libam_free_context(context);
-      return 0l;
+      std::snprintf(filename_buff, sizeof filename_buff, "%s/%s", modelPath, KNOWLEDGE_BANK_FILENAME);
+      filename = filename_buff;
     }
-  return context;
+
+  autocomp::KnowledgeModel model;
+  if( int err = model.loadSourceModels(modelPath) )
+    return err;
+  return model.compileModels(filename);
+}
+
+int
+LIBAM_EXPORT(libam_set_threads)(am_context_t *context, int threads)
+{
+  if( threads < 0 )
+    return -RC_FAILED;
+  context->composition->setThreads(threads);
+  return 0;
+}
+
+static bool note_cmp(const am_note_t &a, const am_note_t &b)
+{
+  return a.start < b.start;
+}
+
+/*
+ * Convert a form just composed by a progressive composition for the receiver of the context.
+ */
+static int form_callback(void *opaque, const autocomp::CompositionToplevel *composition, std::size_t form_index)
+{
+  am_context_t *context = static_cast<am_context_t *>(opaque);
+  const autocomp::CompositionChain &chains = composition->chains();
+  const std::vector<int> &timbres = context->composition->generator()->timbreBanks();
+  int beats = context->composition->generator()->beats();
+
+  std::vector<autocomp::PitchNote> pitchs;
+  context->formNotes.clear();
+  for(std::size_t track=0; track < chains.trackCount(); track++)
+    {
+      pitchs.clear();
+      autocomp::Output::formNotes(pitchs, chains[track][form_index], beats);
+      for(std::size_t j=0; j < pitchs.size(); j++)
+        {
+          am_note_t note;
+          note.track = track;
+          note.pitch = pitchs[j].pitch;
+          note.velocity = pitchs[j].velocity;
+          note.start = pitchs[j].start;
+          note.end = pitchs[j].end;
+          context->formNotes.push_back(note);
+        }
+    }
+  std::stable_sort(context->formNotes.begin(), context->formNotes.end(), note_cmp);
+
+  am_form_t form;
+  form.form_index = form_index;
+  form.form_count = chains.formCount();
+  form.begin = chains.trackCount() ? chains[0][form_index].form.begin() : 0;
+  form.end = chains.trackCount() ? chains[0][form_index].form.end() : 0;
+  form.track_count = chains.trackCount();
+  form.timbres = timbres.size() ? &timbres[0] : 0l;
+  form.notes = context->formNotes.size() ? &context->formNotes[0] : 0l;
+  form.note_count = context->formNotes.size();
+  return context->formCallback(context->formOpaque, &form);
+}
+
+int
+LIBAM_EXPORT(libam_set_form_callback)(am_context_t *context, am_form_callback_t callback, void *opaque)
+{
+  context->formCallback = callback;
+  context->formOpaque = opaque;
+  context->composition->setFormCallback(callback ? form_callback : 0l, context);
+  return 0;
+}
+
+/*
+ * Pick up the latest generation of the models, if it was reloaded since the last composition.
+ */
+static void acquire_model(am_context_t *context)
+{
+  std::shared_ptr<const autocomp::KnowledgeModel> knowledgeModel = context->sharedModel->acquire();
+  if( knowledgeModel.get() != context->composition->knowledgeModel() )
+    context->composition->setKnowledgeModel(knowledgeModel);
 }
 
 int
 LIBAM_EXPORT(libam_composite_by_image)(am_context_t *context, int form_template_index, int beats, const char *filename)
 {
+  acquire_model(context);
+
   if( int err = context->composition->generator()->gen(filename, form_template_index, beats) )
     return err;
   if( int err = context->composition->startup() )
@@ -78,6 +339,176 @@ LIBAM_EXPORT(libam_composite_by_image)(am_context_t *context, int form_template_
   return 0;
 }
 
+void
+LIBAM_EXPORT(libam_image_options_init)(am_image_options_t *options)
+{
+  std::memset(options, 0, sizeof(*options));
+  options->reduction = 1;
+  options->max_dimension = 0;
+}
+
+int
+LIBAM_EXPORT(libam_composite_by_image_buffer)(am_context_t *context, int form_template_index, int beats,
+                                              const void *data, size_t size, const am_image_options_t *options)
+{
+  am_image_options_t default_options;
+  if( !options )
+    {
+      libam_image_options_init(&default_options);
+      options = &default_options;
+    }
+  if( !data || !size ||
+      (options->reduction != 1 && options->reduction != 2 && options->reduction != 4 && options->reduction != 8) ||
+      options->max_dimension < 0 )
+    return -RC_FAILED;
+
+  acquire_model(context);
+
+  if( int err = context->composition->generator()->gen(data, size, options->reduction, options->max_dimension, form_template_index, beats) )
+    return err;
+  if( int err = context->composition->startup() )
+    return err;
+
+  return 0;
+}
+
+void
+LIBAM_EXPORT(libam_composition_params_init)(am_composition_params_t *params)
+{
+  std::memset(params, 0, sizeof(*params));
+  params->form_template_index = 0;
+  params->beats = 4;
+  params->seed = 0;
+  params->character = 0;
+  params->genre = 0;
+  params->chord_factor = -1;
+  params->timbre_factor = -1;
+}
+
+int
+LIBAM_EXPORT(libam_composite_by_params)(am_context_t *context, const am_composition_params_t *params)
+{
+  if( !params || params->chord_factor > 1 || params->timbre_factor > 1 ||
+      params->character < 0 || params->character >= MAX_CHARACTER_INDEX )
+    return -RC_FAILED;
+
+  acquire_model(context);
+  context->composition->reset();
+
+  if( int err = context->composition->generator()->gen(params->form_template_index, params->character, params->genre, params->beats,
+                                                         params->seed, params->chord_factor, params->timbre_factor) )
+    return err;
+  if( int err = context->composition->startup() )
+    return err;
+
+  return 0;
+}
+
+int
+LIBAM_EXPORT(libam_composition_layout)(am_context_t *context, int *track_count, int *form_count)
+{
+  if( !track_count || !form_count )
+    return -RC_FAILED;
+
+  const autocomp::CompositionChain &chains = context->composition->chains();
+  *track_count = chains.trackCount();
+  *form_count = chains.formCount();
+  return 0;
+}
+
+int
+LIBAM_EXPORT(libam_recomposite_track)(am_context_t *context, int track)
+{
+  if( track < 0 )
+    return -RC_FAILED;
+  return context->composition->recomposeTrack(track);
+}
+
+int
+LIBAM_EXPORT(libam_recomposite_forms)(am_context_t *context, int track, int form_begin, int form_end)
+{
+  if( form_begin < 0 || form_end <= form_begin )
+    return -RC_FAILED;
+  return context->composition->recomposeForms(track, form_begin, form_end);
+}
+
+int
+LIBAM_EXPORT(libam_image_params)(const void *data, size_t size, const am_image_options_t *options, am_composition_params_t *params)
+{
+  am_image_options_t default_options;
+  if( !options )
+    {
+      libam_image_options_init(&default_options);
+      options = &default_options;
+    }
+  if( !data || !size || !params ||
+      (options->reduction != 1 && options->reduction != 2 && options->reduction != 4 && options->reduction != 8) ||
+      options->max_dimension < 0 )
+    return -RC_FAILED;
+
+  if( int err = autocomp::ParameterGenerator::imageParameters(data, size, options->reduction, options->max_dimension,
+                                                             &params->seed, &params->character,
+                                                             &params->chord_factor, &params->timbre_factor) )
+    return err;
+  params->genre = 0;
+  return 0;
+}
+
+int
+LIBAM_EXPORT(libam_composite_variations)(am_context_t *context, const am_composition_params_t *params,
+                                         const int *seeds, const double *chord_factors, const double *timbre_factors,
+                                         int count, am_context_t **variations)
+{
+  if( !params || params->chord_factor > 1 || params->timbre_factor > 1 ||
+      params->character < 0 || params->character >= MAX_CHARACTER_INDEX ||
+      count < 0 || (count && !variations) )
+    return -RC_FAILED;
+  for(int i=0; i < count; i++)
+    {
+      if( (chord_factors && chord_factors[i] > 1) || (timbre_factors && timbre_factors[i] > 1) )
+        return -RC_FAILED;
+    }
+
+  std::shared_ptr<const autocomp::KnowledgeModel> knowledgeModel = context->sharedModel->acquire();
+
+  /*
+   * The candidates depend on nothing of the seed, so they are collected once and only read by the variations.
+   */
+  autocomp::ParameterCandidates candidates;
+  if( int err = autocomp::ParameterGenerator::collectCandidates(candidates, knowledgeModel.get(),
+                                                                params->character, params->genre, 0l, 0l) )
+    return err;
+
+  std::vector<am_context_t *> contexts(count);
+  std::vector<int> results(count, 0);
+  for(int i=0; i < count; i++)
+    contexts[i] = new_context(context->sharedModel, knowledgeModel);
+
+  context->composition->pool().run(count, [&](std::size_t i) {
+      autocomp::CompositionToplevel *composition = contexts[i]->composition;
+      int seed = seeds ? seeds[i] : (int)((unsigned int)params->seed + (unsigned int)i); /* wraps around INT_MAX */
+      double chord_factor = chord_factors ? chord_factors[i] : params->chord_factor;
+      double timbre_factor = timbre_factors ? timbre_factors[i] : params->timbre_factor;
+      if( (results[i] = composition->generator()->gen(candidates, params->form_template_index, params->beats,
+                                                      seed, chord_factor, timbre_factor)) )
+        return;
+      results[i] = composition->startup();
+  });
+
+  for(int i=0; i < count; i++)
+    {
+      if( results[i] )
+        {
+          for(int j=0; j < count; j++)
+            libam_free_context(contexts[j]);
+          return results[i];
+        }
+    }
+  for(int i=0; i < count; i++)
+    variations[i] = contexts[i];
+  return 0;
+}
+
 int
 LIBAM_EXPORT(libam_output_file)(am_context_t *context, int filetype, const char *filename)
 {
@@ -30,6 +30,14 @@ ModelLibrary::ModelLibrary() :
 {
 }
 
+ModelLibrary::~ModelLibrary()
+{
+  delete m_percussionModel;
+  delete m_soloMelody;
+  delete m_soloInstrumental;
+  delete m_chord;
+}
+
 /**
  * @brief Invoke a model to generate figures based on bank and class.
  */
@@ -17,6 +17,7 @@
 
 #include <vector>
 #include "typedefs.h"
+#include "util-randomize.h"
 
 namespace autocomp
 {
@@ -34,6 +35,7 @@ public:
   virtual const char *model_name() const=0;
   virtual int generate(std::vector<PitchNote> &dst,
                        CompositionToplevel *composition,
+                       util::RandomStream &random,
                        int src_figure_bank,
                        const std::vector<ChordPair> &src_chords,
                        const std::vector<PitchNote> &src_figure,
@@ -50,6 +52,7 @@ class ModelLibrary
 {
 public:
   ModelLibrary();
+  ~ModelLibrary();
 
   ModelBase *invokeModel(int figure_bank, int figure_class);
 
@@ -25,6 +25,7 @@ const char *ModelChord::model_name() const
 
 int ModelChord::generate(std::vector<PitchNote> &dst,
                      CompositionToplevel *composition,
+                     util::RandomStream &random,
                      int src_figure_bank,
                      const std::vector<ChordPair> &src_chords,
                      const std::vector<PitchNote> &src_figures,
@@ -22,6 +22,7 @@ const char *ModelPercussion::model_name() const
 
 int ModelPercussion::generate(std::vector<PitchNote> &dst,
                      CompositionToplevel *composition,
+                     util::RandomStream &random,
                      int src_figure_bank,
                      const std::vector<ChordPair> &src_chords,
                      const std::vector<PitchNote> &src_figures,
@@ -26,6 +26,7 @@ public:
   virtual const char *model_name() const;
   virtual int generate(std::vector<PitchNote> &dst,
                        CompositionToplevel *composition,
+                       util::RandomStream &random,
                        int src_figure_bank,
                        const std::vector<ChordPair> &src_chords,
                        const std::vector<PitchNote> &src_figure,
@@ -32,6 +32,7 @@ const char *ModelSoloInstrumental::model_name() const
 
 int ModelSoloInstrumental::generate(std::vector<PitchNote> &dst,
                        CompositionToplevel *composition,
+                       util::RandomStream &random,
                        int src_figure_bank,
                        const std::vector<ChordPair> &src_chords,
                        const std::vector<PitchNote> &src_figure,
@@ -50,20 +51,21 @@ int ModelSoloInstrumental::generate(std::vector<PitchNote> &dst,
   std::vector<const FigureListEntry *> candidate_rhythm_list;
   for(std::size_t i=0; i < composition->soloRhythmEntries().size(); i++)
     {
-      const FigureListEntry *form = theory::pick_form(dst_form_id, composition->soloRhythmEntries()[i]->figure_list);
+      const FigureListEntry *form = theory::pick_form(random, dst_form_id, *composition->soloRhythmEntries()[i]);
       candidate_rhythm_list.push_back(form);
     }
   const FigureListEntry *current_form = candidate_rhythm_list[0];
   for(std::size_t i=0; i < candidate_rhythm_list.size(); i++)
     {
-      if( candidate_rhythm_list[i]->pitchs.size() )
+      if( candidate_rhythm_list[i]->pitchCount() )
         {
           current_form = candidate_rhythm_list[i];
           break;
         }
     }
 
-  std::vector<PitchNote> current_rhythm_figures(current_form->pitchs);
+  std::vector<PitchNote> current_rhythm_figures;
+  current_form->pitchs().decode(current_rhythm_figures);
   int current_rhythm_barlen = current_form->end - current_form->begin;
   int new_offset = current_form->offset;
 
@@ -75,7 +77,7 @@ int ModelSoloInstrumental::generate(std::vector<PitchNote> &dst,
   if( int err = theory::transform_figure_chord(dst_figures, src_track_key, src_chords, dst_rhythm_figures, dst_barlen, key, dst_chords, scale, new_offset, beats) )
     return err;
 
-  return transform_figure_solo(dst, dst_figures, dst_barlen, new_offset, dst_chords, key, scale, beats);
+  return transform_figure_solo(dst, random, dst_figures, dst_barlen, new_offset, dst_chords, key, scale, beats);
 }
 
 /**
@@ -205,6 +207,7 @@ int ModelSoloInstrumental::transform_rhythm_solo(std::vector<PitchNote> &dst,
 }
 
 int ModelSoloInstrumental::transform_figure_solo(std::vector<PitchNote> &dst,
+                          util::RandomStream &random,
                           const std::vector<PitchNote> &src_figures,
                           int barlen,
                           int offset,
@@ -281,7 +284,7 @@ int ModelSoloInstrumental::transform_figure_solo(std::vector<PitchNote> &dst,
               else if( ABS(pre_end - cur_start) <= 4 && ABS(cur_end - next_start) <= 4 &&
                         next_pitch == pre_pitch && next_pitch == cur_pitch && pre_pitch == cur_pitch &&
                         (cur_start > (reg_figure_list[-1].end - reg_figure_list[0].start) / 4 + reg_figure_list[0].start ||
-                        util::random_range(101) < 50) )
+                        util::random_range(random, 101) < 50) )
                 {
                   if( ABS(avg_pitch_no - cur_pitch) > 5 )
                     {
@@ -292,7 +295,7 @@ int ModelSoloInstrumental::transform_figure_solo(std::vector<PitchNote> &dst,
                     }
                   else
                     {
-                      int rand_diff = util::random_range(101) < 50 ? -1 : 1;
+                      int rand_diff = util::random_range(random, 101) < 50 ? -1 : 1;
                       reg_figure_list[i].pitch = theory::pitch_get_in_scale(pre_pitch, rand_diff, key, scale);
                     }
                 }
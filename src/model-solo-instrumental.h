@@ -29,6 +29,7 @@ public:
   virtual const char *model_name() const;
   virtual int generate(std::vector<PitchNote> &dst,
                        CompositionToplevel *composition,
+                       util::RandomStream &random,
                        int src_figure_bank,
                        const std::vector<ChordPair> &src_chords,
                        const std::vector<PitchNote> &src_figure,
@@ -48,6 +49,7 @@ protected:
                             const std::vector<ChordPair> &chord_list,
                             int beats = 4);
   int transform_figure_solo(std::vector<PitchNote> &dst,
+                            util::RandomStream &random,
                             const std::vector<PitchNote> &src_figures,
                             int barlen,
                             int offset,
@@ -26,6 +26,7 @@ const char *ModelSoloMelody::model_name() const
 
 int ModelSoloMelody::generate(std::vector<PitchNote> &dst,
                        CompositionToplevel *composition,
+                       util::RandomStream &random,
                        int src_figure_bank,
                        const std::vector<ChordPair> &src_chords,
                        const std::vector<PitchNote> &src_figure,
@@ -44,12 +45,13 @@ int ModelSoloMelody::generate(std::vector<PitchNote> &dst,
   std::vector<const FigureListEntry *> candidate_rhythm_list;
   for(std::size_t i=0; i < composition->melodyRhythmEntries().size(); i++)
     {
-      const FigureListEntry *form = theory::pick_form(dst_form_id, composition->melodyRhythmEntries()[i]->figure_list);
+      const FigureListEntry *form = theory::pick_form(random, dst_form_id, *composition->melodyRhythmEntries()[i]);
       candidate_rhythm_list.push_back(form);
     }
   const FigureListEntry *current_form = candidate_rhythm_list[0];
 
-  std::vector<PitchNote> current_rhythm_figures(current_form->pitchs);
+  std::vector<PitchNote> current_rhythm_figures;
+  current_form->pitchs().decode(current_rhythm_figures);
   int current_rhythm_barlen = current_form->end - current_form->begin;
   int new_offset = current_form->offset;
 
@@ -62,7 +64,7 @@ int ModelSoloMelody::generate(std::vector<PitchNote> &dst,
   if( int err = theory::transform_figure_chord(dst_figures, src_track_key, src_chords, dst_rhythm_figures, dst_barlen, key, dst_chords, scale, new_offset, beats) )
     return err;
 
-  return transform_figure_solo(dst, dst_figures, dst_barlen, new_offset, dst_chords, key, scale, beats);
+  return transform_figure_solo(dst, random, dst_figures, dst_barlen, new_offset, dst_chords, key, scale, beats);
 }
 
 }
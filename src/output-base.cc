@@ -37,33 +37,44 @@ Output::~Output()
     delete m_outputInstances[--m_numOutputMod];
 }
 
+/**
+ * @brief Append the notes of a form, positioned in 64th notes from the beginning of the composition.
+ * The notes falling before the beginning are dropped.
+ */
+void Output::formNotes(std::vector<PitchNote> &dst, const CompositionChainNode &node, int beats)
+{
+  int offset = int(node.form.begin() * beats - node.offset) * 2 * 2 * 2 * 2;
+  for(std::size_t j=0; j < node.pitch.size(); j++)
+    {
+      const PitchNote &note = node.pitch[j];
+      if( note.start + offset >= 0 )
+        dst.push_back(PitchNote(note.pitch, note.velocity, note.start + offset, note.end + offset));
+    }
+}
+
 static int trackCompositionChainToNotes(std::vector<OutputBase::Event> &dst,
-                                 const std::vector<CompositionChainNode *> &compositionChainTrack, int beats)
+                                 const CompositionChainNode *compositionChainTrack, std::size_t formCount, int beats)
 {
+  std::vector<PitchNote> notes;
   dst.clear();
-  for(std::size_t form_index=0; form_index < compositionChainTrack.size(); form_index++)
+  for(std::size_t form_index=0; form_index < formCount; form_index++)
     {
-      if(compositionChainTrack[form_index]->pitch.size())
+      notes.clear();
+      Output::formNotes(notes, compositionChainTrack[form_index], beats);
+      for(std::size_t j=0; j < notes.size(); j++)
         {
-          int offset = int(compositionChainTrack[form_index]->form.begin() * beats - compositionChainTrack[form_index]->offset) * 2 * 2 * 2 * 2;
-          for(std::size_t j=0; j < compositionChainTrack[form_index]->pitch.size(); j++)
-            {
-              const PitchNote &note = compositionChainTrack[form_index]->pitch[j];
-              if( note.start + offset >= 0 )
-                {
-                  OutputBase::Event event;
-                  event.pitch = note.pitch;
-                  event.velocity = note.velocity;
-
-                  event.off = false; /* Note on */
-                  event.tick = note.start + offset;
-                  event.duration = note.end - note.start;
-                  dst.push_back(event);
-                  event.off = true; /* Note off */
-                  event.tick = note.end + offset;
-                  dst.push_back(event);
-                }
-            }
+          const PitchNote &note = notes[j];
+          OutputBase::Event event;
+          event.pitch = note.pitch;
+          event.velocity = note.velocity;
+
+          event.off = false; /* Note on */
+          event.tick = note.start;
+          event.duration = note.end - note.start;
+          dst.push_back(event);
+          event.off = true; /* Note off */
+          event.tick = note.end;
+          dst.push_back(event);
         }
     }
   return 0;
@@ -76,7 +87,7 @@ static bool sequence_cmp(const OutputBase::Event &a, const OutputBase::Event &b)
 
 int Output::outputCompositionChain(const std::string &filename,
                                    int filetype,
-                                   const std::vector<std::vector<CompositionChainNode *>> &compositionChain,
+                                   const CompositionChain &compositionChain,
                                    const std::vector<int> &timbres,
                                    const std::vector<int> &figureBanks, const std::vector<int> &figureClasses,
                                    int beat_type, int beats, float tempo)
@@ -96,7 +107,7 @@ int Output::outputCompositionChain(const std::string &filename,
         return rc;
 
       std::vector<OutputBase::Track> sequence;
-      for(std::size_t track=0; track < compositionChain.size(); track++)
+      for(std::size_t track=0; track < compositionChain.trackCount(); track++)
         {
           OutputBase::Track trackseq;
           /* Wrap the basic parameter of this track */
@@ -105,7 +116,7 @@ int Output::outputCompositionChain(const std::string &filename,
           trackseq.figureClass = figureClasses[track];
 
           /* Get the list of sorted note events */
-          if( int rc = trackCompositionChainToNotes(trackseq.events, compositionChain[track], beats) )
+          if( int rc = trackCompositionChainToNotes(trackseq.events, compositionChain[track], compositionChain.formCount(), beats) )
             return rc;
           quantifyNoteSequence(trackseq.events, outputInstance->tick_64p());
           std::sort(trackseq.events.begin(), trackseq.events.end(), sequence_cmp);
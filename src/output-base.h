@@ -19,6 +19,7 @@
 #include <string>
 
 #include "typedefs.h"
+#include "composition-chain.h"
 
 namespace autocomp
 {
@@ -50,7 +51,7 @@ public:
   virtual int outputFinal(std::ofstream &stream)=0;
 };
 
-#define MAX_OUTPUT_MODS 2 /* the number of output modules */
+#define MAX_OUTPUT_MODS 3 /* the number of output modules */
 
 class Output
 {
@@ -60,11 +61,12 @@ public:
 
   int outputCompositionChain(const std::string &filename,
                              int filetype,
-                             const std::vector<std::vector<CompositionChainNode *>> &compositionChain,
+                             const CompositionChain &compositionChain,
                              const std::vector<int> &timbres,
                              const std::vector<int> &figureBanks, const std::vector<int> &figureClasses,
                              int beat_type, int beats, float tempo);
   void quantifyNoteSequence(std::vector<OutputBase::Event> &dstSequence, float tick_64p);
+  static void formNotes(std::vector<PitchNote> &dst, const CompositionChainNode &node, int beats);
 
 private:
   OutputBase *m_outputInstances[MAX_OUTPUT_MODS];
@@ -19,6 +19,7 @@
 
 #include "libautomusic.h"
 #include "output-midi.h"
+#include "util-log.h"
 
 namespace autocomp
 {
@@ -169,7 +170,7 @@ int OutputMIDI::mf_w_midi_event(std::ofstream &stream, uint32_t abs_time, uint16
 
   if( channel > 15 )
     {
-      std::cerr << "error: MIDI channel greater than 16\n" << std::endl;
+      util::log(util::LOG_ERROR, "error: MIDI channel greater than 16");
       return -RC_FAILED;
     }
   if( m_laststate != c )
@@ -222,7 +223,7 @@ uint32_t OutputMIDI::getDeltaTime(uint32_t absTime)
   uint32_t deltaTime = absTime - m_currentTime;
   if (deltaTime < 0)
     {
-      std::cerr << "Illegal time value" << std::endl;
+      util::log(util::LOG_ERROR, "Illegal time value");
       return -1;
     }
   m_currentTime = absTime;
@@ -307,6 +308,7 @@ int OutputMIDI::writeMIDI(std::ofstream &stream, int format, int division)
 
 int OutputMIDI::outputPrepare(std::ofstream &stream, int beat_time, int beats, float tempo)
 {
+  removeTracks(); /* the tracks of the previous output */
   m_mf_pnq = MICROSECONDS_PER_MINUTE / tempo;
   return 0;
 }
@@ -25,94 +25,201 @@
 
 #ifdef ENABLE_IMAGE_COMPOSITION
 # include <cmath>
+# include <climits>
+# include <algorithm>
 # include <opencv2/core.hpp>
 # include <opencv2/highgui.hpp>
+# include <opencv2/imgcodecs.hpp>
 # include <opencv2/imgproc.hpp>
 #endif
 
 namespace autocomp
 {
 
-ParameterGenerator::ParameterGenerator(KnowledgeModel *knowledgeModel)
+ParameterGenerator::ParameterGenerator(const KnowledgeModel *knowledgeModel)
     : m_knowledgeModel(knowledgeModel),
       m_current_chord_knowledge_entry(0l),
       m_current_timbre_knowledge_entry(0l),
+      m_chains(new FormChain),
       m_key(-1),
       m_scale(-1),
       m_beats(0),
       m_character(-1),
       m_genre(-1),
+      m_seed(0),
       m_generated(false)
 {
 }
 
-int ParameterGenerator::gen_inner(int form_template_index, int character, int genre, int beats, int rand_seed, double chord_factor, double timbre_factor)
+/**
+ * @brief Switch to another model, dropping the parameters generated from the previous one.
+ */
+void ParameterGenerator::setKnowledgeModel(const KnowledgeModel *knowledgeModel)
+{
+  m_knowledgeModel = knowledgeModel;
+  reset();
+}
+
+/**
+ * @brief Drop the generated parameters, so the next generation does not avoid the entries selected by this one.
+ */
+void ParameterGenerator::reset()
+{
+  m_candidates.chords.clear();
+  m_candidates.in_key_chords.clear();
+  m_candidates.timbres.clear();
+  m_current_chord_knowledge_entry = 0l;
+  m_current_timbre_knowledge_entry = 0l;
+  m_generated = false;
+}
+
+#ifdef ENABLE_IMAGE_COMPOSITION
+/**
+ * @brief Extract the seed, the character and the factors of composition from the Hu moments of a grayscale image.
+ */
+static void image_parameters(const cv::Mat &img_gray, int *seed, int *character, double *chord_factor, double *timbre_factor)
+{
+  cv::Moments mts = cv::moments(img_gray);
+  
+  double hu[7];
+  cv::HuMoments(mts, hu);
+  
+  double modsum = hu[0];
+  for (int i=0; i<7; i++)
+    {
+      double val = std::log(std::fabs(hu[i]));
+      if (modsum > val) modsum = val;
+    }
+
+  const double random_gain = 10000;
+  *seed = std::abs(int(modsum * random_gain));
+  *character = int(std::log(std::fabs(hu[0])) / modsum * MAX_CHARACTER_INDEX); /* normalize */
+  *chord_factor = std::log(std::fabs(hu[1])) / modsum;
+  *timbre_factor = std::log(std::fabs(hu[2])) / modsum;
+}
+#endif
+
+/**
+ * @brief Remap the chords of each form from a time signature to another, the 4/4 and 3/4 are supported.
+ */
+static void remapChordBeats(FormChain &chains, int src_beats, int dst_beats)
+{
+  for(std::size_t i=0; i < chains.size(); i++)
+    {
+      const std::vector<ChordPair> &ori_chord_list = chains[i].chords;
+      if( src_beats == 4 && dst_beats == 3 )
+        {
+          std::vector<ChordPair> new_chord_list;
+          for(std::size_t j=0; j < ori_chord_list.size(); j += 4)
+            {
+              for(unsigned int k=0; k < 3; k++)
+                new_chord_list.push_back(ori_chord_list[j + 2]);
+            }
+          chains[i].chords = new_chord_list;
+        }
+      else if( src_beats == 3 && dst_beats == 4 )
+        {
+          std::vector<ChordPair> new_chord_list;
+          for(std::size_t j=0; j < ori_chord_list.size(); j += 3)
+            {
+              for(unsigned int k = j; k < j + 3; k++)
+                new_chord_list.push_back(ori_chord_list[k]);
+              new_chord_list.push_back(ori_chord_list[j + 2]);
+            }
+          chains[i].chords = new_chord_list;
+        }
+    }
+}
+
+/**
+ * @brief Collect the candidate chord and timbre entries of a character and a genre.
+ * @param exclude_chord Entry not to be a candidate, e.g. the one of the previous generation. NULL = none.
+ * @param exclude_timbre Ditto.
+ */
+int ParameterGenerator::collectCandidates(ParameterCandidates &dst, const KnowledgeModel *knowledgeModel,
+                                          int character, int genre,
+                                          const KnowledgeEntry *exclude_chord, const KnowledgeEntry *exclude_timbre)
 {
   using namespace std;
 
-  util::set_rand_seed(rand_seed);
+  dst.character = character;
+  dst.genre = genre;
+  dst.chords.clear();
+  dst.in_key_chords.clear();
+  dst.timbres.clear();
 
   /*
    * Generate candidate chords based on music character.
    * Above all else generating a compatible chord development is the beginning of our work.
    * This will select in-key chords as far as possible...
    */
-  if( int err = m_knowledgeModel->getChord(m_candidate_chord_knowledge_entries, (m_character = character)) )
+  const vector<const KnowledgeEntry *> *chord_entries = 0l;
+  if( int err = knowledgeModel->getChord(&chord_entries, character) )
     return err;
 
-  for(vector<const KnowledgeEntry *>::iterator iter = m_candidate_chord_knowledge_entries.begin();
-      iter != m_candidate_chord_knowledge_entries.end(); )
+  for(std::size_t i=0; i < chord_entries->size(); i++)
     {
-      if( (*iter) == m_current_chord_knowledge_entry )
-        m_candidate_chord_knowledge_entries.erase(iter);
-      else
-        iter++;
+      if( (*chord_entries)[i] != exclude_chord )
+        dst.chords.push_back((*chord_entries)[i]);
     }
 
-  std::vector<const KnowledgeEntry *> penality_list;
-  std::vector<const FigureListEntry *> figure_list;
-
-  for(std::size_t i=0; i < m_candidate_chord_knowledge_entries.size(); i++)
+  for(std::size_t i=0; i < dst.chords.size(); i++)
     {
-      const KnowledgeEntry *knowledgeEntry = m_candidate_chord_knowledge_entries[i];
-
-      const vector<const FigureListEntry *> &figureList = knowledgeEntry->m_knowledgeArrayEntries[0]->figure_list;
-      int key = knowledgeEntry->key;
-      int scale = knowledgeEntry->scale;
-      int out_chord_num = 0;
-      int chord_num = 0;
-      for(std::size_t j=0; j <figureList.size(); j++)
-        {
-          const FigureListEntry *figure = figureList[j];
+      const KnowledgeEntry *knowledgeEntry = dst.chords[i];
 
-          for(std::size_t k=0; k < figure->chord.size(); k++)
-            {
-              if( !theory::chord_is_in_key(figure->chord[k], key, scale) )
-                ++out_chord_num;
-            }
-          chord_num += figure->chord.size();
-        }
-      if( float(out_chord_num) / chord_num <= 1.0 / 20 )
+      if( knowledgeEntry->out_of_key_ratio <= 1.0 / 20 )
         {
-          penality_list.push_back(knowledgeEntry);
+          dst.in_key_chords.push_back(knowledgeEntry);
         }
     }
 
+  const vector<const KnowledgeEntry *> *timbre_entries = 0l;
+  if( int rc = knowledgeModel->getTimbreBank(&timbre_entries, genre) )
+    return rc;
+
+  for(std::size_t i=0; i < timbre_entries->size(); i++)
+    {
+      if( (*timbre_entries)[i] != exclude_timbre )
+        dst.timbres.push_back((*timbre_entries)[i]);
+    }
+  return 0;
+}
+
+int ParameterGenerator::gen_inner(int form_template_index, int character, int genre, int beats, int rand_seed, double chord_factor, double timbre_factor)
+{
+  if( int err = collectCandidates(m_candidates, m_knowledgeModel, character, genre,
+                                  m_current_chord_knowledge_entry, m_current_timbre_knowledge_entry) )
+    return err;
+  return gen(m_candidates, form_template_index, beats, rand_seed, chord_factor, timbre_factor);
+}
+
+/**
+ * @brief Generate the parameters from candidates collected beforehand, which may be shared by many generators.
+ * @param chord_factor Position of the chord entry among the candidates, ranged from [0, 1], negative = random.
+ * @param timbre_factor Position of the timbre entry among the candidates, ranged from [0, 1], negative = random.
+ */
+int ParameterGenerator::gen(const ParameterCandidates &candidates, int form_template_index, int beats, int seed, double chord_factor, double timbre_factor)
+{
+  m_random.seed((m_seed = seed));
+  m_character = candidates.character;
+  m_genre = candidates.genre;
+
+  const std::vector<const KnowledgeEntry *> &penality_list = candidates.in_key_chords;
+  if( candidates.chords.empty() )
+    return -1;
+
   if( penality_list.size() > 10 )
       if( chord_factor < 0 )
-        m_current_chord_knowledge_entry = util::random_choice(penality_list);
+        m_current_chord_knowledge_entry = util::random_choice(m_random, penality_list);
       else
         m_current_chord_knowledge_entry = util::factor_choice(penality_list, chord_factor); /* controlled randomization */
   else
       if( chord_factor < 0 )
-        m_current_chord_knowledge_entry = util::random_choice(m_candidate_chord_knowledge_entries);
+        m_current_chord_knowledge_entry = util::random_choice(m_random, candidates.chords);
       else
-        m_current_chord_knowledge_entry = util::factor_choice(m_candidate_chord_knowledge_entries, chord_factor);
+        m_current_chord_knowledge_entry = util::factor_choice(candidates.chords, chord_factor);
 
-  for(std::size_t i=0; i < m_current_chord_knowledge_entry->m_knowledgeArrayEntries[0]->figure_list.size(); i++)
-    {
-      figure_list.push_back(m_current_chord_knowledge_entry->m_knowledgeArrayEntries[0]->figure_list[i]);
-    }
+  const KnowledgeArrayEntry &figure_list = m_current_chord_knowledge_entry->m_knowledgeArrayEntries[0];
 
   /*
    * Generate key mode and time-beat for the whole music works, which is based on the selected chords.
@@ -136,61 +243,38 @@ int ParameterGenerator::gen_inner(int form_template_index, int character, int ge
   if( m_forms[0].type() != StructureForm::FORM_BLANK )
     m_forms.push_back(StructureForm(StructureForm::FORM_BLANK, 1, 0, 1));
 
-  if( int rc = coordinateChordWithFormChain(m_chains, m_forms, figure_list, m_key, m_scale) )
-    return rc;
-
-  int dst_beats = beats;
-  m_beats = 4;
-
-  for(std::size_t i=0; i < m_chains.size(); i++)
+  /*
+   * The chord plan only depends on the chord entry, the template and the beats, unless it fell back to a random figure,
+   * so it is looked up first among the plans of the model shared by all the compositions.
+   */
+  ChordPlanCache &plans = m_knowledgeModel->chordPlans();
+  m_chains = plans.find(m_current_chord_knowledge_entry, form_template_index, beats);
+  m_beats = beats;
+  if( !m_chains )
     {
-      const std::vector<ChordPair> &ori_chord_list = m_chains[i]->chords;
-      if( m_beats == 4 && dst_beats == 3 )
+      std::shared_ptr<FormChain> chains(new FormChain);
+      bool randomized;
+      if( int rc = coordinateChordWithFormChain(*chains, &randomized, m_forms, figure_list, m_key, m_scale) )
         {
-          std::vector<ChordPair> new_chord_list;
-          for(std::size_t j=0; j < ori_chord_list.size(); j += 4)
-            {
-              for(unsigned int k=0; k < 3; k++)
-                new_chord_list.push_back(ori_chord_list[j + 2]);
-            }
-          m_chains[i]->chords = new_chord_list;
+          m_chains.reset(new FormChain);
+          return rc;
         }
-      else if( m_beats == 3 && dst_beats == 4 )
-        {
-          std::vector<ChordPair> new_chord_list;
-          for(std::size_t j=0; j < ori_chord_list.size(); j += 3)
-            {
-              for(unsigned int k = j; k < j + 3; k++)
-                new_chord_list.push_back(ori_chord_list[k]);
-              new_chord_list.push_back(ori_chord_list[j + 2]);
-            }
-          m_chains[i]->chords = new_chord_list;
-        }
-    }
+      remapChordBeats(*chains, 4, beats);
 
-  m_beats = dst_beats;
+      if( !randomized )
+        plans.insert(m_current_chord_knowledge_entry, form_template_index, beats, chains);
+      m_chains = chains;
+    }
 
   /*
    * Generate instrument table for the whole work
    */
-  if( int rc = m_knowledgeModel->getTimbreBank(m_candidate_timbre_knowledge_entries, (m_genre = genre)) )
-    return rc;
-
-  for(vector<const KnowledgeEntry *>::iterator iter = m_candidate_timbre_knowledge_entries.begin();
-        iter != m_candidate_timbre_knowledge_entries.end(); )
-    {
-      if( (*iter) == m_current_timbre_knowledge_entry )
-        m_candidate_timbre_knowledge_entries.erase(iter);
-      else
-        iter++;
-    }
-
-  if( m_candidate_timbre_knowledge_entries.size() )
+  if( candidates.timbres.size() )
     {
       if( timbre_factor < 0 )
-        m_current_timbre_knowledge_entry = util::random_choice(m_candidate_timbre_knowledge_entries);
+        m_current_timbre_knowledge_entry = util::random_choice(m_random, candidates.timbres);
       else
-        m_current_timbre_knowledge_entry = util::factor_choice(m_candidate_timbre_knowledge_entries, timbre_factor); /* controlled randomization */
+        m_current_timbre_knowledge_entry = util::factor_choice(candidates.timbres, timbre_factor); /* controlled randomization */
     }
   else
     return -1;
@@ -201,7 +285,7 @@ int ParameterGenerator::gen_inner(int form_template_index, int character, int ge
 
   if( int err = theory::get_timbres(m_current_timbre_knowledge_entry, timbre_banks, figure_banks, figure_classes) )
     return err;
-  if( int err = theory::layout_timbres(m_timbre_banks, m_figure_banks, m_figure_classes,
+  if( int err = theory::layout_timbres(m_random, m_timbre_banks, m_figure_banks, m_figure_classes,
                                        timbre_banks, figure_banks, figure_classes, false) )
     return err;
 
@@ -214,6 +298,16 @@ int ParameterGenerator::gen(int form_template_index, int character, int genre, i
   return gen_inner(form_template_index, character, genre, beats, (int)std::clock(), -1, -1);
 }
 
+/**
+ * @brief Generate the parameters from a given seed.
+ * @param chord_factor Position of the chord entry among the candidates, ranged from [0, 1], negative = random.
+ * @param timbre_factor Position of the timbre entry among the candidates, ranged from [0, 1], negative = random.
+ */
+int ParameterGenerator::gen(int form_template_index, int character, int genre, int beats, int seed, double chord_factor, double timbre_factor)
+{
+  return gen_inner(form_template_index, character, genre, beats, seed, chord_factor, timbre_factor);
+}
+
 int ParameterGenerator::gen(const char *imageFilename, int form_template_index, int beats)
 {
   /*
@@ -226,39 +320,82 @@ int ParameterGenerator::gen(const char *imageFilename, int form_template_index,
       return -RC_OPENFILE;
     }
   cv::cvtColor(img_in, img_in, CV_BGR2GRAY); /* grayscale */
-  cv::Moments mts = cv::moments(img_in);
-  
-  double hu[7];
-  cv::HuMoments(mts, hu);
-  
-  double modsum = hu[0];
-  for (int i=0; i<7; i++)
-    {
-      double val = std::log(std::fabs(hu[i]));
-      if (modsum > val) modsum = val;
-    }
 
-  const double random_gain = 10000;
   int seed, character;
   double chord_factor, timbre_factor;
-  seed = std::abs(int(modsum * random_gain));
-  character = int(std::log(std::fabs(hu[0])) / modsum * MAX_CHARACTER_INDEX); /* normalize */
-  chord_factor = std::log(std::fabs(hu[1])) / modsum;
-  timbre_factor = std::log(std::fabs(hu[2])) / modsum;
-  
+  image_parameters(img_in, &seed, &character, &chord_factor, &timbre_factor);
+
   return gen_inner(form_template_index, character, 0, beats, seed, chord_factor, timbre_factor);
 #else
   return -RC_UNSUPPORTED;
 #endif
 }
 
+/**
+ * @brief Extract the seed, the character and the factors of composition from an encoded image in memory.
+ * @param reduction Decode the image at 1/reduction of its resolution, 1, 2, 4 or 8.
+ * @param maxDimension Scale the decoded image down to this width and height at most, 0 = no limit.
+ */
+int ParameterGenerator::imageParameters(const void *imageData, std::size_t imageSize, int reduction, int maxDimension,
+                                        int *seed, int *character, double *chord_factor, double *timbre_factor)
+{
+#ifdef ENABLE_IMAGE_COMPOSITION
+  if( imageSize > (std::size_t)INT_MAX )
+    return -RC_FAILED;
+
+  /*
+   * Decoding straight to grayscale, JPEG is even scaled down within the decoder, as the moments barely depend on the scale.
+   */
+  int flags;
+  switch( reduction ) {
+    case 2: flags = cv::IMREAD_REDUCED_GRAYSCALE_2; break;
+    case 4: flags = cv::IMREAD_REDUCED_GRAYSCALE_4; break;
+    case 8: flags = cv::IMREAD_REDUCED_GRAYSCALE_8; break;
+    default: flags = cv::IMREAD_GRAYSCALE; break;
+  }
+  cv::Mat buffer(1, (int)imageSize, CV_8UC1, const_cast<void *>(imageData));
+  cv::Mat img_in = cv::imdecode(buffer, flags);
+  if (img_in.empty())
+    {
+      return -RC_OPENFILE;
+    }
+
+  int longer = std::max(img_in.cols, img_in.rows);
+  if( maxDimension > 0 && longer > maxDimension )
+    {
+      double scale = double(maxDimension) / longer;
+      cv::resize(img_in, img_in, cv::Size(), scale, scale, cv::INTER_AREA);
+    }
+
+  image_parameters(img_in, seed, character, chord_factor, timbre_factor);
+  return 0;
+#else
+  return -RC_UNSUPPORTED;
+#endif
+}
+
+/**
+ * @brief Generate all the parameters of composition from an encoded image in memory, @see imageParameters()
+ */
+int ParameterGenerator::gen(const void *imageData, std::size_t imageSize, int reduction, int maxDimension, int form_template_index, int beats)
+{
+  int seed, character;
+  double chord_factor, timbre_factor;
+  if( int err = imageParameters(imageData, imageSize, reduction, maxDimension, &seed, &character, &chord_factor, &timbre_factor) )
+    return err;
+
+  return gen_inner(form_template_index, character, 0, beats, seed, chord_factor, timbre_factor);
+}
+
 
-int ParameterGenerator::coordinateChordWithFormChain(std::vector<FormChainNode *> &dst,
+int ParameterGenerator::coordinateChordWithFormChain(FormChain &dst,
+                                      bool *randomized,
                                       const std::vector<StructureForm> &forms,
-                                      const std::vector<const FigureListEntry *> &src_figures,
+                                      const KnowledgeArrayEntry &src_figures,
                                       int key, int scale /*= 0*/)
 {
   dst.clear();
+  *randomized = false;
   for(std::size_t i=0; i < forms.size(); i++)
     {
       const StructureForm &form = forms[i];
@@ -267,56 +404,32 @@ int ParameterGenerator::coordinateChordWithFormChain(std::vector<FormChainNode *
       if( new_form_index == StructureForm::FORM_BLANK )
         continue;
 
+      /*
+       * Seeing if the target form type is already existing in forms vector, or trying it with replacement rules.
+       * The chords prefer the last replacement form found, @see theory::resolve_form_figures()
+       */
       const FigureListEntry *target_figure;
-      bool found = false;
-      /* Firstly seeing if the target form type is already existing in forms vector. */
-      for(std::size_t j=0; j < src_figures.size(); j++)
-        {
-          if( int(new_form_index) == src_figures[j]->segment )
-            {
-              target_figure = src_figures[j];
-              found = true;
-              break;
-            }
-        }
-
-      if( !found )
+      if( new_form_index >= 0 && new_form_index < FORM_TYPE_NUM && src_figures.last_form_figures[new_form_index] >= 0 )
         {
-          /* Not found, trying it with replacement rules. */
-          const StructureForm::FormType *candidate_form = theory::form_replacement_rules[form.type()];
-
-          for(unsigned int j=0; candidate_form[j] != StructureForm::FORM_INVALID; j++)
-            {
-              for(std::size_t k=0; k < src_figures.size(); k++)
-                {
-                  if( int(candidate_form[j]) == src_figures[k]->segment )
-                    {
-                      target_figure = src_figures[k];
-                      found = true;
-                      break;
-                    }
-                }
-            }
+          target_figure = &src_figures.figure_list[src_figures.last_form_figures[new_form_index]];
         }
-      if( !found )
+      else
         {
           /* Not matched, randomly choose one from vector instead of making other efforts... */
-          target_figure = util::random_choice(src_figures);
+          target_figure = &src_figures.figure_list[util::random_range(m_random, src_figures.figure_list.size())];
+          *randomized = true;
         }
 
       int src_barlen = target_figure->end - target_figure->begin;
       int dst_barlen = form.end() - form.begin();
 
-      FormChainNode *chainNode = new FormChainNode;
-      if( int err = theory::stretch_chord_sequence(chainNode->chords, target_figure->chord, src_barlen, dst_barlen) )
-        {
-          delete chainNode;
-          return err;
-        }
-      chainNode->figure = target_figure;
-      chainNode->form = form;
-      chainNode->key = key;
-      chainNode->offset = target_figure->offset;
+      FormChainNode chainNode;
+      if( int err = theory::stretch_chord_sequence(chainNode.chords, target_figure->chord, src_barlen, dst_barlen) )
+        return err;
+      chainNode.figure = target_figure;
+      chainNode.form = form;
+      chainNode.key = key;
+      chainNode.offset = target_figure->offset;
 
       /*
        * Coordinate the regular chords with ending or interlude forms to make it not deviate from the theme,
@@ -328,25 +441,25 @@ int ParameterGenerator::coordinateChordWithFormChain(std::vector<FormChainNode *
           if( next_form_index == StructureForm::FORM_ENDING ||
               next_form_index == StructureForm::FORM_INTERLUDE1 || next_form_index == StructureForm::FORM_INTERLUDE2 )
             {
-              unsigned int chordlast = chainNode->chords.size();
-              if( chainNode->chords[chordlast-3] != chainNode->chords[chordlast-2] )
-                chainNode->chords[chordlast-2] = chainNode->chords[chordlast-1] = ChordPair(key, scale);
+              unsigned int chordlast = chainNode.chords.size();
+              if( chainNode.chords[chordlast-3] != chainNode.chords[chordlast-2] )
+                chainNode.chords[chordlast-2] = chainNode.chords[chordlast-1] = ChordPair(key, scale);
               else
                 {
-                  chainNode->chords[chordlast-4] = chainNode->chords[chordlast-3] = ChordPair(key, scale);
-                  chainNode->chords[chordlast-2] = chainNode->chords[chordlast-1] = ChordPair(key, scale);
+                  chainNode.chords[chordlast-4] = chainNode.chords[chordlast-3] = ChordPair(key, scale);
+                  chainNode.chords[chordlast-2] = chainNode.chords[chordlast-1] = ChordPair(key, scale);
                 }
             }
         }
       dst.push_back(chainNode);
     }
 
-  if( dst.size() > 1 && dst[0]->form.type() == StructureForm::FORM_BLANK )
+  if( dst.size() > 1 && dst[0].form.type() == StructureForm::FORM_BLANK )
     {
-      const ChordPair &main_chord = dst[1]->chords[0];
-      dst[0]->chords.clear();
+      const ChordPair main_chord = dst[1].chords[0];
+      dst[0].chords.clear();
       for(unsigned int i=0; i < 4; i++)
-        dst[0]->chords.push_back(main_chord);
+        dst[0].chords.push_back(main_chord);
     }
 
   return 0;
@@ -15,63 +15,96 @@
 #ifndef PARAMETER_GENERATOR_H
 #define PARAMETER_GENERATOR_H
 
+#include <cstddef>
 #include <vector>
+#include <memory>
 
 #include "typedefs.h"
+#include "util-randomize.h"
 
 namespace autocomp
 {
 
 class KnowledgeModel;
 class KnowledgeEntry;
+class KnowledgeArrayEntry;
 class FigureListEntry;
 
+/**
+ * @brief Candidate entries of a generation, depending only on the character, the genre and the entries to avoid.
+ * They may be collected once and shared read-only by many generations.
+ */
+class ParameterCandidates
+{
+public:
+  int character;
+  int genre;
+  std::vector<const KnowledgeEntry *> chords;
+  std::vector<const KnowledgeEntry *> in_key_chords; /* preferred to the others if there are enough */
+  std::vector<const KnowledgeEntry *> timbres;
+};
+
 class ParameterGenerator
 {
 public:
-  ParameterGenerator(KnowledgeModel *knowledgeModel);
+  ParameterGenerator(const KnowledgeModel *knowledgeModel);
 
 public:
+  void setKnowledgeModel(const KnowledgeModel *knowledgeModel);
+  void reset();
   int gen(int form_template_index, int character, int genre, int beats);
+  int gen(int form_template_index, int character, int genre, int beats, int seed, double chord_factor, double timbre_factor);
   int gen(const char *imageFilename, int form_template_index, int beats);
+  int gen(const void *imageData, std::size_t imageSize, int reduction, int maxDimension, int form_template_index, int beats);
+  int gen(const ParameterCandidates &candidates, int form_template_index, int beats, int seed, double chord_factor, double timbre_factor);
+
+  static int collectCandidates(ParameterCandidates &dst, const KnowledgeModel *knowledgeModel,
+                               int character, int genre,
+                               const KnowledgeEntry *exclude_chord, const KnowledgeEntry *exclude_timbre);
+  static int imageParameters(const void *imageData, std::size_t imageSize, int reduction, int maxDimension,
+                             int *seed, int *character, double *chord_factor, double *timbre_factor);
 public:
   inline int key() const { return m_key; }
   inline int scale() const { return m_scale; }
   inline int beats() const { return m_beats; }
   inline int character() const { return m_character; }
   inline int genre() const { return m_genre; }
+  inline int seed() const { return m_seed; }
   inline const KnowledgeEntry *chordKnowledgeEntry() const { return m_current_chord_knowledge_entry; }
   inline const KnowledgeEntry *timbreKnowledgeEntry() const { return m_current_timbre_knowledge_entry; }
   inline const std::vector<int> &timbreBanks() const { return m_timbre_banks; }
   inline const std::vector<int> &figureBanks() const { return m_figure_banks; }
   inline const std::vector<int> &figureClasses() const { return m_figure_classes; }
   inline const std::vector<StructureForm> &forms() const { return m_forms; }
-  inline std::vector<FormChainNode *> &chains() { return m_chains; }
+  inline const FormChain &chains() const { return *m_chains; }
   inline bool generated() { return m_generated; }
+  inline util::Random &random() { return m_random; }
 
 private:
   int gen_inner(int form_template_index, int character, int genre, int beats, int rand_seed, double chord_factor, double timbre_factor);
-  int coordinateChordWithFormChain(std::vector<FormChainNode *> &dst,
+  int coordinateChordWithFormChain(FormChain &dst,
+                                   bool *randomized,
                                    const std::vector<StructureForm> &forms,
-                                   const std::vector<const FigureListEntry *> &src_chords,
+                                   const KnowledgeArrayEntry &src_chords,
                                    int key, int scale = 0);
 private:
-  KnowledgeModel *m_knowledgeModel;
-  std::vector<const KnowledgeEntry *> m_candidate_chord_knowledge_entries;
-  std::vector<const KnowledgeEntry *> m_candidate_timbre_knowledge_entries;
+  const KnowledgeModel *m_knowledgeModel;
+  util::Random m_random;
+  ParameterCandidates m_candidates;
   const KnowledgeEntry *m_current_chord_knowledge_entry;
   const KnowledgeEntry *m_current_timbre_knowledge_entry;
   std::vector<int> m_timbre_banks;
   std::vector<int> m_figure_banks;
   std::vector<int> m_figure_classes;
   std::vector<StructureForm> m_forms;
-  std::vector<FormChainNode *> m_chains;
+  std::shared_ptr<const FormChain> m_chains;
 
   int m_key;
   int m_scale;
   int m_beats;
   int m_character;
   int m_genre;
+  int m_seed;
   bool m_generated;
 };
 
@@ -16,6 +16,7 @@
 #include "util-math.h"
 #include "libautomusic.h"
 #include "theory-harmonics.h"
+#include "util-log.h"
 
 namespace autocomp
 { namespace theory
@@ -89,7 +90,7 @@ std::string chord_get_name(const ChordPair &chord)
       name.append(chord_sign_string[chord.sign]);
     }
   else
-    std::cerr << "eee" << chord.root << "," << chord.sign << std::endl;
+    util::log(util::LOG_WARNING, "chord_get_name(): bad chord %d,%d", chord.root, chord.sign);
   return name;
 }
 
@@ -408,7 +409,7 @@ int transform_figure_chord(std::vector<PitchNote> &dst,
 
   if( src_chord_list.size() / src_beats != dst_chord_list.size() / dst_beats )
     {
-      std::cerr << "Transformation is broken down as the number of beats between origin and new is not equal" << std::endl;
+      util::log(util::LOG_WARNING, "Transformation is broken down as the number of beats between origin and new is not equal");
     }
 
   reg_old_chord_list.push_back(reg_old_chord_list.back());
@@ -417,13 +418,13 @@ int transform_figure_chord(std::vector<PitchNote> &dst,
   std::size_t src_num_beat = num_bar * src_beats;
   if( src_num_beat + 1 != reg_old_chord_list.size() )
     {
-      std::cerr << "Less or more chords are needed, src_num_beat = " << src_num_beat << " chord_num = " << reg_old_chord_list.size()-1 << std::endl;
+      util::log(util::LOG_ERROR, "Less or more chords are needed, src_num_beat = %zu chord_num = %zu", src_num_beat, reg_old_chord_list.size()-1);
       return -RC_FAILED;
     }
   std::size_t dst_num_beat = num_bar * dst_beats;
   if( dst_num_beat + 1 != reg_dst_chord_list.size() )
     {
-      std::cerr << "Less or more chords are needed, dst_num_beat = " << dst_num_beat << " chord_num = " << reg_dst_chord_list.size()-1 << std::endl;
+      util::log(util::LOG_ERROR, "Less or more chords are needed, dst_num_beat = %zu chord_num = %zu", dst_num_beat, reg_dst_chord_list.size()-1);
       return -RC_FAILED;
     }
   dst.clear();
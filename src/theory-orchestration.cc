@@ -106,7 +106,8 @@ bool is_timbre_bank_related(int figure_bank, int dst_figure_bank)
  * @brief Layout all the instrument tracks (parts) of the music works.
  * Build up an available manifest of instruments with their figure banks and figure classes.
  */
-int layout_timbres(std::vector<int> &dst_timbre_banks,
+int layout_timbres(util::Random &random,
+                   std::vector<int> &dst_timbre_banks,
                    std::vector<int> &dst_figure_banks,
                    std::vector<int> &dst_figure_classes,
                    const std::vector<int> &src_timbre_banks,
@@ -124,7 +125,7 @@ int layout_timbres(std::vector<int> &dst_timbre_banks,
    * If there is not any melody required, randomly select a instrument from solo types,
    * Otherwise, ensuring we have a melody-grouped instrument.
    */
-  int cur_timbre_bank = util::random_choice(solo_instruments, SOLO_INSTRUMENTS_NUM);
+  int cur_timbre_bank = util::random_choice(random, solo_instruments, SOLO_INSTRUMENTS_NUM);
 
   if(has_melody)
     {
@@ -167,7 +168,7 @@ int layout_timbres(std::vector<int> &dst_timbre_banks,
     }
   else
     {
-      int rand_instrument_index = util::random_choice(solo_instruments, SOLO_INSTRUMENTS_NUM);
+      int rand_instrument_index = util::random_choice(random, solo_instruments, SOLO_INSTRUMENTS_NUM);
       int rand_figure_bank = get_timbre_figure_bank(rand_instrument_index);
       dst_figure_banks.push_back(rand_figure_bank);
       dst_timbre_banks.push_back(rand_instrument_index);
@@ -190,7 +191,7 @@ int layout_timbres(std::vector<int> &dst_timbre_banks,
           if(is_grouped_in_timbre_bank(FIGURE_BANK_DRUMS, src_timbre_banks[i]))
               dst_timbre_banks.push_back(src_timbre_banks[i]);
           else
-              dst_timbre_banks.push_back(util::random_choice(gm_timbre_banks[FIGURE_BANK_DRUMS], timbre_bank_count(FIGURE_BANK_DRUMS)));
+              dst_timbre_banks.push_back(util::random_choice(random, gm_timbre_banks[FIGURE_BANK_DRUMS], timbre_bank_count(FIGURE_BANK_DRUMS)));
           dst_figure_banks.push_back(FIGURE_BANK_DRUMS);
           dst_figure_classes.push_back(FIGURE_CLASS_CHORD);
         }
@@ -213,6 +214,22 @@ int layout_timbres(std::vector<int> &dst_timbre_banks,
   return 0;
 }
 
+/**
+ * @brief Get the figure bank of a track, normalized by its timbre unless it is a solo, melody or drums track.
+ */
+int get_track_figure_bank(int timbre_bank, int figure_bank, int figure_class)
+{
+  if( figure_class != FIGURE_CLASS_SOLO && figure_bank != FIGURE_BANK_MELODY && figure_bank != FIGURE_BANK_DRUMS )
+    {
+      figure_bank = get_timbre_figure_bank(timbre_bank);
+    }
+  return figure_bank;
+}
+
+/**
+ * @brief Get the normalized timbre banks, figure banks and figure classes of all the tracks.
+ * The figure banks are normalized at loading, @see get_track_figure_bank()
+ */
 int get_timbres(const KnowledgeEntry *knowledgeEntry,
                    std::vector<int> &timbre_banks,
                    std::vector<int> &figure_banks,
@@ -223,100 +240,106 @@ int get_timbres(const KnowledgeEntry *knowledgeEntry,
   figure_classes.clear();
   for(std::size_t i=0; i < knowledgeEntry->m_knowledgeArrayEntries.size(); i++)
     {
-      const KnowledgeArrayEntry *knowledgeArrayEntry = knowledgeEntry->m_knowledgeArrayEntries[i];
-      int timbre_bank = knowledgeArrayEntry->timbre_bank;
-      int figure_bank = knowledgeArrayEntry->figure_bank;
-      int figure_class = knowledgeArrayEntry->figure_class;
-
-      if( figure_class != FIGURE_CLASS_SOLO && figure_bank != FIGURE_BANK_MELODY && figure_bank != FIGURE_BANK_DRUMS )
-        {
-          figure_bank = get_timbre_figure_bank(timbre_bank);
-        }
-      timbre_banks.push_back(timbre_bank);
-      figure_banks.push_back(figure_bank);
-      figure_classes.push_back(figure_class);
+      const KnowledgeArrayEntry *knowledgeArrayEntry = &knowledgeEntry->m_knowledgeArrayEntries[i];
+      timbre_banks.push_back(knowledgeArrayEntry->timbre_bank);
+      figure_banks.push_back(knowledgeArrayEntry->track_figure_bank);
+      figure_classes.push_back(knowledgeArrayEntry->figure_class);
     }
   return 0;
 }
 
-static int get_timbre_figures_helper(std::vector<const KnowledgeEntry *> &dst_entries,
-                       std::vector<int> &dst_tracks,
-                       const std::vector<const KnowledgeEntry *> &knowledge_entries, int figure_bank, int figure_class)
+/**
+ * @brief Find the first track matching the figure bank and class.
+ * If there is none, find the first track of the class in a related figure bank, and set *related.
+ * @return The track index, or -1 if there is neither.
+ */
+int find_timbre_track(const KnowledgeEntry *knowledgeEntry, int figure_bank, int figure_class, bool *related)
 {
-  dst_entries.clear(); dst_tracks.clear();
-  std::vector<const KnowledgeEntry *> related_entries;
-  std::vector<int> related_tracks;
-
-  for(std::size_t i=0; i < knowledge_entries.size(); i++)
+  const util::ArrayRef<KnowledgeArrayEntry> &tracks = knowledgeEntry->m_knowledgeArrayEntries;
+  *related = false;
+  for(std::size_t j=0; j < tracks.size(); j++)
     {
-      std::vector<int> timbre_banks;
-      std::vector<int> figure_banks;
-      std::vector<int> figure_classes;
-
-      if( int err = get_timbres(knowledge_entries[i], timbre_banks, figure_banks, figure_classes) )
-        return err;
-
-      bool not_found = true;
-      for(std::size_t j=0; j < timbre_banks.size(); j++)
-        {
-          if( figure_bank == figure_banks[j] && figure_class == figure_classes[j] )
-            {
-              not_found = false;
-              dst_entries.push_back(knowledge_entries[i]);
-              dst_tracks.push_back(j);
-              break;
-            }
-        }
-      if( not_found )
+      if( figure_bank == tracks[j].track_figure_bank && figure_class == tracks[j].figure_class )
+        return int(j);
+    }
+  for(std::size_t j=0; j < tracks.size(); j++)
+    {
+      if( figure_class == tracks[j].figure_class && is_timbre_bank_related(figure_bank, tracks[j].track_figure_bank) )
         {
-          for(std::size_t j=0; j < timbre_banks.size(); j++)
-            {
-              if( figure_class == figure_classes[j] )
-                {
-                  if( is_timbre_bank_related(figure_bank, figure_banks[j]) )
-                    {
-                      related_entries.push_back(knowledge_entries[i]);
-                      related_tracks.push_back(j);
-                      break;
-                    }
-                }
-            }
+          *related = true;
+          return int(j);
         }
     }
+  return -1;
+}
 
-  /*
-   * Utilize related figures when the quantity of matched figures is poor.
-   */
-  if( dst_entries.size() < 10 )
+/*
+ * Utilize related figures when the quantity of matched figures is poor.
+ */
+#define MIN_MATCHED_TIMBRE_FIGURES 10
+
+/*
+ * @brief Get the compatible figures according to specified figure bank and class.
+ * The candidates are the matched tracks, joined by the related ones when the matched are few,
+ * each one drawn in proportion to the weight of its knowledge entry.
+ * When it returns -1, you should consider enlarge the range of target knowledge entries.
+ */
+int get_timbre_figures(const KnowledgeEntry **ppKnowledgeEntry,
+                       int *pTrack,
+                       util::Random &random,
+                       const util::WeightedSampler<const KnowledgeEntry *> &knowledge_entries, int figure_bank, int figure_class)
+{
+  util::WeightedSampler<KnowledgeTrack> matched, related;
+  bool is_related;
+  for(std::size_t i=0; i < knowledge_entries.size(); i++)
     {
-      for(std::size_t i=0; i < related_entries.size(); i++)
-        dst_entries.push_back(related_entries[i]);
-      for(std::size_t i=0; i < related_tracks.size(); i++)
-        dst_tracks.push_back(related_tracks[i]);
+      const KnowledgeEntry *entry = knowledge_entries.item(i);
+      int track = find_timbre_track(entry, figure_bank, figure_class, &is_related);
+      if( track < 0 )
+        continue;
+      if( is_related )
+        related.add(KnowledgeTrack(entry, track), knowledge_entries.weight(i));
+      else
+        matched.add(KnowledgeTrack(entry, track), knowledge_entries.weight(i));
+    }
+  if( matched.totalWeight() < MIN_MATCHED_TIMBRE_FIGURES )
+    {
+      for(std::size_t i=0; i < related.size(); i++)
+        matched.add(related.item(i), related.weight(i));
     }
 
+  if( matched.empty() )
+    return -1;
+
+  matched.build();
+  const KnowledgeTrack &track = matched.choose(random);
+  *ppKnowledgeEntry = track.entry;
+  *pTrack = track.track;
   return 0;
 }
 
 /*
- * @brief Get the compatible figures according to specified figure bank and class.
- * When it returns -1, you should consider enlarge the range of target knowledge entries.
+ * @brief Get the compatible figures within the whole knowledge library, using its timbre track index.
  */
 int get_timbre_figures(const KnowledgeEntry **ppKnowledgeEntry,
                        int *pTrack,
-                       const std::vector<const KnowledgeEntry *> &knowledge_entries, int figure_bank, int figure_class)
+                       util::Random &random,
+                       const KnowledgeModel &knowledgeModel, int figure_bank, int figure_class)
 {
-  std::vector<const KnowledgeEntry *> figure_entries;
-  std::vector<int> figure_tracks;
-  if( int err = get_timbre_figures_helper(figure_entries, figure_tracks, knowledge_entries, figure_bank, figure_class) )
-    return err;
+  const KnowledgeTrackList *tracks = 0l;
+  if( knowledgeModel.getTimbreTracks(&tracks, figure_bank, figure_class) )
+    return -1;
+
+  std::size_t matched = tracks->matched.size();
+  std::size_t related = matched < MIN_MATCHED_TIMBRE_FIGURES ? tracks->related.size() : 0;
 
-  if( figure_entries.size() )
+  if( matched + related )
     {
-      std::size_t idx = util::random_range(figure_entries.size());
+      std::size_t idx = util::random_range(random, matched + related);
+      const KnowledgeTrack &track = idx < matched ? tracks->matched[idx] : tracks->related[idx - matched];
 
-      *ppKnowledgeEntry = figure_entries[idx];
-      *pTrack = figure_tracks[idx];
+      *ppKnowledgeEntry = track.entry;
+      *pTrack = track.track;
       return 0;
     }
   return -1;
@@ -329,55 +352,53 @@ static const float randomVelocityThreshold = 0.3;
 static const float soloVelocityProportion = 1.3;
 
 /**
- * @brief Process the velocity of each notes for all the different instruments.
+ * @brief Process the velocity of each notes of a structure form for all the different instruments.
+ * The velocities of a form only depend on the notes of the form, so that a form composed or recomposed
+ * leaves those of the other forms untouched. The chord tracks of the form give the benchmark velocity,
+ * so the dynamics between the forms follow the chord tracks.
  * @param compositionChainTrack Target chains to be processed.
+ * @param form Index of the structure form to be processed.
+ * @param seed Seed of the composition, each form of each track draws from its own stream.
  * @param figureBanks Instrument figure banks.
  * @param figureClasses Figure classes.
  * @param velocityFactorModu Optional, Modulation coefficient of Randomization factor for velocity, ranged from [0, 1].
  * @param soloProportionModu Optional, Modulation coefficient of Proportion: velocity of solo track / chord track.
  */
-int processVelocity(std::vector<std::vector<CompositionChainNode *>> &compositionChainTrack, const std::vector<int> &figureBanks, const std::vector<int> &figureClasses, float velocityFactorModu, float soloProportionModu)
+int processVelocity(CompositionChain &compositionChainTrack, std::size_t form, int seed, const std::vector<int> &figureBanks, const std::vector<int> &figureClasses, float velocityFactorModu, float soloProportionModu)
 {
   velocityFactorModu *= randomVelocityFactor;
   soloProportionModu *= soloVelocityProportion;
   /*
    * Randomize the velocity of each note when all the notes has the same velocity.
    */
-  for(std::size_t trackNum=0; trackNum < compositionChainTrack.size(); trackNum++)
+  for(std::size_t trackNum=0; trackNum < compositionChainTrack.trackCount(); trackNum++)
     {
-      if (figureBanks[trackNum] != FIGURE_BANK_DRUMS)
+      std::vector<PitchNote> &pitch = compositionChainTrack[trackNum][form].pitch;
+      if (figureBanks[trackNum] != FIGURE_BANK_DRUMS && pitch.size())
         {
           int dullVelocity = 0, count = 0;
-          for(std::size_t form=0; form < compositionChainTrack[trackNum].size(); form++)
+          uint8_t velocity = pitch[0].velocity;
+          for(std::size_t j=0; j < pitch.size(); j++)
             {
-              if (compositionChainTrack[trackNum][form]->pitch.size())
+              if (pitch[j].velocity != velocity)
                 {
-                  uint8_t velocity = compositionChainTrack[trackNum][form]->pitch[0].velocity;
-                  for(std::size_t j=0; j < compositionChainTrack[trackNum][form]->pitch.size(); j++)
-                    {
-                      if (compositionChainTrack[trackNum][form]->pitch[j].velocity != velocity)
-                        {
-                          ++dullVelocity;
-                        }
-                      ++count;
-                    }
+                  ++dullVelocity;
                 }
+              ++count;
             }
-          if (count && (float)dullVelocity / count < randomVelocityThreshold)
+          if ((float)dullVelocity / count < randomVelocityThreshold)
             {
               int8_t benchmark = MAX_VELOCITY * velocityFactorModu;
-              for(std::size_t form=0; form < compositionChainTrack[trackNum].size(); form++)
+              util::RandomStream random(seed, trackNum, form, util::RANDOM_STAGE_VELOCITY);
+              for(std::size_t j=0; j < pitch.size(); j++)
                 {
-                  for(std::size_t j=0; j < compositionChainTrack[trackNum][form]->pitch.size(); j++)
-                    {
-                      int8_t lowmark = (int8_t)compositionChainTrack[trackNum][form]->pitch[j].velocity - benchmark;
-                      uint8_t highmark = compositionChainTrack[trackNum][form]->pitch[j].velocity + benchmark;
+                  int8_t lowmark = (int8_t)pitch[j].velocity - benchmark;
+                  uint8_t highmark = pitch[j].velocity + benchmark;
 
-                      highmark = highmark > MAX_VELOCITY ? MAX_VELOCITY : highmark; /* clip */
-                      lowmark = lowmark < 0 ? 0 : lowmark;
+                  highmark = highmark > MAX_VELOCITY ? MAX_VELOCITY : highmark; /* clip */
+                  lowmark = lowmark < 0 ? 0 : lowmark;
 
-                      compositionChainTrack[trackNum][form]->pitch[j].velocity = util::random_range<uint8_t>(lowmark, highmark);
-                    }
+                  pitch[j].velocity = util::random_range<uint8_t>(random, lowmark, highmark);
                 }
             }
         }
@@ -387,17 +408,15 @@ int processVelocity(std::vector<std::vector<CompositionChainNode *>> &compositio
    * Normalization. Adopt the velocity of current track to benchmark velocity.
    */
   int avreageVelocity = 0, sumCount = 0;
-  for(std::size_t trackNum=0; trackNum < compositionChainTrack.size(); trackNum++)
+  for(std::size_t trackNum=0; trackNum < compositionChainTrack.trackCount(); trackNum++)
       {
         if (figureBanks[trackNum] == FIGURE_CLASS_CHORD)
           {
-            for(std::size_t form=0; form < compositionChainTrack[trackNum].size(); form++)
+            const std::vector<PitchNote> &pitch = compositionChainTrack[trackNum][form].pitch;
+            for(std::size_t j=0; j < pitch.size(); j++)
               {
-                for(std::size_t j=0; j < compositionChainTrack[trackNum][form]->pitch.size(); j++)
-                  {
-                    avreageVelocity += compositionChainTrack[trackNum][form]->pitch[j].velocity;
-                    ++sumCount;
-                  }
+                avreageVelocity += pitch[j].velocity;
+                ++sumCount;
               }
           }
       }
@@ -410,41 +429,39 @@ int processVelocity(std::vector<std::vector<CompositionChainNode *>> &compositio
   int soloBenchmark = int(avreageVelocity * soloProportionModu);
   if (soloBenchmark > MAX_VELOCITY) soloBenchmark = MAX_VELOCITY;
 
-  for(std::size_t trackNum=0; trackNum < compositionChainTrack.size(); trackNum++)
+  for(std::size_t trackNum=0; trackNum < compositionChainTrack.trackCount(); trackNum++)
     {
+      std::vector<PitchNote> &pitch = compositionChainTrack[trackNum][form].pitch;
+
       /* Calculate the DC (Direct Current) offset of velocity */
       int DC_offset = 0, DC_count = 0;
-      for(std::size_t form=0; form < compositionChainTrack[trackNum].size(); form++)
+      for(std::size_t j=0; j < pitch.size(); j++)
         {
-          for(std::size_t j=0; j < compositionChainTrack[trackNum][form]->pitch.size(); j++)
-            {
-              DC_offset += compositionChainTrack[trackNum][form]->pitch[j].velocity;
-              ++DC_count;
-            }
+          DC_offset += pitch[j].velocity;
+          ++DC_count;
         }
+      if( !DC_count )
+        continue; /* No notes of the track in the form. */
       DC_offset /= DC_count;
 
       /* Apply new offset to the original velocity */
-      for(std::size_t form=0; form < compositionChainTrack[trackNum].size(); form++)
+      for(std::size_t j=0; j < pitch.size(); j++)
         {
-          for(std::size_t j=0; j < compositionChainTrack[trackNum][form]->pitch.size(); j++)
+          uint8_t vel;
+          switch(figureClasses[trackNum])
             {
-              uint8_t vel;
-              switch(figureClasses[trackNum])
-                {
-                  case FIGURE_CLASS_SOLO:
-                    vel = (uint8_t)soloBenchmark + (compositionChainTrack[trackNum][form]->pitch[j].velocity - DC_offset);
-                    break;
-                  case FIGURE_CLASS_CHORD:
-                  default:
-                    vel = (uint8_t)chordBenchmark + (compositionChainTrack[trackNum][form]->pitch[j].velocity - DC_offset);
-                }
+              case FIGURE_CLASS_SOLO:
+                vel = (uint8_t)soloBenchmark + (pitch[j].velocity - DC_offset);
+                break;
+              case FIGURE_CLASS_CHORD:
+              default:
+                vel = (uint8_t)chordBenchmark + (pitch[j].velocity - DC_offset);
+            }
 
-              vel = (vel > MAX_VELOCITY ? MAX_VELOCITY : vel); /* clip */
-              vel = (vel < 0 ? DC_offset/2 : vel);
+          vel = (vel > MAX_VELOCITY ? MAX_VELOCITY : vel); /* clip */
+          vel = (vel < 0 ? DC_offset/2 : vel);
 
-              compositionChainTrack[trackNum][form]->pitch[j].velocity = vel;
-            }
+          pitch[j].velocity = vel;
         }
     }
   return 0;
@@ -18,11 +18,14 @@
 #include <vector>
 
 #include "typedefs.h"
+#include "composition-chain.h"
+#include "util-randomize.h"
 
 namespace autocomp
 {
 class FigureListEntry;
 class KnowledgeEntry;
+class KnowledgeModel;
 
 namespace theory
 {
@@ -49,7 +52,8 @@ enum FigureBank
   FIGURE_BANK_UNSORTED
 };
 
-int layout_timbres(std::vector<int> &dst_timbre_banks,
+int layout_timbres(util::Random &random,
+                   std::vector<int> &dst_timbre_banks,
                    std::vector<int> &dst_figure_banks,
                    std::vector<int> &dst_figure_classes,
                    const std::vector<int> &src_timbre_banks,
@@ -60,14 +64,21 @@ int get_timbres(const KnowledgeEntry *knowledgeEntry,
                    std::vector<int> &timbre_banks,
                    std::vector<int> &figure_banks,
                    std::vector<int> &figure_classes);
+int get_track_figure_bank(int timbre_bank, int figure_bank, int figure_class);
+int find_timbre_track(const KnowledgeEntry *knowledgeEntry, int figure_bank, int figure_class, bool *related);
 
 int get_timbre_figures(const KnowledgeEntry ** ppKnowledgeEntry,
                        int *pTrack,
-                       const std::vector<const KnowledgeEntry *> &knowledge_entries, int figure_bank, int figure_class);
+                       util::Random &random,
+                       const util::WeightedSampler<const KnowledgeEntry *> &knowledge_entries, int figure_bank, int figure_class);
+int get_timbre_figures(const KnowledgeEntry ** ppKnowledgeEntry,
+                       int *pTrack,
+                       util::Random &random,
+                       const KnowledgeModel &knowledgeModel, int figure_bank, int figure_class);
 
 bool is_timbre_bank_related(int figure_bank, int dst_figure_bank);
 
-int processVelocity(std::vector<std::vector<CompositionChainNode *>> &compositionChainTrack, const std::vector<int> &figureBanks, const std::vector<int> &figureClasses, float velocityFactor = 1.0, float soloProportion = 1.0);
+int processVelocity(CompositionChain &compositionChainTrack, std::size_t form, int seed, const std::vector<int> &figureBanks, const std::vector<int> &figureClasses, float velocityFactor = 1.0, float soloProportion = 1.0);
 
 }
 }
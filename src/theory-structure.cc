@@ -23,7 +23,7 @@ namespace autocomp
 { namespace theory
   {
 
-const StructureForm::FormType form_replacement_rules[][6] =
+const StructureForm::FormType form_replacement_rules[FORM_TYPE_NUM][6] =
  {
    /* BLANK */    {StructureForm::FORM_VERSE11,  StructureForm::FORM_BLANK, StructureForm::FORM_INVALID},
    /* PRELUDE */  {StructureForm::FORM_INTERLUDE1, StructureForm::FORM_INVALID},
@@ -194,10 +194,10 @@ static const form_template form_templates[FORM_TEMPLATE_NUM][25] = {
  * This will do linear scale, deleting the redundant part or appending new part when needed.
  */
 int stretch_figure_sequence(std::vector<PitchNote> &dst_figure_list,
-                         const std::vector<PitchNote> &src_figure_list,
+                         const util::ArrayRef<PitchNote> &src_figure_list,
                          int src_barlen, int dst_barlen, int beats /*= 4*/)
 {
-  dst_figure_list = src_figure_list;
+  dst_figure_list.assign(src_figure_list.begin(), src_figure_list.end());
 
   int bar_diff = ABS(dst_barlen - src_barlen);
   if( src_barlen < dst_barlen )
@@ -255,7 +255,7 @@ int stretch_figure_sequence(std::vector<PitchNote> &dst_figure_list,
  * Delete the redundant chords or append chords (repetitive in source list) when needed.
  */
 int stretch_chord_sequence(std::vector<ChordPair> &dst,
-                        const std::vector<ChordPair> &src_chord_list,
+                        const util::ArrayRef<ChordPair> &src_chord_list,
                         int src_barlen, int dst_barlen,
                         int beats /*= 4*/)
 {
@@ -263,7 +263,7 @@ int stretch_chord_sequence(std::vector<ChordPair> &dst,
 
   if( src_barlen < dst_barlen )
     {
-      dst = src_chord_list;
+      dst.assign(src_chord_list.begin(), src_chord_list.end());
 
       while( bar_diff > 0 )
         {
@@ -285,7 +285,7 @@ int stretch_chord_sequence(std::vector<ChordPair> &dst,
     }
   else /* no need to stretch */
     {
-      dst = src_chord_list;
+      dst.assign(src_chord_list.begin(), src_chord_list.end());
     }
   return 0;
 }
@@ -302,23 +302,51 @@ int get_form_template(std::vector<StructureForm> &dst, unsigned int id)
   return -1;
 }
 
-const FigureListEntry *pick_form(StructureForm::FormType form, const std::vector<const FigureListEntry *> &forms_vector)
+/**
+ * @brief Resolve the figure of each form type in a figure list, ahead of picking forms.
+ * A form type takes the first figure of its segment. If there is none, the replacement rules are
+ * tried in order, dst_first takes the first replacement form found and dst_last the last one.
+ * Unresolved form types are set to -1.
+ */
+void resolve_form_figures(int32_t *dst_first, int32_t *dst_last, const util::ArrayRef<FigureListEntry> &forms_vector)
 {
-  /* Firstly seeing if the target form type is already existing in forms vector. */
-  for(std::size_t i=0; i < forms_vector.size(); i++)
-    if( int(form) == forms_vector[i]->segment )
-      return forms_vector[i];
+  int32_t exact[FORM_TYPE_NUM];
+  for(int form=0; form < FORM_TYPE_NUM; form++)
+    exact[form] = -1;
+  for(std::size_t i=forms_vector.size(); i-- > 0;)
+    {
+      int segment = forms_vector[i].segment;
+      if( segment >= 0 && segment < FORM_TYPE_NUM )
+        exact[segment] = int32_t(i);
+    }
 
-  /* Not found, trying it with replacement rules. */
-  const StructureForm::FormType *candidate_form = form_replacement_rules[form];
+  for(int form=0; form < FORM_TYPE_NUM; form++)
+    {
+      dst_first[form] = dst_last[form] = exact[form];
+      if( exact[form] >= 0 )
+        continue;
 
-  for(unsigned int i=0; candidate_form[i] != StructureForm::FORM_INVALID; i++)
-    for(std::size_t j=0; j < forms_vector.size(); j++)
-      if( int(candidate_form[i]) == forms_vector[j]->segment )
-        return forms_vector[j];
+      const StructureForm::FormType *candidate_form = form_replacement_rules[form];
+      for(unsigned int i=0; candidate_form[i] != StructureForm::FORM_INVALID; i++)
+        {
+          int32_t figure = exact[candidate_form[i]];
+          if( figure < 0 )
+            continue;
+          if( dst_first[form] < 0 )
+            dst_first[form] = figure;
+          dst_last[form] = figure;
+        }
+    }
+}
+
+const FigureListEntry *pick_form(util::RandomStream &random, StructureForm::FormType form, const KnowledgeArrayEntry &forms)
+{
+  /* The form type is in the figure list, or it is replaced by the rules, @see resolve_form_figures() */
+  if( form >= 0 && form < FORM_TYPE_NUM && forms.form_figures[form] >= 0 )
+    return &forms.figure_list[forms.form_figures[form]];
 
   /* Not matched, randomly choose one from vector instead of making other efforts... */
-  return util::random_choice(forms_vector);
+  return &forms.figure_list[util::random_range(random, forms.figure_list.size())];
 }
 
 /*
@@ -16,31 +16,39 @@
 #define THEORY_STRUCTURE_H
 
 #include <vector>
+#include <cstdint>
 #include "typedefs.h"
+#include "util-array.h"
+#include "util-randomize.h"
+
+/* number of the structure form types, FORM_BLANK ... FORM_BRIDGE3 */
+#define FORM_TYPE_NUM 26
 
 namespace autocomp
 {
 class FigureListEntry;
+class KnowledgeArrayEntry;
 
 namespace theory
 {
 
 int stretch_figure_sequence(std::vector<PitchNote> &dst_figure_list,
-                         const std::vector<PitchNote> &src_figure_list,
+                         const util::ArrayRef<PitchNote> &src_figure_list,
                          int src_barlen, int dst_barlen, int beats = 4);
 
 int stretch_chord_sequence(std::vector<ChordPair> &dst,
-                        const std::vector<ChordPair> &src_chord_list,
+                        const util::ArrayRef<ChordPair> &src_chord_list,
                         int src_barlen, int dst_barlen,
                         int beats = 4);
 
 
 int get_form_template(std::vector<StructureForm> &dst, unsigned int id);
 
-const FigureListEntry *pick_form(StructureForm::FormType form, const std::vector<const FigureListEntry *> &forms_vector);
+void resolve_form_figures(int32_t *dst_first, int32_t *dst_last, const util::ArrayRef<FigureListEntry> &forms_vector);
+const FigureListEntry *pick_form(util::RandomStream &random, StructureForm::FormType form, const KnowledgeArrayEntry &forms);
 int transform_figure_4_3(std::vector<PitchNote> &dst, const std::vector<PitchNote> &figures, int bars);
 
-extern const StructureForm::FormType form_replacement_rules[][6];
+extern const StructureForm::FormType form_replacement_rules[FORM_TYPE_NUM][6];
 
 }
 }
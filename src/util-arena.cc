@@ -0,0 +1,98 @@
+/*
+ *  libautomusic (Library for Image-based Algorithmic Musical Composition)
+ *  Copyright (C) 2018, automusic.
+ *
+ *  THIS PROJECT IS FREE SOFTWARE; YOU CAN REDISTRIBUTE IT AND/OR
+ *  MODIFY IT UNDER THE TERMS OF THE GNU LESSER GENERAL PUBLIC LICENSE(GPL)
+ *  AS PUBLISHED BY THE FREE SOFTWARE FOUNDATION; EITHER VERSION 2.1
+ *  OF THE LICENSE, OR (AT YOUR OPTION) ANY LATER VERSION.
+ *
+ *  THIS PROJECT IS DISTRIBUTED IN THE HOPE THAT IT WILL BE USEFUL,
+ *  BUT WITHOUT ANY WARRANTY; WITHOUT EVEN THE IMPLIED WARRANTY OF
+ *  MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE.  SEE THE GNU
+ *  LESSER GENERAL PUBLIC LICENSE FOR MORE DETAILS.
+ */
+#include <cstdint>
+
+#include "util-arena.h"
+
+namespace autocomp
+{ namespace util
+  {
+
+Arena::Arena(std::size_t block_size /*= 64 * 1024*/)
+    : m_cursor(0l),
+      m_remaining(0),
+      m_blockSize(block_size),
+      m_used(0),
+      m_capacity(0)
+{
+}
+
+Arena::~Arena()
+{
+  clear();
+}
+
+/**
+ * @brief Allocate memory from the current block, starting a new block when it is exhausted.
+ */
+void *Arena::allocate(std::size_t size, std::size_t align)
+{
+  std::size_t padding = (align - reinterpret_cast<std::uintptr_t>(m_cursor) % align) % align;
+  if( !m_cursor || padding + size > m_remaining )
+    {
+      reserve(size + align);
+      padding = (align - reinterpret_cast<std::uintptr_t>(m_cursor) % align) % align;
+    }
+  char *ptr = m_cursor + padding;
+  m_cursor += padding + size;
+  m_remaining -= padding + size;
+  m_used += size;
+  return ptr;
+}
+
+/**
+ * @brief Ensure that the following allocations of size bytes in total come from one block.
+ */
+void Arena::reserve(std::size_t size)
+{
+  if( m_cursor && size <= m_remaining )
+    return;
+  std::size_t block_size = size > m_blockSize ? size : m_blockSize;
+  char *block = new char[block_size];
+  m_blocks.push_back(block);
+  m_cursor = block;
+  m_remaining = block_size;
+  m_capacity += block_size;
+}
+
+/**
+ * @brief Take over all the blocks of another arena, which is left empty.
+ * Allocations keep their addresses.
+ */
+void Arena::merge(Arena &src)
+{
+  m_blocks.insert(m_blocks.end(), src.m_blocks.begin(), src.m_blocks.end());
+  m_used += src.m_used;
+  m_capacity += src.m_capacity;
+  src.m_blocks.clear();
+  src.m_cursor = 0l;
+  src.m_remaining = 0;
+  src.m_used = 0;
+  src.m_capacity = 0;
+}
+
+void Arena::clear()
+{
+  for(std::size_t i=0; i < m_blocks.size(); i++)
+    delete[] m_blocks[i];
+  m_blocks.clear();
+  m_cursor = 0l;
+  m_remaining = 0;
+  m_used = 0;
+  m_capacity = 0;
+}
+
+  }
+}
@@ -0,0 +1,82 @@
+/*
+ *  libautomusic (Library for Image-based Algorithmic Musical Composition)
+ *  Copyright (C) 2018, automusic.
+ *
+ *  THIS PROJECT IS FREE SOFTWARE; YOU CAN REDISTRIBUTE IT AND/OR
+ *  MODIFY IT UNDER THE TERMS OF THE GNU LESSER GENERAL PUBLIC LICENSE(GPL)
+ *  AS PUBLISHED BY THE FREE SOFTWARE FOUNDATION; EITHER VERSION 2.1
+ *  OF THE LICENSE, OR (AT YOUR OPTION) ANY LATER VERSION.
+ *
+ *  THIS PROJECT IS DISTRIBUTED IN THE HOPE THAT IT WILL BE USEFUL,
+ *  BUT WITHOUT ANY WARRANTY; WITHOUT EVEN THE IMPLIED WARRANTY OF
+ *  MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE.  SEE THE GNU
+ *  LESSER GENERAL PUBLIC LICENSE FOR MORE DETAILS.
+ */
+#ifndef UTIL_ARENA_H
+#define UTIL_ARENA_H
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+namespace autocomp
+{ namespace util
+  {
+
+/**
+ * @brief Bump allocator handing out memory from a few large blocks.
+ * Objects are never moved or destructed individually, all the blocks are released at once,
+ * so only trivially destructible types should be created in an arena.
+ */
+class Arena
+{
+public:
+  explicit Arena(std::size_t block_size = 64 * 1024);
+  ~Arena();
+
+  void *allocate(std::size_t size, std::size_t align);
+  void reserve(std::size_t size);
+  void merge(Arena &src);
+  void clear();
+  inline std::size_t size() const { return m_used; }
+  inline std::size_t capacity() const { return m_capacity; }
+
+  template <typename T>
+    T *create()
+      {
+        return new (allocate(sizeof(T), alignof(T))) T;
+      }
+
+  template <typename T>
+    T *allocateArray(std::size_t count)
+      {
+        return count ? static_cast<T *>(allocate(sizeof(T) * count, alignof(T))) : 0l;
+      }
+
+  template <typename T>
+    T *createArray(std::size_t count)
+      {
+        if( !count )
+          return 0l;
+        T *array = static_cast<T *>(allocate(sizeof(T) * count, alignof(T)));
+        for(std::size_t i=0; i < count; i++)
+          new (array + i) T;
+        return array;
+      }
+
+private:
+  Arena(const Arena &);
+  Arena &operator=(const Arena &);
+
+  std::vector<char *> m_blocks;
+  char *m_cursor;
+  std::size_t m_remaining;
+  std::size_t m_blockSize;
+  std::size_t m_used;
+  std::size_t m_capacity;
+};
+
+  }
+}
+
+#endif
@@ -0,0 +1,66 @@
+/*
+ *  libautomusic (Library for Image-based Algorithmic Musical Composition)
+ *  Copyright (C) 2018, automusic.
+ *
+ *  THIS PROJECT IS FREE SOFTWARE; YOU CAN REDISTRIBUTE IT AND/OR
+ *  MODIFY IT UNDER THE TERMS OF THE GNU LESSER GENERAL PUBLIC LICENSE(GPL)
+ *  AS PUBLISHED BY THE FREE SOFTWARE FOUNDATION; EITHER VERSION 2.1
+ *  OF THE LICENSE, OR (AT YOUR OPTION) ANY LATER VERSION.
+ *
+ *  THIS PROJECT IS DISTRIBUTED IN THE HOPE THAT IT WILL BE USEFUL,
+ *  BUT WITHOUT ANY WARRANTY; WITHOUT EVEN THE IMPLIED WARRANTY OF
+ *  MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE.  SEE THE GNU
+ *  LESSER GENERAL PUBLIC LICENSE FOR MORE DETAILS.
+ */
+#ifndef UTIL_ARRAY_H
+#define UTIL_ARRAY_H
+
+#include <cstddef>
+#include <vector>
+
+namespace autocomp
+{ namespace util
+  {
+
+/**
+ * @brief Read-only view of a packed array, addressed by its first element and length.
+ * The view does not own the elements, which usually live in the arena of the knowledge model.
+ */
+template <typename T>
+  class ArrayRef
+  {
+  public:
+    typedef T value_type;
+    typedef const T *const_iterator;
+
+    ArrayRef()
+      : m_data(0l),
+        m_size(0)
+    {}
+    ArrayRef(const T *data, std::size_t size)
+      : m_data(data),
+        m_size(size)
+    {}
+    ArrayRef(const std::vector<T> &src)
+      : m_data(src.empty() ? 0l : &src[0]),
+        m_size(src.size())
+    {}
+
+    inline std::size_t size() const { return m_size; }
+    inline bool empty() const { return m_size == 0; }
+    inline const T *data() const { return m_data; }
+    inline const T &operator[](std::size_t index) const { return m_data[index]; }
+    inline const T &front() const { return m_data[0]; }
+    inline const T &back() const { return m_data[m_size - 1]; }
+    inline const_iterator begin() const { return m_data; }
+    inline const_iterator end() const { return m_data + m_size; }
+
+  private:
+    const T *m_data;
+    std::size_t m_size;
+  };
+
+  }
+}
+
+#endif
@@ -0,0 +1,61 @@
+/*
+ *  libautomusic (Library for Image-based Algorithmic Musical Composition)
+ *  Copyright (C) 2018, automusic.
+ *
+ *  THIS PROJECT IS FREE SOFTWARE; YOU CAN REDISTRIBUTE IT AND/OR
+ *  MODIFY IT UNDER THE TERMS OF THE GNU LESSER GENERAL PUBLIC LICENSE(GPL)
+ *  AS PUBLISHED BY THE FREE SOFTWARE FOUNDATION; EITHER VERSION 2.1
+ *  OF THE LICENSE, OR (AT YOUR OPTION) ANY LATER VERSION.
+ *
+ *  THIS PROJECT IS DISTRIBUTED IN THE HOPE THAT IT WILL BE USEFUL,
+ *  BUT WITHOUT ANY WARRANTY; WITHOUT EVEN THE IMPLIED WARRANTY OF
+ *  MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE.  SEE THE GNU
+ *  LESSER GENERAL PUBLIC LICENSE FOR MORE DETAILS.
+ */
+#include <cstdio>
+#include <cstdarg>
+#include <mutex>
+
+#include "util-log.h"
+
+namespace autocomp
+{ namespace util
+  {
+
+static std::mutex log_mutex;
+static LogCallback log_callback = 0l;
+static void *log_opaque = 0l;
+
+void set_log_callback(LogCallback callback, void *opaque)
+{
+  std::lock_guard<std::mutex> lock(log_mutex);
+  log_callback = callback;
+  log_opaque = opaque;
+}
+
+void log(LogLevel level, const char *format, ...)
+{
+  char message[1024];
+  va_list args;
+  va_start(args, format);
+  std::vsnprintf(message, sizeof message, format, args);
+  va_end(args);
+
+  /*
+   * The callback is called without the lock held, so that it may call back into the library.
+   */
+  LogCallback callback;
+  void *opaque;
+  {
+    std::lock_guard<std::mutex> lock(log_mutex);
+    callback = log_callback;
+    opaque = log_opaque;
+  }
+  if( callback )
+    callback(opaque, level, message);
+  else if( level <= LOG_WARNING )
+    std::fprintf(stderr, "%s\n", message);
+}
+
+  }
+}
@@ -0,0 +1,53 @@
+/*
+ *  libautomusic (Library for Image-based Algorithmic Musical Composition)
+ *  Copyright (C) 2018, automusic.
+ *
+ *  THIS PROJECT IS FREE SOFTWARE; YOU CAN REDISTRIBUTE IT AND/OR
+ *  MODIFY IT UNDER THE TERMS OF THE GNU LESSER GENERAL PUBLIC LICENSE(GPL)
+ *  AS PUBLISHED BY THE FREE SOFTWARE FOUNDATION; EITHER VERSION 2.1
+ *  OF THE LICENSE, OR (AT YOUR OPTION) ANY LATER VERSION.
+ *
+ *  THIS PROJECT IS DISTRIBUTED IN THE HOPE THAT IT WILL BE USEFUL,
+ *  BUT WITHOUT ANY WARRANTY; WITHOUT EVEN THE IMPLIED WARRANTY OF
+ *  MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE.  SEE THE GNU
+ *  LESSER GENERAL PUBLIC LICENSE FOR MORE DETAILS.
+ */
+#ifndef UTIL_LOG_H
+#define UTIL_LOG_H
+
+namespace autocomp
+{ namespace util
+  {
+
+/*
+ * Levels of the messages, the same values as LIBAM_LOG_*
+ */
+enum LogLevel
+{
+  LOG_ERROR = 0,
+  LOG_WARNING = 1,
+  LOG_INFO = 2
+};
+
+typedef void (*LogCallback)(void *opaque, int level, const char *message);
+
+/**
+ * @brief Set the receiver of all the messages of the library.
+ * @param callback Receiver of the messages, NULL = print the warnings and errors to stderr.
+ */
+void set_log_callback(LogCallback callback, void *opaque);
+
+/**
+ * @brief Format and send a message to the receiver.
+ * This is safe to be called concurrently, the receiver is called by one thread at a time.
+ */
+void log(LogLevel level, const char *format, ...)
+#ifdef __GNUC__
+  __attribute__((format(printf, 2, 3)))
+#endif
+  ;
+
+  }
+}
+
+#endif
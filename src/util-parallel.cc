@@ -0,0 +1,157 @@
+/*
+ *  libautomusic (Library for Image-based Algorithmic Musical Composition)
+ *  Copyright (C) 2018, automusic.
+ *
+ *  THIS PROJECT IS FREE SOFTWARE; YOU CAN REDISTRIBUTE IT AND/OR
+ *  MODIFY IT UNDER THE TERMS OF THE GNU LESSER GENERAL PUBLIC LICENSE(GPL)
+ *  AS PUBLISHED BY THE FREE SOFTWARE FOUNDATION; EITHER VERSION 2.1
+ *  OF THE LICENSE, OR (AT YOUR OPTION) ANY LATER VERSION.
+ *
+ *  THIS PROJECT IS DISTRIBUTED IN THE HOPE THAT IT WILL BE USEFUL,
+ *  BUT WITHOUT ANY WARRANTY; WITHOUT EVEN THE IMPLIED WARRANTY OF
+ *  MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE.  SEE THE GNU
+ *  LESSER GENERAL PUBLIC LICENSE FOR MORE DETAILS.
+ */
+#include <algorithm>
+
+#include "util-parallel.h"
+
+namespace autocomp
+{ namespace util
+  {
+
+int worker_count(int threads)
+{
+  if( threads > 0 )
+    return threads;
+  unsigned int cpus = std::thread::hardware_concurrency();
+  return cpus ? int(cpus) : 1;
+}
+
+/**
+ * @param threads Number of threads running the batches, the caller thread included.
+ * 0 = the number of processors, 1 = run in the caller thread.
+ */
+ThreadPool::ThreadPool(int threads)
+    : m_threads(threads),
+      m_batch(0),
+      m_stop(false),
+      m_fn(0l),
+      m_count(0),
+      m_next(0),
+      m_busy(0)
+{
+}
+
+ThreadPool::~ThreadPool()
+{
+  stopWorkers();
+}
+
+void ThreadPool::setThreads(int threads)
+{
+  if( threads == m_threads )
+    return;
+  stopWorkers();
+  m_threads = threads;
+}
+
+void ThreadPool::stopWorkers()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_wakeup.notify_all();
+  for(std::size_t i=0; i < m_workers.size(); i++)
+    m_workers[i].join();
+  m_workers.clear();
+  m_stop = false;
+}
+
+/**
+ * @brief Call fn(0) ... fn(count-1) concurrently on the workers and the caller thread.
+ * Items are taken in ascending order, and fn must not depend on the order of completion.
+ * Return after all the items were done. If fn throws, the remaining items are skipped
+ * and the first exception is thrown again in the caller thread.
+ */
+void ThreadPool::run(std::size_t count, const std::function<void(std::size_t)> &fn)
+{
+  std::size_t threads = std::size_t(worker_count(m_threads));
+  if( std::min(threads, count) <= 1 )
+    {
+      for(std::size_t i=0; i < count; i++)
+        fn(i);
+      return;
+    }
+
+  while( m_workers.size() < threads - 1 )
+    m_workers.emplace_back(&ThreadPool::workerMain, this, m_batch);
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_fn = &fn;
+    m_count = count;
+    m_next = 0;
+    m_busy = m_workers.size();
+    m_error = std::exception_ptr();
+    ++m_batch;
+  }
+  m_wakeup.notify_all();
+  runItems();
+
+  std::exception_ptr error;
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_finished.wait(lock, [this]() { return m_busy == 0; });
+    m_fn = 0l;
+    std::swap(error, m_error);
+  }
+  if( error )
+    std::rethrow_exception(error);
+}
+
+void ThreadPool::workerMain(uint64_t batch)
+{
+  for(;;)
+    {
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_wakeup.wait(lock, [&]() { return m_stop || m_batch != batch; });
+        if( m_stop )
+          return;
+        batch = m_batch;
+      }
+      runItems();
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if( --m_busy == 0 )
+          m_finished.notify_one();
+      }
+    }
+}
+
+void ThreadPool::runItems()
+{
+  try
+    {
+      for(std::size_t i = m_next++; i < m_count; i = m_next++)
+        (*m_fn)(i);
+    }
+  catch( ... )
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if( !m_error )
+        m_error = std::current_exception();
+      m_next = m_count; /* skip the remaining items */
+    }
+}
+
+void parallel_for(std::size_t count, int threads, const std::function<void(std::size_t)> &fn)
+{
+  ThreadPool pool(threads);
+  pool.run(count, fn);
+}
+
+  }
+}
@@ -0,0 +1,90 @@
+/*
+ *  libautomusic (Library for Image-based Algorithmic Musical Composition)
+ *  Copyright (C) 2018, automusic.
+ *
+ *  THIS PROJECT IS FREE SOFTWARE; YOU CAN REDISTRIBUTE IT AND/OR
+ *  MODIFY IT UNDER THE TERMS OF THE GNU LESSER GENERAL PUBLIC LICENSE(GPL)
+ *  AS PUBLISHED BY THE FREE SOFTWARE FOUNDATION; EITHER VERSION 2.1
+ *  OF THE LICENSE, OR (AT YOUR OPTION) ANY LATER VERSION.
+ *
+ *  THIS PROJECT IS DISTRIBUTED IN THE HOPE THAT IT WILL BE USEFUL,
+ *  BUT WITHOUT ANY WARRANTY; WITHOUT EVEN THE IMPLIED WARRANTY OF
+ *  MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE.  SEE THE GNU
+ *  LESSER GENERAL PUBLIC LICENSE FOR MORE DETAILS.
+ */
+#ifndef UTIL_PARALLEL_H
+#define UTIL_PARALLEL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace autocomp
+{ namespace util
+  {
+
+/**
+ * @brief Get the number of worker threads to use.
+ * @param threads Requested number of threads. 0 = the number of processors.
+ */
+int worker_count(int threads);
+
+/**
+ * @brief Worker threads kept over the calls of run(), so that small batches do not pay for starting threads.
+ * The workers are started at the first batch needing them and stopped with the pool.
+ * One batch runs at a time, and fn must not run another batch on the same pool.
+ */
+class ThreadPool
+{
+public:
+  explicit ThreadPool(int threads);
+  ~ThreadPool();
+
+  inline int threads() const { return m_threads; }
+  void setThreads(int threads);
+  void run(std::size_t count, const std::function<void(std::size_t)> &fn);
+
+private:
+  ThreadPool(const ThreadPool &);
+  ThreadPool &operator=(const ThreadPool &);
+
+  void stopWorkers();
+  void workerMain(uint64_t batch);
+  void runItems();
+
+private:
+  int m_threads; /* 0 = the number of processors, 1 = run in the caller thread */
+  std::vector<std::thread> m_workers;
+  std::mutex m_mutex;
+  std::condition_variable m_wakeup;   /* a batch is started or the workers are stopped */
+  std::condition_variable m_finished; /* all the workers are done with the batch */
+  uint64_t m_batch;
+  bool m_stop;
+
+  /*
+   * Current batch, written by the caller thread under the lock before waking up the workers.
+   */
+  const std::function<void(std::size_t)> *m_fn;
+  std::size_t m_count;
+  std::atomic<std::size_t> m_next;
+  std::size_t m_busy; /* workers still in the batch */
+  std::exception_ptr m_error;
+};
+
+/**
+ * @brief Call fn(0) ... fn(count-1) concurrently on a set of worker threads started for this call.
+ * @see ThreadPool::run()
+ * @param threads Number of worker threads, 0 = the number of processors, 1 = run in the caller thread.
+ */
+void parallel_for(std::size_t count, int threads, const std::function<void(std::size_t)> &fn);
+
+  }
+}
+
+#endif
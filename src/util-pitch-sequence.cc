@@ -0,0 +1,143 @@
+/*
+ *  libautomusic (Library for Image-based Algorithmic Musical Composition)
+ *  Copyright (C) 2018, automusic.
+ *
+ *  THIS PROJECT IS FREE SOFTWARE; YOU CAN REDISTRIBUTE IT AND/OR
+ *  MODIFY IT UNDER THE TERMS OF THE GNU LESSER GENERAL PUBLIC LICENSE(GPL)
+ *  AS PUBLISHED BY THE FREE SOFTWARE FOUNDATION; EITHER VERSION 2.1
+ *  OF THE LICENSE, OR (AT YOUR OPTION) ANY LATER VERSION.
+ *
+ *  THIS PROJECT IS DISTRIBUTED IN THE HOPE THAT IT WILL BE USEFUL,
+ *  BUT WITHOUT ANY WARRANTY; WITHOUT EVEN THE IMPLIED WARRANTY OF
+ *  MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE.  SEE THE GNU
+ *  LESSER GENERAL PUBLIC LICENSE FOR MORE DETAILS.
+ */
+#include "util-pitch-sequence.h"
+
+namespace autocomp
+{ namespace util
+  {
+
+static inline uint32_t zigzag(int32_t value)
+{
+  return (uint32_t(value) << 1) ^ uint32_t(value >> 31);
+}
+
+static inline int32_t unzigzag(uint32_t value)
+{
+  return int32_t(value >> 1) ^ -int32_t(value & 1);
+}
+
+static inline std::size_t varint_size(uint32_t value)
+{
+  std::size_t size = 1;
+  while( value >= 0x80 )
+    {
+      value >>= 7;
+      ++size;
+    }
+  return size;
+}
+
+static inline uint8_t *put_varint(uint8_t *dst, uint32_t value)
+{
+  while( value >= 0x80 )
+    {
+      *dst++ = uint8_t(value | 0x80);
+      value >>= 7;
+    }
+  *dst++ = uint8_t(value);
+  return dst;
+}
+
+static inline const uint8_t *get_varint(const uint8_t *src, uint32_t *value)
+{
+  uint32_t result = 0;
+  for(unsigned int shift=0; ; shift += 7)
+    {
+      uint8_t byte = *src++;
+      result |= uint32_t(byte & 0x7f) << shift;
+      if( !(byte & 0x80) )
+        break;
+    }
+  *value = result;
+  return src;
+}
+
+/**
+ * @brief Decode all the notes into a vector, which is cleared first.
+ */
+void PitchSequence::decode(std::vector<PitchNote> &dst) const
+{
+  dst.clear();
+  dst.reserve(m_size);
+  for(const_iterator it = begin(); it != end(); ++it)
+    dst.push_back(*it);
+}
+
+/**
+ * @brief Get the number of the encoded bytes, skipping the notes without decoding them.
+ */
+std::size_t PitchSequence::byteSize() const
+{
+  const uint8_t *cursor = m_data;
+  for(std::size_t i=0; i < m_size; i++)
+    {
+      cursor += 2; /* pitch and velocity */
+      while( *cursor++ & 0x80 ) {}
+      while( *cursor++ & 0x80 ) {}
+    }
+  return cursor - m_data;
+}
+
+/**
+ * @brief Get the number of bytes to encode the notes.
+ */
+std::size_t PitchSequence::encodedSize(const PitchNote *src, std::size_t count)
+{
+  std::size_t size = 0;
+  int32_t prev_start = 0;
+  for(std::size_t i=0; i < count; i++)
+    {
+      size += 2 + varint_size(zigzag(src[i].start - prev_start)) + varint_size(zigzag(src[i].end - src[i].start));
+      prev_start = src[i].start;
+    }
+  return size;
+}
+
+/**
+ * @brief Encode the notes to a buffer of encodedSize() bytes.
+ * @return The end of the encoded bytes.
+ */
+uint8_t *PitchSequence::encode(uint8_t *dst, const PitchNote *src, std::size_t count)
+{
+  int32_t prev_start = 0;
+  for(std::size_t i=0; i < count; i++)
+    {
+      *dst++ = src[i].pitch;
+      *dst++ = src[i].velocity;
+      dst = put_varint(dst, zigzag(src[i].start - prev_start));
+      dst = put_varint(dst, zigzag(src[i].end - src[i].start));
+      prev_start = src[i].start;
+    }
+  return dst;
+}
+
+/**
+ * @brief Decode a note following the one starting at prev_start.
+ * @return The beginning of the next note.
+ */
+const uint8_t *PitchSequence::decodeNote(const uint8_t *src, int32_t prev_start, PitchNote *dst)
+{
+  uint32_t delta, duration;
+  dst->pitch = src[0];
+  dst->velocity = src[1];
+  src = get_varint(src + 2, &delta);
+  src = get_varint(src, &duration);
+  dst->start = prev_start + unzigzag(delta);
+  dst->end = dst->start + unzigzag(duration);
+  return src;
+}
+
+  }
+}
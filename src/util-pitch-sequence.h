@@ -0,0 +1,115 @@
+/*
+ *  libautomusic (Library for Image-based Algorithmic Musical Composition)
+ *  Copyright (C) 2018, automusic.
+ *
+ *  THIS PROJECT IS FREE SOFTWARE; YOU CAN REDISTRIBUTE IT AND/OR
+ *  MODIFY IT UNDER THE TERMS OF THE GNU LESSER GENERAL PUBLIC LICENSE(GPL)
+ *  AS PUBLISHED BY THE FREE SOFTWARE FOUNDATION; EITHER VERSION 2.1
+ *  OF THE LICENSE, OR (AT YOUR OPTION) ANY LATER VERSION.
+ *
+ *  THIS PROJECT IS DISTRIBUTED IN THE HOPE THAT IT WILL BE USEFUL,
+ *  BUT WITHOUT ANY WARRANTY; WITHOUT EVEN THE IMPLIED WARRANTY OF
+ *  MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE.  SEE THE GNU
+ *  LESSER GENERAL PUBLIC LICENSE FOR MORE DETAILS.
+ */
+#ifndef UTIL_PITCH_SEQUENCE_H
+#define UTIL_PITCH_SEQUENCE_H
+
+#include <cstddef>
+#include <iterator>
+#include <vector>
+
+#include "typedefs.h"
+
+namespace autocomp
+{ namespace util
+  {
+
+/**
+ * @brief Read-only view of a sequence of pitch notes in the compact encoding.
+ * Each note takes its pitch and velocity bytes, followed by the start as a delta from
+ * the start of the previous note and the duration (end - start), both of which are
+ * zigzag varints of 64th notes. Most of the notes take 4 bytes instead of 12 of PitchNote.
+ * The notes are decoded while iterating, the view does not own the bytes.
+ */
+class PitchSequence
+{
+public:
+  class const_iterator
+  {
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef PitchNote value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const PitchNote *pointer;
+    typedef const PitchNote &reference;
+
+    const_iterator()
+      : m_cursor(0l),
+        m_index(0),
+        m_count(0)
+    {}
+    const_iterator(const uint8_t *cursor, std::size_t index, std::size_t count)
+      : m_cursor(cursor),
+        m_index(index),
+        m_count(count)
+    {
+      if( m_index < m_count )
+        m_cursor = decodeNote(m_cursor, 0, &m_note);
+    }
+
+    inline reference operator*() const { return m_note; }
+    inline pointer operator->() const { return &m_note; }
+    inline const_iterator &operator++()
+      {
+        if( ++m_index < m_count )
+          m_cursor = decodeNote(m_cursor, m_note.start, &m_note);
+        return *this;
+      }
+    inline const_iterator operator++(int)
+      {
+        const_iterator prev = *this;
+        ++(*this);
+        return prev;
+      }
+    inline bool operator==(const const_iterator &rhs) const { return m_index == rhs.m_index; }
+    inline bool operator!=(const const_iterator &rhs) const { return m_index != rhs.m_index; }
+
+  private:
+    const uint8_t *m_cursor;
+    std::size_t m_index;
+    std::size_t m_count;
+    PitchNote m_note;
+  };
+
+  PitchSequence()
+    : m_data(0l),
+      m_size(0)
+  {}
+  PitchSequence(const uint8_t *data, std::size_t size)
+    : m_data(data),
+      m_size(size)
+  {}
+
+  inline std::size_t size() const { return m_size; }
+  inline bool empty() const { return m_size == 0; }
+  inline const uint8_t *data() const { return m_data; }
+  inline const_iterator begin() const { return const_iterator(m_data, 0, m_size); }
+  inline const_iterator end() const { return const_iterator(m_data, m_size, m_size); }
+
+  void decode(std::vector<PitchNote> &dst) const;
+  std::size_t byteSize() const;
+
+  static std::size_t encodedSize(const PitchNote *src, std::size_t count);
+  static uint8_t *encode(uint8_t *dst, const PitchNote *src, std::size_t count);
+  static const uint8_t *decodeNote(const uint8_t *src, int32_t prev_start, PitchNote *dst);
+
+private:
+  const uint8_t *m_data;
+  std::size_t m_size; /* the number of notes */
+};
+
+  }
+}
+
+#endif
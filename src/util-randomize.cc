@@ -62,7 +62,6 @@
 #define C	0xB
 #define SET3(x, x0, x1, x2)	((x)[0] = (x0), (x)[1] = (x1), (x)[2] = (x2))
 #define SETLOW(x, y, n) SET3(x, LOW((y)[n]), LOW((y)[(n)+1]), LOW((y)[(n)+2]))
-#define SEED(x0, x1, x2) (SET3(x, x0, x1, x2), SET3(a, A0, A1, A2), c = C)
 #define REST(v)	for (i = 0; i < 3; i++) { xsubi[i] = x[i]; x[i] = temp[i]; } \
 		return (v);
 #define HI_BIT	(1L << (2 * N - 1))
@@ -71,33 +70,66 @@ namespace autocomp
 { namespace util
   {
 
-static uint32_t x[3] = { X0, X1, X2 }, a[3] = { A0, A1, A2 }, c = C;
+Random::Random()
+{
+  SET3(m_x, X0, X1, X2);
+  SET3(m_a, A0, A1, A2);
+  m_c = C;
+}
 
-static void rand_next(void) {
+int32_t Random::next()
+{
   uint32_t p[2], q[2], r[2], carry0, carry1;
 
-  MUL(a[0], x[0], p);
-  ADDEQU(p[0], c, carry0);
+  MUL(m_a[0], m_x[0], p);
+  ADDEQU(p[0], m_c, carry0);
   ADDEQU(p[1], carry0, carry1);
-  MUL(a[0], x[1], q);
+  MUL(m_a[0], m_x[1], q);
   ADDEQU(p[1], q[0], carry0);
-  MUL(a[1], x[0], r);
-  x[2] = LOW(carry0 + carry1 + CARRY(p[1], r[0]) + q[1] + r[1] +
-          a[0] * x[2] + a[1] * x[1] + a[2] * x[0]);
-  x[1] = LOW(p[1] + r[0]);
-  x[0] = LOW(p[0]);
-}
+  MUL(m_a[1], m_x[0], r);
+  m_x[2] = LOW(carry0 + carry1 + CARRY(p[1], r[0]) + q[1] + r[1] +
+          m_a[0] * m_x[2] + m_a[1] * m_x[1] + m_a[2] * m_x[0]);
+  m_x[1] = LOW(p[1] + r[0]);
+  m_x[0] = LOW(p[0]);
 
-int32_t get_rand() {
-  rand_next();
-  int32_t prand = (((int32_t)x[2] << (N - 1)) + (x[1] >> 1));
+  int32_t prand = (((int32_t)m_x[2] << (N - 1)) + (m_x[1] >> 1));
   assert(prand >= 0);
   return prand;
 }
 
-void set_rand_seed(int32_t seedval)
+void Random::seed(int32_t seedval)
+{
+  SET3(m_x, X0, LOW(seedval), HIGH(seedval));
+  SET3(m_a, A0, A1, A2);
+  m_c = C;
+}
+
+/* SplitMix64 finalizer */
+static inline uint64_t mix64(uint64_t z)
+{
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+#define GOLDEN_GAMMA 0x9E3779B97F4A7C15ULL
+
+/**
+ * @param revision Count of the recompositions of the form, each one drawing a different stream.
+ */
+RandomStream::RandomStream(int32_t seed, uint32_t track, uint32_t form, RandomStage stage, uint32_t revision /*= 0*/)
+    : m_counter(0)
+{
+  m_key = mix64((uint64_t)(uint32_t)seed * GOLDEN_GAMMA);
+  m_key = mix64(m_key ^ (((uint64_t)track << 32) | form));
+  m_key = mix64(m_key ^ ((uint64_t)stage * GOLDEN_GAMMA));
+  if( revision )
+    m_key = mix64(m_key ^ ((uint64_t)revision << 32));
+}
+
+int32_t RandomStream::next()
 {
-  SEED(X0, LOW(seedval), HIGH(seedval));
+  return (int32_t)(mix64(m_key + (++m_counter) * GOLDEN_GAMMA) >> 33);
 }
 
   }
@@ -24,13 +24,54 @@ namespace autocomp
 
 #define PRAND_MAX 2147483647
 
-void set_rand_seed(int32_t seed);
-int32_t get_rand();
+/**
+ * @brief 48-bit linear congruential generator, the same sequence as drand48() on every system.
+ * Each composition owns its own generator, so that separate contexts neither share nor race on the state.
+ */
+class Random
+{
+public:
+  Random();
 
-template <typename T>
-  static inline T random_choice(const std::vector<T> &src)
+  void seed(int32_t seed);
+  int32_t next();
+
+private:
+  uint32_t m_x[3];
+  uint32_t m_a[3];
+  uint32_t m_c;
+};
+
+/**
+ * @brief Stages of the composition drawing from their own streams, @see RandomStream
+ */
+enum RandomStage
+{
+  RANDOM_STAGE_FIGURE = 0,
+  RANDOM_STAGE_VELOCITY
+};
+
+/**
+ * @brief Counter-based generator whose stream is keyed by (seed, track, form, stage).
+ * The n-th draw is a pure function of the key and n, so a track or form yields the same numbers
+ * whatever order, or thread, the other tracks and forms are composed in.
+ */
+class RandomStream
+{
+public:
+  RandomStream(int32_t seed, uint32_t track, uint32_t form, RandomStage stage, uint32_t revision = 0);
+
+  int32_t next();
+
+private:
+  uint64_t m_key;
+  uint64_t m_counter;
+};
+
+template <typename R, typename T>
+  static inline T random_choice(R &random, const std::vector<T> &src)
     {
-      std::size_t _rand_index = (std::size_t)( (src.size()-1) * ((float)get_rand()/PRAND_MAX) );
+      std::size_t _rand_index = (std::size_t)( (src.size()-1) * ((float)random.next()/PRAND_MAX) );
       return src[_rand_index];
     }
 
@@ -44,10 +85,10 @@ template <typename T>
       return src[(std::size_t)( (src.size()-1) * factor )];
     }
 
-template <typename T>
-  static inline T random_choice(const T *src, std::size_t size)
+template <typename R, typename T>
+  static inline T random_choice(R &random, const T *src, std::size_t size)
     {
-      std::size_t _rand_index = (std::size_t)( (size-1) * ((float)get_rand()/PRAND_MAX) );
+      std::size_t _rand_index = (std::size_t)( (size-1) * ((float)random.next()/PRAND_MAX) );
       return src[_rand_index];
     }
 
@@ -55,20 +96,108 @@ template <typename T>
  * @brief Generate a random number ranged from 0 to size-1.
  * This is often used to generate a index for a liner addressed container.
  */
-static inline std::size_t random_range(std::size_t size)
-  {
-    return (std::size_t)( (size-1) * ((float)get_rand()/PRAND_MAX) );
-  }
+template <typename R>
+  static inline std::size_t random_range(R &random, std::size_t size)
+    {
+      return (std::size_t)( (size-1) * ((float)random.next()/PRAND_MAX) );
+    }
 
 /**
  * @brief Generate a random number in the range of [start, end].
  */
-template <typename T>
-  static inline T random_range(T start, T end)
+template <typename T, typename R>
+  static inline T random_range(R &random, T start, T end)
     {
-      return start + (T)( (end-start) * ((float)get_rand()/PRAND_MAX) );
+      return start + (T)( (end-start) * ((float)random.next()/PRAND_MAX) );
     }
 
+/**
+ * @brief Weighted sampling of items with Vose's alias method.
+ * Building the table is linear in the number of items, then each draw costs a single random number.
+ * The same item may be added several times, its probability is the sum of its weights.
+ */
+template <typename T>
+  class WeightedSampler
+  {
+  public:
+    WeightedSampler() : m_total(0) {}
+
+    void clear()
+      {
+        m_items.clear();
+        m_weights.clear();
+        m_prob.clear();
+        m_alias.clear();
+        m_total = 0;
+      }
+
+    void add(const T &item, uint32_t weight)
+      {
+        if( weight == 0 )
+          return;
+        m_items.push_back(item);
+        m_weights.push_back(weight);
+        m_total += weight;
+      }
+
+    /**
+     * @brief Build the alias table, call it once all the items are added and before choose().
+     */
+    void build()
+      {
+        std::size_t n = m_items.size();
+        std::vector<double> scaled(n);
+        std::vector<uint32_t> small, large;
+        m_prob.assign(n, 1.0);
+        m_alias.resize(n);
+
+        for(std::size_t i=0; i < n; i++)
+          {
+            m_alias[i] = i;
+            scaled[i] = (double)m_weights[i] * n / m_total;
+            if( scaled[i] < 1.0 )
+              small.push_back(i);
+            else
+              large.push_back(i);
+          }
+        while( small.size() && large.size() )
+          {
+            uint32_t s = small.back(), l = large.back();
+            small.pop_back();
+            m_prob[s] = scaled[s];
+            m_alias[s] = l;
+            scaled[l] -= 1.0 - scaled[s];
+            if( scaled[l] < 1.0 )
+              {
+                large.pop_back();
+                small.push_back(l);
+              }
+          }
+        /* the remaining columns are full, up to rounding errors */
+      }
+
+    template <typename R>
+      const T &choose(R &random) const
+        {
+          double u = (double)random.next() / ((double)PRAND_MAX + 1) * m_items.size();
+          std::size_t column = (std::size_t)u;
+          return (u - column) < m_prob[column] ? m_items[column] : m_items[m_alias[column]];
+        }
+
+    inline bool empty() const { return m_items.empty(); }
+    inline std::size_t size() const { return m_items.size(); }
+    inline uint64_t totalWeight() const { return m_total; }
+    inline const T &item(std::size_t i) const { return m_items[i]; }
+    inline uint32_t weight(std::size_t i) const { return m_weights[i]; }
+
+  private:
+    std::vector<T> m_items;
+    std::vector<uint32_t> m_weights;
+    std::vector<double> m_prob;
+    std::vector<uint32_t> m_alias;
+    uint64_t m_total;
+  };
+
   }
 }
 